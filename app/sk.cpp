@@ -1,182 +1,2034 @@
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
+#include <fcntl.h>
 #include <filesystem>
-#include <regex>
+#include <map>
+#include <optional>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
 
+#include "alloc.hh"
 #include "args.hh"
+#include "compdb.hh"
 #include "fmt.hh"
+#include "grep.hh"
+#include "json.hh"
 #include "lua.hh"
+#include "parallel.hh"
+#include "path.hh"
+#include "process.hh"
+#include "sync.hh"
 #include "task.hh"
+#include "trace.hh"
+#include "workspace.hh"
 
 namespace dk = devkit;
 namespace fs = std::filesystem;
 
+// <store>/cache, set once the store is known.
+static fs::path cache_dir;
+
+static dk::LuaResult<bool>
+set_env(const char* name, const char* value, bool overwrite)
+{
+  if (setenv(name, value, overwrite) != 0) {
+    return dk::LuaFailure{ dk::fmt(
+      "Failed to set environment variable '{}'", name) };
+  }
+  return true;
+}
+
+// Without a third argument sh.set_env overwrites, an explicit nil keeps the
+// value like false does.
+extern "C" int
+lua_set_env(lua_State* L)
+{
+  if (lua_isnone(L, 3)) {
+    lua_settop(L, 2);
+    lua_pushboolean(L, 1);
+  }
+  return dk::lua_function<set_env>(L);
+}
+
+static std::optional<std::string_view>
+get_env(const char* name)
+{
+  const char* value = std::getenv(name);
+  if (value == nullptr || *value == '\0') {
+    return std::nullopt;
+  }
+  return value;
+}
+
+static std::map<std::string_view, std::vector<std::string>>
+list_dir(const char* path)
+{
+  auto dirs = std::vector<std::string>{};
+  auto files = std::vector<std::string>{};
+
+  for (const auto& entry : std::filesystem::directory_iterator(path)) {
+    if (entry.is_directory()) {
+      dirs.push_back(entry.path().filename().string());
+    }
+    else if (entry.is_regular_file()) {
+      files.push_back(entry.path().filename().string());
+    }
+  }
+
+  return { { "dirs", std::move(dirs) }, { "files", std::move(files) } };
+}
+
+static bool
+exists(const char* path)
+{
+  return std::filesystem::exists(path);
+}
+
+static std::string_view
+to_string_view(lua_State* L, int index)
+{
+  size_t size = 0;
+  const char* str = lua_tolstring(L, index, &size);
+  return { str, size };
+}
+
+static std::string_view
+home_dir()
+{
+  const char* home = std::getenv("HOME");
+  return home != nullptr ? home : "";
+}
+
+static void
+push_parts(lua_State* L, const dk::PathParts& parts)
+{
+  lua_createtable(L, 0, 3);
+  lua_pushlstring(L, parts.dir.data(), parts.dir.size());
+  lua_setfield(L, -2, "dir");
+  lua_pushlstring(L, parts.name.data(), parts.name.size());
+  lua_setfield(L, -2, "name");
+  lua_pushlstring(L, parts.ext.data(), parts.ext.size());
+  lua_setfield(L, -2, "ext");
+}
+
+extern "C" int
+lua_join(lua_State* L)
+{
+  int nargs = lua_gettop(L);
+  auto joined_path = std::string{};
+
+  for (int i = 1; i <= nargs; ++i) {
+    if (!lua_isstring(L, i)) {
+      lua_pushstring(L, "Invalid argument. All arguments must be strings.");
+      lua_error(L);
+      return 0;
+    }
+
+    dk::append_path(joined_path, to_string_view(L, i), home_dir());
+  }
+
+  lua_pushlstring(L, joined_path.data(), joined_path.size());
+
+  return 1;
+}
+
+extern "C" int
+lua_split_path(lua_State* L)
+{
+  if (lua_gettop(L) != 1 || !lua_isstring(L, 1)) {
+    lua_pushstring(L, "Invalid argument. Expected a path string.");
+    lua_error(L);
+    return 0;
+  }
+
+  push_parts(L, dk::split_path(to_string_view(L, 1)));
+
+  return 1;
+}
+
+// The *_many variants take an array and return an array of the same length,
+// reusing one buffer for the whole batch.
+
+static bool
+check_array(lua_State* L, int index, const char* message)
+{
+  if (!lua_istable(L, index)) {
+    lua_pushstring(L, message);
+    lua_error(L);
+    return false;
+  }
+  return true;
+}
+
+// Raises an argument error naming the first element of the array at `arg`
+// that is not a string. It runs before the batch allocates its buffers, which
+// the error would skip. With `nested`, elements may be arrays of strings too.
+static void
+check_strings(lua_State* L, int arg, bool nested = false)
+{
+  const auto size = lua_rawlen(L, arg);
+  for (size_t i = 1; i <= size; ++i) {
+    lua_rawgeti(L, arg, i);
+    if (nested && lua_istable(L, -1)) {
+      const auto parts = lua_rawlen(L, -1);
+      for (size_t j = 1; j <= parts; ++j) {
+        lua_rawgeti(L, -1, j);
+        if (!lua_isstring(L, -1)) {
+          const auto* message =
+            lua_pushfstring(L,
+                            "string expected at index %I.%I, got %s",
+                            static_cast<lua_Integer>(i),
+                            static_cast<lua_Integer>(j),
+                            luaL_typename(L, -1));
+          luaL_argerror(L, arg, message);
+        }
+        lua_pop(L, 1);
+      }
+    }
+    else if (!lua_isstring(L, -1)) {
+      const auto* message =
+        lua_pushfstring(L,
+                        "string expected at index %I, got %s",
+                        static_cast<lua_Integer>(i),
+                        luaL_typename(L, -1));
+      luaL_argerror(L, arg, message);
+    }
+    lua_pop(L, 1);
+  }
+}
+
+extern "C" int
+lua_split_many(lua_State* L)
+{
+  if (!check_array(L, 1, "Invalid argument. Expected an array of paths.")) {
+    return 0;
+  }
+  check_strings(L, 1);
+
+  const auto size = lua_rawlen(L, 1);
+  lua_createtable(L, size, 0);
+
+  for (size_t i = 1; i <= size; ++i) {
+    lua_rawgeti(L, 1, i);
+    const auto path = to_string_view(L, -1);
+    push_parts(L, dk::split_path(path));
+    lua_rawseti(L, -3, i);
+    lua_pop(L, 1);
+  }
+
+  return 1;
+}
+
+extern "C" int
+lua_join_many(lua_State* L)
+{
+  if (!check_array(L,
+                   1,
+                   "Invalid argument. Expected an array of paths or of arrays "
+                   "of path parts.")) {
+    return 0;
+  }
+  check_strings(L, 1, true);
+
+  const auto base = lua_isstring(L, 2) ? to_string_view(L, 2) : "";
+  const auto home = home_dir();
+  const auto size = lua_rawlen(L, 1);
+  auto out = std::string{};
+
+  lua_createtable(L, size, 0);
+
+  for (size_t i = 1; i <= size; ++i) {
+    out.clear();
+    if (!base.empty()) {
+      dk::append_path(out, base, home);
+    }
+
+    lua_rawgeti(L, 1, i);
+    if (lua_istable(L, -1)) {
+      const auto parts = lua_rawlen(L, -1);
+      for (size_t j = 1; j <= parts; ++j) {
+        lua_rawgeti(L, -1, j);
+        dk::append_path(out, to_string_view(L, -1), home);
+        lua_pop(L, 1);
+      }
+    }
+    else {
+      dk::append_path(out, to_string_view(L, -1), home);
+    }
+    lua_pop(L, 1);
+
+    lua_pushlstring(L, out.data(), out.size());
+    lua_rawseti(L, -2, i);
+  }
+
+  return 1;
+}
+
+extern "C" int
+lua_normalize_many(lua_State* L)
+{
+  if (!check_array(L, 1, "Invalid argument. Expected an array of paths.")) {
+    return 0;
+  }
+  check_strings(L, 1);
+
+  const auto size = lua_rawlen(L, 1);
+  auto out = std::string{};
+
+  lua_createtable(L, size, 0);
+
+  for (size_t i = 1; i <= size; ++i) {
+    lua_rawgeti(L, 1, i);
+    dk::normalize_path(out, to_string_view(L, -1));
+    lua_pop(L, 1);
+
+    lua_pushlstring(L, out.data(), out.size());
+    lua_rawseti(L, -2, i);
+  }
+
+  return 1;
+}
+
+extern "C" int
+lua_relative_many(lua_State* L)
+{
+  if (!check_array(L, 1, "Invalid argument. Expected an array of paths.") ||
+      !lua_isstring(L, 2)) {
+    lua_pushstring(L, "Invalid argument. Expected a base path.");
+    lua_error(L);
+    return 0;
+  }
+  check_strings(L, 1);
+
+  const auto base = to_string_view(L, 2);
+  const auto size = lua_rawlen(L, 1);
+  auto out = std::string{};
+  auto scratch = std::string{};
+
+  lua_createtable(L, size, 0);
+
+  for (size_t i = 1; i <= size; ++i) {
+    lua_rawgeti(L, 1, i);
+    dk::relative_path(out, to_string_view(L, -1), base, scratch);
+    lua_pop(L, 1);
+
+    lua_pushlstring(L, out.data(), out.size());
+    lua_rawseti(L, -2, i);
+  }
+
+  return 1;
+}
+
+static bool
+get_field_bool(lua_State* L, int index, const char* key)
+{
+  lua_getfield(L, index, key);
+  const bool value = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return value;
+}
+
+static lua_Integer
+get_field_integer(lua_State* L, int index, const char* key)
+{
+  lua_getfield(L, index, key);
+  const auto value = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : 0;
+  lua_pop(L, 1);
+  return value;
+}
+
+// Like get_field_integer, but raises an error for a negative value so that it
+// can be stored in a size_t. Call it before any local owns memory, the error
+// does not unwind the C++ stack.
+static lua_Integer
+get_field_count(lua_State* L, int index, const char* key)
+{
+  const auto value = get_field_integer(L, index, key);
+  if (value < 0) {
+    luaL_error(L, "Invalid argument. Expected %s to be at least 0.", key);
+  }
+  return value;
+}
+
+static std::vector<std::string>
+get_paths(lua_State* L, int index)
+{
+  auto paths = std::vector<std::string>{};
+
+  if (lua_isstring(L, index)) {
+    paths.emplace_back(lua_tostring(L, index));
+  }
+  else if (lua_istable(L, index)) {
+    const auto size = lua_rawlen(L, index);
+    for (size_t i = 1; i <= size; ++i) {
+      lua_rawgeti(L, index, i);
+      if (lua_isstring(L, -1)) {
+        paths.emplace_back(lua_tostring(L, -1));
+      }
+      lua_pop(L, 1);
+    }
+  }
+
+  return paths;
+}
+
+extern "C" int
+lua_grep(lua_State* L)
+{
+  if (!lua_isstring(L, 1) || !(lua_isstring(L, 2) || lua_istable(L, 2))) {
+    lua_pushstring(
+      L,
+      "Invalid argument. Expected a pattern and a path or an array of paths.");
+    lua_error(L);
+    return 0;
+  }
+
+  auto options = dk::GrepOptions{};
+  int on_match = 0;
+
+  if (lua_istable(L, 3)) {
+    options.ignore_case = get_field_bool(L, 3, "ignore_case");
+    options.fixed = get_field_bool(L, 3, "fixed");
+    options.hidden = get_field_bool(L, 3, "hidden");
+    options.jobs = get_field_count(L, 3, "jobs");
+    options.max_count = get_field_count(L, 3, "max_count");
+
+    lua_getfield(L, 3, "on_match");
+    if (lua_isfunction(L, -1)) {
+      on_match = lua_gettop(L);
+    }
+    else {
+      lua_pop(L, 1);
+    }
+  }
+
+  const auto pattern = std::string{ lua_tostring(L, 1) };
+  const auto paths = get_paths(L, 2);
+
+  const auto grep = dk::Grep{ pattern, options };
+  if (!grep.error().empty()) {
+    lua_pushnil(L);
+    lua_pushstring(
+      L, dk::fmt("Invalid pattern '{}': {}", pattern, grep.error()).data());
+    return 2;
+  }
+
+  lua_newtable(L);
+  const int result = lua_gettop(L);
+  lua_Integer count = 0;
+  bool failed = false;
+
+  // Errors raised by on_match are held back until the workers are joined.
+  grep.run(paths, [&](const dk::GrepMatch& match) {
+    if (failed) {
+      return;
+    }
+
+    if (on_match != 0) {
+      lua_pushvalue(L, on_match);
+    }
+
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, match.path.c_str());
+    lua_setfield(L, -2, "path");
+    lua_pushinteger(L, match.line);
+    lua_setfield(L, -2, "line");
+    lua_pushinteger(L, match.column);
+    lua_setfield(L, -2, "column");
+    lua_pushlstring(L, match.text.data(), match.text.size());
+    lua_setfield(L, -2, "text");
+
+    count += 1;
+    if (on_match == 0) {
+      lua_rawseti(L, result, count);
+    }
+    else if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+      failed = true;
+    }
+  });
+
+  if (failed) {
+    lua_error(L);
+    return 0;
+  }
+
+  if (on_match != 0) {
+    lua_pushinteger(L, count);
+  }
+
+  return 1;
+}
+
+static int
+sync_paths(lua_State* L, bool force)
+{
+  if (lua_gettop(L) < 2 || !lua_isstring(L, 1) || !lua_isstring(L, 2)) {
+    lua_pushstring(
+      L, "Invalid argument. Expected a source and a destination path.");
+    lua_error(L);
+    return 0;
+  }
+
+  auto options = dk::SyncOptions{};
+  if (lua_istable(L, 3)) {
+    options.checksum = get_field_bool(L, 3, "checksum");
+    options.jobs = get_field_count(L, 3, "jobs");
+  }
+
+  const auto from = fs::path{ lua_tostring(L, 1) };
+  const auto to = fs::path{ lua_tostring(L, 2) };
+
+  auto ec = std::error_code{};
+  if (!fs::exists(fs::symlink_status(from, ec))) {
+    lua_pushnil(L);
+    lua_pushstring(
+      L, dk::fmt("Path '{}' does not exist", from.string()).data());
+    return 2;
+  }
+
+  const auto stats =
+    force ? dk::copy(from, to, options) : dk::sync(from, to, options);
+
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, stats.copied);
+  lua_setfield(L, -2, "copied");
+  lua_pushinteger(L, stats.skipped);
+  lua_setfield(L, -2, "skipped");
+  lua_pushinteger(L, stats.failed);
+  lua_setfield(L, -2, "failed");
+  lua_pushinteger(L, stats.bytes);
+  lua_setfield(L, -2, "bytes");
+
+  return 1;
+}
+
+extern "C" int
+lua_copy_tree(lua_State* L)
+{
+  return sync_paths(L, true);
+}
+
+extern "C" int
+lua_sync_tree(lua_State* L)
+{
+  return sync_paths(L, false);
+}
+
+extern "C" int
+lua_find_root(lua_State* L)
+{
+  if (!(lua_isstring(L, 1) || lua_istable(L, 1)) ||
+      !(lua_isnoneornil(L, 2) || lua_isstring(L, 2))) {
+    lua_pushstring(L,
+                   "Invalid argument. Expected a marker or an array of markers "
+                   "and an optional start directory.");
+    lua_error(L);
+    return 0;
+  }
+
+  const auto markers = get_paths(L, 1);
+  const auto start =
+    lua_isstring(L, 2) ? fs::path{ lua_tostring(L, 2) } : fs::current_path();
+
+  const auto root = dk::find_root(start, markers);
+
+  if (!root.has_value()) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  lua_pushstring(L, root->path.c_str());
+  lua_pushstring(L, root->marker.c_str());
+  return 2;
+}
+
+static void
+push_strings(lua_State* L, const std::vector<std::string>& list)
+{
+  lua_createtable(L, list.size(), 0);
+  for (size_t i = 0; i < list.size(); ++i) {
+    lua_pushstring(L, list[i].c_str());
+    lua_rawseti(L, -2, i + 1);
+  }
+}
+
+extern "C" int
+lua_packages(lua_State* L)
+{
+  if (!(lua_isnoneornil(L, 1) || lua_isstring(L, 1))) {
+    lua_pushstring(L, "Invalid argument. Expected a workspace directory.");
+    lua_error(L);
+    return 0;
+  }
+
+  const auto root =
+    lua_isstring(L, 1) ? fs::path{ lua_tostring(L, 1) } : fs::current_path();
+
+  auto ec = std::error_code{};
+  if (!fs::is_directory(root, ec)) {
+    lua_pushnil(L);
+    lua_pushstring(
+      L, dk::fmt("Path '{}' is not a directory", root.string()).data());
+    return 2;
+  }
+
+  const auto cache = dk::Cache{ cache_dir / "workspace" };
+  const auto workspace =
+    dk::Workspace{ root, cache_dir.empty() ? nullptr : &cache };
+
+  const auto packages = workspace.packages();
+  lua_createtable(L, packages.size(), 0);
+  for (size_t i = 0; i < packages.size(); ++i) {
+    const auto& package = packages[i];
+    lua_createtable(L, 0, 9);
+    lua_pushstring(L, package.name.c_str());
+    lua_setfield(L, -2, "name");
+    lua_pushstring(L, package.path.c_str());
+    lua_setfield(L, -2, "path");
+    lua_pushstring(L, package.version.c_str());
+    lua_setfield(L, -2, "version");
+    lua_pushstring(L, package.build_type.c_str());
+    lua_setfield(L, -2, "build_type");
+    lua_pushinteger(L, package.level + 1);
+    lua_setfield(L, -2, "level");
+    push_strings(L, package.depends);
+    lua_setfield(L, -2, "depends");
+    push_strings(L, package.build_depends);
+    lua_setfield(L, -2, "build_depends");
+    push_strings(L, package.exec_depends);
+    lua_setfield(L, -2, "exec_depends");
+    push_strings(L, package.test_depends);
+    lua_setfield(L, -2, "test_depends");
+    lua_rawseti(L, -2, i + 1);
+  }
+
+  const auto levels = workspace.levels();
+  lua_createtable(L, levels.size(), 0);
+  for (size_t i = 0; i < levels.size(); ++i) {
+    push_strings(L, levels[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+
+  return 2;
+}
+
+extern "C" int
+lua_merge_compdb(lua_State* L)
+{
+  if (!lua_isstring(L, 1) || !(lua_isstring(L, 2) || lua_istable(L, 2))) {
+    lua_pushstring(L,
+                   "Invalid argument. Expected an output path and a path or "
+                   "an array of paths.");
+    lua_error(L);
+    return 0;
+  }
+
+  const auto jobs = lua_istable(L, 3) ? get_field_count(L, 3, "jobs") : 0;
+
+  const auto output = fs::path{ lua_tostring(L, 1) };
+  auto inputs = std::vector<fs::path>{};
+  for (const auto& path : get_paths(L, 2)) {
+    inputs.emplace_back(path);
+  }
+
+  const auto stats = dk::merge_compdb(inputs, output, jobs);
+  if (!stats.has_value()) {
+    lua_pushnil(L);
+    lua_pushstring(
+      L, dk::fmt("Failed to write '{}'", output.string()).data());
+    return 2;
+  }
+
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, stats->inputs);
+  lua_setfield(L, -2, "inputs");
+  lua_pushinteger(L, stats->entries);
+  lua_setfield(L, -2, "entries");
+  lua_pushinteger(L, stats->duplicates);
+  lua_setfield(L, -2, "duplicates");
+  lua_pushinteger(L, stats->failed);
+  lua_setfield(L, -2, "failed");
+
+  return 1;
+}
+
+extern "C" int
+lua_lookup_compdb(lua_State* L)
+{
+  if (!lua_isstring(L, 1) || !lua_isstring(L, 2)) {
+    lua_pushstring(
+      L, "Invalid argument. Expected a database path and a file path.");
+    lua_error(L);
+    return 0;
+  }
+
+  const auto file = fs::absolute(lua_tostring(L, 2)).string();
+  const auto entry = dk::lookup_compdb(lua_tostring(L, 1), file);
+  if (!entry.has_value()) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  lua_pushlstring(L, entry->data(), entry->size());
+  return 1;
+}
+
+// Decodes JSON events into Lua values. null becomes json.null, a light
+// userdata, so that arrays keep their length.
+struct LuaJsonBuilder
+{
+  lua_State* L;
+  // next index of every open container, 0 for objects
+  std::vector<lua_Integer> open = {};
+
+  void
+  store()
+  {
+    if (open.empty()) {
+      return;
+    }
+    if (open.back() == 0) {
+      lua_rawset(L, -3);
+    }
+    else {
+      lua_rawseti(L, -2, open.back()++);
+    }
+  }
+
+  void
+  null()
+  {
+    lua_pushlightuserdata(L, nullptr);
+    store();
+  }
+
+  void
+  boolean(bool value)
+  {
+    lua_pushboolean(L, value);
+    store();
+  }
+
+  void
+  integer(int64_t value)
+  {
+    lua_pushinteger(L, value);
+    store();
+  }
+
+  void
+  number(double value)
+  {
+    lua_pushnumber(L, value);
+    store();
+  }
+
+  void
+  string(std::string_view value)
+  {
+    lua_pushlstring(L, value.data(), value.size());
+    store();
+  }
+
+  void
+  key(std::string_view name)
+  {
+    lua_pushlstring(L, name.data(), name.size());
+  }
+
+  void
+  begin_object()
+  {
+    luaL_checkstack(L, 3, "JSON nesting too deep");
+    lua_newtable(L);
+    open.push_back(0);
+  }
+
+  void
+  end_object()
+  {
+    open.pop_back();
+    store();
+  }
+
+  void
+  begin_array()
+  {
+    luaL_checkstack(L, 3, "JSON nesting too deep");
+    lua_newtable(L);
+    open.push_back(1);
+  }
+
+  void
+  end_array()
+  {
+    open.pop_back();
+    store();
+  }
+};
+
+struct StringHash
+{
+  using is_transparent = void;
+
+  size_t
+  operator()(std::string_view s) const
+  {
+    return std::hash<std::string_view>{}(s);
+  }
+};
+
+// A container of a lazily decoded document. Its members are located on
+// first access and only decoded when read; decoded containers are kept in
+// the second user value so repeated reads return the same proxy. The first
+// user value keeps the document alive.
+struct JsonNode
+{
+  std::string_view text;
+  size_t offset = 0;
+  bool object = false;
+  bool indexed = false;
+  std::vector<size_t> values = {};
+  std::vector<const std::string*> keys = {};
+  std::unordered_map<std::string, size_t, StringHash, std::equal_to<>>
+    members = {};
+};
+
+constexpr auto json_node_name = "devkit.json.node";
+constexpr auto json_file_name = "devkit.json.file";
+
+static std::string_view
+json_text(lua_State* L, int index)
+{
+  if (lua_type(L, index) == LUA_TSTRING) {
+    return to_string_view(L, index);
+  }
+  const auto* file =
+    static_cast<dk::MappedFile*>(luaL_checkudata(L, index, json_file_name));
+  return file->view();
+}
+
+// Push the error of `reader` as a message. Callers raise it with lua_error once
+// the reader is out of scope, as the jump would skip its destructor.
+static void
+push_json_error(lua_State* L,
+                const dk::JsonReader& reader,
+                const char* expected = "invalid value")
+{
+  lua_pushfstring(L,
+                  "JSON: %s at offset %d",
+                  reader.error() != nullptr ? reader.error() : expected,
+                  static_cast<int>(reader.position()));
+}
+
+static void
+push_json_node(lua_State* L,
+               int anchor,
+               std::string_view text,
+               size_t offset,
+               bool object);
+
+// Push the value at the reader's cursor, leaving the cursor after it.
+// Containers become proxies when `lazy` is set; `anchor` is the stack index
+// of the string or file holding the document.
+static bool
+push_json_value(lua_State* L,
+                int anchor,
+                std::string_view text,
+                dk::JsonReader& reader,
+                bool lazy)
+{
+  const char c = reader.peek();
+  if (lazy && (c == '{' || c == '[')) {
+    const auto offset = reader.position();
+    if (!reader.skip()) {
+      return false;
+    }
+    push_json_node(L, anchor, text, offset, c == '{');
+    return true;
+  }
+
+  auto builder = LuaJsonBuilder{ L };
+  const auto top = lua_gettop(L);
+  if (!reader.parse(builder)) {
+    lua_settop(L, top);
+    return false;
+  }
+  return true;
+}
+
+// Locate the members of `node`. On a malformed document, pushes the error and
+// returns false.
+static bool
+scan_json_node(lua_State* L, JsonNode& node)
+{
+  auto reader = dk::JsonReader{ node.text };
+  reader.seek(node.offset + 1);
+  const char close = node.object ? '}' : ']';
+
+  for (bool first = true; !reader.consume(close); first = false) {
+    if (!first && !reader.consume(',')) {
+      push_json_error(
+        L, reader, node.object ? "expected ',' or '}'" : "expected ',' or ']'");
+      return false;
+    }
+
+    if (node.object) {
+      auto name = std::string_view{};
+      if (!reader.string(name) || !reader.consume(':')) {
+        push_json_error(L, reader, "expected ':'");
+        return false;
+      }
+
+      reader.peek();
+      const auto [it, inserted] =
+        node.members.try_emplace(std::string{ name }, node.values.size());
+      if (!inserted) {
+        node.values[it->second] = reader.position();
+        if (!reader.skip()) {
+          push_json_error(L, reader);
+          return false;
+        }
+        continue;
+      }
+      node.keys.push_back(&it->first);
+    }
+
+    reader.peek();
+    node.values.push_back(reader.position());
+    if (!reader.skip()) {
+      push_json_error(L, reader);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static JsonNode&
+index_json_node(lua_State* L, int index)
+{
+  auto& node =
+    *static_cast<JsonNode*>(luaL_checkudata(L, index, json_node_name));
+  if (node.indexed) {
+    return node;
+  }
+
+  // a malformed document raises half way; start over on the next access
+  node.values.clear();
+  node.keys.clear();
+  node.members.clear();
+
+  if (!scan_json_node(L, node)) {
+    lua_error(L);
+  }
+
+  node.indexed = true;
+  return node;
+}
+
+// Push member `i` of the node at `index`.
+static void
+push_json_member(lua_State* L, int index, const JsonNode& node, size_t i)
+{
+  lua_getiuservalue(L, index, 2);
+  if (lua_rawgeti(L, -1, i + 1) != LUA_TNIL) {
+    lua_remove(L, -2);
+    return;
+  }
+  lua_pop(L, 1);
+
+  lua_getiuservalue(L, index, 1);
+  const auto anchor = lua_gettop(L);
+  bool pushed = false;
+  {
+    auto reader = dk::JsonReader{ node.text };
+    reader.seek(node.values[i]);
+    pushed = push_json_value(L, anchor, node.text, reader, true);
+    if (!pushed) {
+      push_json_error(L, reader);
+    }
+  }
+  if (!pushed) {
+    lua_error(L);
+  }
+
+  if (lua_type(L, -1) == LUA_TUSERDATA) {
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, anchor - 1, i + 1);
+  }
+  lua_replace(L, anchor - 1);
+  lua_settop(L, anchor - 1);
+}
+
+extern "C" int
+lua_json_node_index(lua_State* L)
+{
+  const auto& node = index_json_node(L, 1);
+
+  size_t i = node.values.size();
+  if (node.object && lua_type(L, 2) == LUA_TSTRING) {
+    const auto it = node.members.find(to_string_view(L, 2));
+    if (it != node.members.end()) {
+      i = it->second;
+    }
+  }
+  else if (!node.object && lua_isinteger(L, 2)) {
+    const auto key = lua_tointeger(L, 2);
+    if (key >= 1 && static_cast<size_t>(key) <= node.values.size()) {
+      i = key - 1;
+    }
+  }
+
+  if (i == node.values.size()) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  push_json_member(L, 1, node, i);
+  return 1;
+}
+
+extern "C" int
+lua_json_node_len(lua_State* L)
+{
+  lua_pushinteger(L, index_json_node(L, 1).values.size());
+  return 1;
+}
+
+extern "C" int
+lua_json_node_next(lua_State* L)
+{
+  const auto& node = index_json_node(L, 1);
+
+  size_t i = 0;
+  if (!lua_isnoneornil(L, 2)) {
+    if (node.object) {
+      const auto it = node.members.find(to_string_view(L, 2));
+      i = it == node.members.end() ? node.values.size() : it->second + 1;
+    }
+    else {
+      i = lua_tointeger(L, 2);
+    }
+  }
+
+  if (i >= node.values.size()) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  if (node.object) {
+    lua_pushlstring(L, node.keys[i]->data(), node.keys[i]->size());
+  }
+  else {
+    lua_pushinteger(L, i + 1);
+  }
+  push_json_member(L, 1, node, i);
+  return 2;
+}
+
+extern "C" int
+lua_json_node_pairs(lua_State* L)
+{
+  luaL_checkudata(L, 1, json_node_name);
+  lua_pushcfunction(L, lua_json_node_next);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+extern "C" int
+lua_json_node_gc(lua_State* L)
+{
+  static_cast<JsonNode*>(luaL_checkudata(L, 1, json_node_name))->~JsonNode();
+  return 0;
+}
+
+extern "C" int
+lua_json_file_gc(lua_State* L)
+{
+  static_cast<dk::MappedFile*>(luaL_checkudata(L, 1, json_file_name))
+    ->~MappedFile();
+  return 0;
+}
+
+static void
+push_json_node(lua_State* L,
+               int anchor,
+               std::string_view text,
+               size_t offset,
+               bool object)
+{
+  new (lua_newuserdatauv(L, sizeof(JsonNode), 2))
+    JsonNode{ .text = text, .offset = offset, .object = object };
+
+  if (luaL_newmetatable(L, json_node_name)) {
+    constexpr auto meta =
+      std::array{ luaL_Reg{ "__index", lua_json_node_index },
+                  luaL_Reg{ "__len", lua_json_node_len },
+                  luaL_Reg{ "__pairs", lua_json_node_pairs },
+                  luaL_Reg{ "__gc", lua_json_node_gc },
+                  luaL_Reg{ nullptr, nullptr } };
+    luaL_setfuncs(L, meta.data(), 0);
+  }
+  lua_setmetatable(L, -2);
+
+  lua_pushvalue(L, anchor);
+  lua_setiuservalue(L, -2, 1);
+  lua_newtable(L);
+  lua_setiuservalue(L, -2, 2);
+}
+
+// Decode the document at `anchor`, a string or a mapped file.
+static int
+decode_json(lua_State* L, int anchor, bool lazy)
+{
+  const auto text = json_text(L, anchor);
+  auto reader = dk::JsonReader{ text };
+
+  if (push_json_value(L, anchor, text, reader, lazy) && reader.peek() == '\0') {
+    return 1;
+  }
+
+  lua_pushnil(L);
+  lua_pushstring(L,
+                 dk::fmt("JSON: {} at offset {}",
+                         reader.error() != nullptr
+                           ? reader.error()
+                           : "unexpected data after the document",
+                         reader.position())
+                   .data());
+  return 2;
+}
+
+static bool
+get_json_lazy(lua_State* L, int index)
+{
+  return lua_istable(L, index) && get_field_bool(L, index, "lazy");
+}
+
+// Map the file at stack `index` and push it.
+static bool
+push_json_file(lua_State* L, int index)
+{
+  auto* file = new (lua_newuserdatauv(L, sizeof(dk::MappedFile), 0))
+    dk::MappedFile{ lua_tostring(L, index) };
+
+  if (luaL_newmetatable(L, json_file_name)) {
+    lua_pushcfunction(L, lua_json_file_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+
+  if (!file->valid()) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_pushstring(
+      L, dk::fmt("Failed to read '{}'", lua_tostring(L, index)).data());
+    return false;
+  }
+  return true;
+}
+
+extern "C" int
+lua_json_decode(lua_State* L)
+{
+  if (lua_type(L, 1) != LUA_TSTRING ||
+      !(lua_isnoneornil(L, 2) || lua_istable(L, 2))) {
+    lua_pushstring(
+      L, "Invalid argument. Expected a JSON string and optional options.");
+    lua_error(L);
+    return 0;
+  }
+
+  return decode_json(L, 1, get_json_lazy(L, 2));
+}
+
+extern "C" int
+lua_json_load(lua_State* L)
+{
+  if (!lua_isstring(L, 1) || !(lua_isnoneornil(L, 2) || lua_istable(L, 2))) {
+    lua_pushstring(
+      L, "Invalid argument. Expected a file path and optional options.");
+    lua_error(L);
+    return 0;
+  }
+
+  if (!push_json_file(L, 1)) {
+    return 2;
+  }
+  return decode_json(L, lua_gettop(L), get_json_lazy(L, 2));
+}
+
+// One step of lua_json_each_next. On a malformed document, pushes the error
+// and returns -1.
+static int
+next_json_element(lua_State* L)
+{
+  const auto anchor = lua_upvalueindex(1);
+  const auto text = json_text(L, anchor);
+  const auto index = lua_tointeger(L, lua_upvalueindex(3));
+
+  auto reader = dk::JsonReader{ text };
+  reader.seek(lua_tointeger(L, lua_upvalueindex(2)));
+
+  if (index == 0 && !reader.consume('[')) {
+    lua_pushstring(L, "JSON: expected an array");
+    return -1;
+  }
+  if (reader.consume(']')) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (index > 0 && !reader.consume(',')) {
+    push_json_error(L, reader, "expected ',' or ']'");
+    return -1;
+  }
+
+  lua_pushinteger(L, index + 1);
+  lua_pushvalue(L, anchor);
+  const auto stack_anchor = lua_gettop(L);
+  if (!push_json_value(
+        L, stack_anchor, text, reader, lua_toboolean(L, lua_upvalueindex(4)))) {
+    push_json_error(L, reader);
+    return -1;
+  }
+  lua_remove(L, stack_anchor);
+
+  lua_pushinteger(L, reader.position());
+  lua_replace(L, lua_upvalueindex(2));
+  lua_pushinteger(L, index + 1);
+  lua_replace(L, lua_upvalueindex(3));
+  return 2;
+}
+
+// Iterator over the elements of a top level array. Upvalues: the document,
+// the offset to continue from, the index of the last element and whether
+// containers are decoded lazily.
+extern "C" int
+lua_json_each_next(lua_State* L)
+{
+  const auto results = next_json_element(L);
+  if (results < 0) {
+    return lua_error(L);
+  }
+  return results;
+}
+
+static int
+each_json(lua_State* L, int anchor, bool lazy)
+{
+  lua_pushvalue(L, anchor);
+  lua_pushinteger(L, 0);
+  lua_pushinteger(L, 0);
+  lua_pushboolean(L, lazy);
+  lua_pushcclosure(L, lua_json_each_next, 4);
+  return 1;
+}
+
+extern "C" int
+lua_json_each(lua_State* L)
+{
+  if (lua_type(L, 1) != LUA_TSTRING ||
+      !(lua_isnoneornil(L, 2) || lua_istable(L, 2))) {
+    lua_pushstring(
+      L, "Invalid argument. Expected a JSON string and optional options.");
+    lua_error(L);
+    return 0;
+  }
+
+  return each_json(L, 1, get_json_lazy(L, 2));
+}
+
+extern "C" int
+lua_json_each_file(lua_State* L)
+{
+  if (!lua_isstring(L, 1) || !(lua_isnoneornil(L, 2) || lua_istable(L, 2))) {
+    lua_pushstring(
+      L, "Invalid argument. Expected a file path and optional options.");
+    lua_error(L);
+    return 0;
+  }
+
+  if (!push_json_file(L, 1)) {
+    return luaL_error(L, "%s", lua_tostring(L, -1));
+  }
+  return each_json(L, lua_gettop(L), get_json_lazy(L, 2));
+}
+
+// Completion providers registered by aliases, kept in the registry as
+// providers[command][option] = { fn, ttl, watch, cwd }.
+static constexpr auto completion_providers = "devkit.completion.providers";
+
+static void
+push_completion_providers(lua_State* L)
+{
+  if (lua_getfield(L, LUA_REGISTRYINDEX, completion_providers) !=
+      LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, completion_providers);
+  }
+}
+
+// Pushes the provider for `command` and `option`, or nil.
+static bool
+push_completion_provider(lua_State* L, int command, int option)
+{
+  push_completion_providers(L);
+  if (lua_getfield(L, -1, lua_tostring(L, command)) != LUA_TTABLE) {
+    lua_pop(L, 2);
+    lua_pushnil(L);
+    return false;
+  }
+  lua_getfield(L, -1, lua_tostring(L, option));
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+  return !lua_isnil(L, -1);
+}
+
+extern "C" int
+lua_complete_register(lua_State* L)
+{
+  if (!lua_isstring(L, 1) || !lua_isstring(L, 2) || !lua_isfunction(L, 3) ||
+      !(lua_isnoneornil(L, 4) || lua_istable(L, 4))) {
+    lua_pushstring(L,
+                   "Invalid argument. Expected a command, an option name, a "
+                   "function and optional options.");
+    lua_error(L);
+    return 0;
+  }
+
+  lua_createtable(L, 0, 4);
+  lua_pushvalue(L, 3);
+  lua_setfield(L, -2, "fn");
+  if (lua_istable(L, 4)) {
+    const auto ttl = get_field_integer(L, 4, "ttl");
+    lua_pushinteger(L, ttl > 0 ? ttl : 60);
+    lua_setfield(L, -2, "ttl");
+    lua_getfield(L, 4, "watch");
+    const auto watch = get_paths(L, -1);
+    lua_pop(L, 1);
+    push_strings(L, watch);
+    lua_setfield(L, -2, "watch");
+    lua_getfield(L, 4, "cwd");
+    lua_setfield(L, -2, "cwd");
+  }
+  const auto provider = lua_gettop(L);
+
+  push_completion_providers(L);
+  if (lua_getfield(L, -1, lua_tostring(L, 1)) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, lua_tostring(L, 1));
+  }
+  lua_pushvalue(L, provider);
+  lua_setfield(L, -2, lua_tostring(L, 2));
+
+  return 0;
+}
+
 extern "C" int
-lua_set_env(lua_State* L)
+lua_complete_has(lua_State* L)
 {
-  const auto name = std::string{ luaL_checkstring(L, 1) };
-  const auto value = std::string{ luaL_checkstring(L, 2) };
-  int overwrite = lua_isnone(L, 3) ? 1 : lua_toboolean(L, 3);
-
-  if (setenv(name.data(), value.data(), overwrite) != 0) {
-    lua_pushnil(L);
-    lua_pushstring(
-      L, dk::fmt("Failed to set environment variable '{}'", name).data());
-    return 2;
+  if (!lua_isstring(L, 1) || !lua_isstring(L, 2)) {
+    lua_pushstring(L, "Invalid argument. Expected a command and an option.");
+    lua_error(L);
+    return 0;
   }
 
-  lua_pushboolean(L, 1);
+  lua_pushboolean(L, push_completion_provider(L, 1, 2));
   return 1;
 }
 
-extern "C" int
-lua_get_env(lua_State* L)
+// Runs the provider on top of the stack and joins what it returns, one
+// candidate per line. Returns nullopt when it fails.
+static std::optional<std::string>
+run_completion_provider(lua_State* L, const std::string& cwd)
 {
-  const auto name = std::string{ luaL_checkstring(L, 1) };
-  const auto value = std::string{ getenv(name.data()) };
+  lua_getfield(L, -1, "fn");
+  lua_pushstring(L, cwd.c_str());
+  if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+    dk_err("Lua: error {}", lua_tostring(L, -1));
+    lua_pop(L, 1);
+    return std::nullopt;
+  }
 
-  if (!value.empty()) {
-    lua_pushstring(L, value.data());
+  auto lines = std::string{};
+  for (const auto& line : get_paths(L, -1)) {
+    if (line.find('\n') == std::string::npos) {
+      lines += line;
+      lines += '\n';
+    }
   }
-  else {
-    lua_pushnil(L);
+  lua_pop(L, 1);
+  return lines;
+}
+
+// The provider's cache key: the command and option, and the working
+// directory when the provider depends on it. Only stable inputs go in, so a
+// refresh overwrites the entry instead of leaving the old one behind.
+static std::string
+completion_key(lua_State* L, int command, int option, const std::string& cwd)
+{
+  auto key =
+    dk::fmt("{}\t{}", lua_tostring(L, command), lua_tostring(L, option));
+
+  lua_getfield(L, -1, "cwd");
+  if (lua_toboolean(L, -1)) {
+    key += dk::fmt("\t{}", cwd);
   }
+  lua_pop(L, 1);
 
-  return 1;
+  return key;
+}
+
+// The modification time of every watched file, stored on the first line of
+// the entry, so touching one of them is a miss.
+static std::string
+completion_stamp(lua_State* L, const std::string& cwd)
+{
+  auto stamp = std::string{};
+
+  lua_getfield(L, -1, "watch");
+  auto path = std::string{};
+  for (const auto& watch : get_paths(L, -1)) {
+    path = cwd;
+    dk::append_path(path, watch, home_dir());
+
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+      stamp += dk::fmt("\t{}:{}.{}",
+                       path,
+                       static_cast<int64_t>(st.st_mtim.tv_sec),
+                       st.st_mtim.tv_nsec);
+    }
+    else {
+      stamp += dk::fmt("\t{}:-", path);
+    }
+  }
+  lua_pop(L, 1);
+
+  return stamp;
+}
+
+// Refreshes a stale entry in a detached child, so the caller can answer
+// from the stale one right away.
+static void
+refresh_completion(lua_State* L,
+                   const dk::Cache& cache,
+                   const std::string& key,
+                   const std::string& stamp,
+                   const std::string& cwd)
+{
+  std::fflush(stdout);
+  std::fflush(stderr);
+
+  const auto pid = fork();
+  if (pid != 0) {
+    return;
+  }
+
+  setsid();
+  const auto null = open("/dev/null", O_RDWR);
+  if (null >= 0) {
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+  }
+
+  if (const auto lines = run_completion_provider(L, cwd); lines.has_value()) {
+    cache.put(key, dk::fmt("{}\n{}", stamp, lines.value()));
+  }
+  _exit(0);
 }
 
 extern "C" int
-lua_list_dir(lua_State* L)
+lua_complete_values(lua_State* L)
 {
-  if (lua_gettop(L) != 1 || !lua_isstring(L, 1)) {
-    lua_pushstring(L, "Invalid argument. Expected a directory path string.");
+  if (!lua_isstring(L, 1) || !lua_isstring(L, 2) ||
+      !(lua_isnoneornil(L, 3) || lua_isstring(L, 3))) {
+    lua_pushstring(L,
+                   "Invalid argument. Expected a command, an option and an "
+                   "optional prefix.");
     lua_error(L);
     return 0;
   }
 
-  std::string path = lua_tostring(L, 1);
-  lua_newtable(L);
+  const auto prefix = lua_isstring(L, 3) ? to_string_view(L, 3) : "";
+  const auto limit = lua_isinteger(L, 4) ? lua_tointeger(L, 4) : 0;
+
+  lua_settop(L, 4);
+  if (!push_completion_provider(L, 1, 2)) {
+    lua_newtable(L);
+    return 1;
+  }
+
+  lua_getfield(L, -1, "ttl");
+  const auto ttl = std::chrono::seconds{ lua_isinteger(L, -1)
+                                           ? lua_tointeger(L, -1)
+                                           : 60 };
+  lua_pop(L, 1);
+
+  const auto cwd = fs::current_path().string();
+  const auto key = completion_key(L, 1, 2, cwd);
+  const auto stamp = completion_stamp(L, cwd);
+  const auto cache = dk::Cache{ cache_dir / "complete" };
+
+  // An entry whose stamp is not the current one is a miss.
+  auto lines = cache_dir.empty() ? std::nullopt : cache.get(key);
+  if (lines.has_value()) {
+    const auto end = lines->find('\n');
+    if (end != std::string::npos &&
+        std::string_view{ *lines }.substr(0, end) == stamp) {
+      lines->erase(0, end + 1);
+    }
+    else {
+      lines.reset();
+    }
+  }
+
+  if (lines.has_value()) {
+    if (cache.age(key).value_or(ttl) >= ttl) {
+      // Claim the refresh, so the next keystrokes don't start another one.
+      cache.put(key, dk::fmt("{}\n{}", stamp, lines.value()));
+      refresh_completion(L, cache, key, stamp, cwd);
+    }
+  }
+  else {
+    lines = run_completion_provider(L, cwd);
+    if (lines.has_value() && !cache_dir.empty()) {
+      cache.put(key, dk::fmt("{}\n{}", stamp, lines.value()));
+    }
+  }
 
-  lua_pushstring(L, "dirs");
   lua_newtable(L);
-  int dir_index = 1;
+  auto count = lua_Integer{ 0 };
+  auto rest = lines.has_value() ? std::string_view{ *lines } : "";
+  while (!rest.empty() && (limit == 0 || count < limit)) {
+    const auto end = rest.find('\n');
+    const auto line = rest.substr(0, end);
+    rest.remove_prefix(end == std::string_view::npos ? rest.size() : end + 1);
 
-  for (const auto& entry : std::filesystem::directory_iterator(path)) {
-    if (entry.is_directory()) {
-      lua_pushstring(L, entry.path().filename().string().c_str());
-      lua_rawseti(L, -2, dir_index++); // dirs[subIndex] = "dirname"
+    if (line.starts_with(prefix)) {
+      lua_pushlstring(L, line.data(), line.size());
+      lua_rawseti(L, -2, ++count);
+    }
+  }
+  return 1;
+}
+
+// Children started by sh.spawn live in userdata, with one loop waiting for
+// all of them. sh.wait and sh.wait_all suspend the coroutines sk drives,
+// the alias and those started by sh.go, and the loop resumes them as their
+// children exit; anywhere else they block until the children are done.
+static auto processes = dk::ProcessLoop{};
+
+// The state sh.spawn and sh.go were used in, to finish what they started
+// once the alias returns.
+static lua_State* process_state = nullptr;
+
+constexpr auto process_name = "devkit.process";
+
+// Registry: handles of the running children, so that none is collected
+// while the loop watches it.
+static constexpr auto running_processes = "devkit.sh.running";
+// Registry: the coroutines of sh.go, and those of them suspended in
+// sh.wait.
+static constexpr auto sh_tasks = "devkit.sh.tasks";
+static constexpr auto waiting_tasks = "devkit.sh.waiting";
+// Registry: handles of the tasks the alias yielded, in order.
+static constexpr auto streamed_tasks = "devkit.sh.streamed";
+
+// The first value sh.wait yields, the second is what it waits for.
+static char wait_marker;
+
+static void
+push_registry_table(lua_State* L, const char* key)
+{
+  if (lua_getfield(L, LUA_REGISTRYINDEX, key) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, key);
+  }
+}
+
+// Sets `key` of the registry table to the value on top of the stack, for
+// the thread at `thread`, and pops it.
+static void
+set_thread_entry(lua_State* L, const char* key, int thread)
+{
+  thread = lua_absindex(L, thread);
+  push_registry_table(L, key);
+  lua_pushvalue(L, thread);
+  lua_pushvalue(L, -3);
+  lua_rawset(L, -3);
+  lua_pop(L, 2);
+}
+
+static dk::Process&
+check_process(lua_State* L, int index)
+{
+  return *static_cast<dk::Process*>(luaL_checkudata(L, index, process_name));
+}
+
+static const dk::Process&
+to_process(lua_State* L, int index)
+{
+  return *static_cast<const dk::Process*>(lua_touserdata(L, index));
+}
+
+// Whether every child of the wait at `index`, a handle or an array of
+// handles, has exited.
+static bool
+wait_done(lua_State* L, int index)
+{
+  if (lua_type(L, index) == LUA_TUSERDATA) {
+    return !to_process(L, index).running();
+  }
+
+  const auto size = lua_rawlen(L, index);
+  for (size_t i = 1; i <= size; ++i) {
+    lua_rawgeti(L, index, i);
+    const auto running = to_process(L, -1).running();
+    lua_pop(L, 1);
+    if (running) {
+      return false;
     }
   }
-  lua_settable(L, -3); // result["dirs"] = dirs
+  return true;
+}
+
+// Pushes what the wait at `index` returns: an exit code, or an array of
+// them.
+static void
+push_exit_codes(lua_State* L, int index)
+{
+  if (lua_type(L, index) == LUA_TUSERDATA) {
+    lua_pushinteger(L, to_process(L, index).exit_code());
+    return;
+  }
+
+  const auto size = lua_rawlen(L, index);
+  lua_createtable(L, size, 0);
+  for (size_t i = 1; i <= size; ++i) {
+    lua_rawgeti(L, index, i);
+    const auto code = to_process(L, -1).exit_code();
+    lua_pop(L, 1);
+    lua_pushinteger(L, code);
+    lua_rawseti(L, -2, i);
+  }
+}
+
+// Replaces the wait a suspended coroutine yielded with its result.
+static void
+finish_wait(lua_State* co)
+{
+  const auto wait = lua_gettop(co);
+  push_exit_codes(co, wait);
+  lua_replace(co, wait - 1);
+  lua_settop(co, wait - 1);
+}
+
+static bool
+yielded_wait(lua_State* co, int nresults)
+{
+  return nresults == 2 && lua_touserdata(co, -2) == &wait_marker;
+}
+
+// Resumes the sh.go coroutine at `thread`, which finishes or waits again.
+static void
+resume_task(lua_State* L, int thread, int nargs)
+{
+  auto* co = lua_tothread(L, thread);
+  int nresults = 0;
+  const auto status = lua_resume(co, L, nargs, &nresults);
+
+  if (status == LUA_YIELD && yielded_wait(co, nresults)) {
+    lua_pushboolean(L, true);
+    set_thread_entry(L, waiting_tasks, thread);
+    return;
+  }
+
+  if (status == LUA_YIELD) {
+    dk_err("Lua: error sh.go tasks may only yield in sh.wait.");
+  }
+  else if (status != LUA_OK) {
+    dk_err("Lua: error {}", lua_tostring(co, -1));
+  }
+  lua_pushnil(L);
+  set_thread_entry(L, sh_tasks, thread);
+}
+
+// Waits for children to exit, then resumes the sh.go coroutines whose wait
+// is over. False when no child is running.
+static bool
+step_processes(lua_State* L)
+{
+  if (processes.pending() == 0) {
+    return false;
+  }
+
+  const auto done = processes.run_once();
+  if (done.empty()) {
+    return true;
+  }
+
+  push_registry_table(L, running_processes);
+  for (auto* process : done) {
+    lua_pushlightuserdata(L, process);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+  }
+  lua_pop(L, 1);
 
-  lua_pushstring(L, "files");
+  // Resuming changes the table, the ready coroutines are collected first.
+  push_registry_table(L, waiting_tasks);
+  const auto waiting = lua_gettop(L);
   lua_newtable(L);
-  int file_index = 1;
+  lua_Integer ready = 0;
+  lua_pushnil(L);
+  while (lua_next(L, waiting) != 0) {
+    lua_pop(L, 1);
+    auto* co = lua_tothread(L, -1);
+    if (wait_done(co, lua_gettop(co))) {
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, waiting + 1, ++ready);
+    }
+  }
 
-  for (const auto& entry : std::filesystem::directory_iterator(path)) {
-    if (entry.is_regular_file()) {
-      lua_pushstring(L, entry.path().filename().string().c_str());
-      lua_rawseti(L, -2, file_index++); // files[fileIndex] = "filename"
+  for (lua_Integer i = 1; i <= ready; ++i) {
+    lua_rawgeti(L, waiting + 1, i);
+    auto* co = lua_tothread(L, -1);
+
+    // A blocking sh.wait in a task resumed before may have resumed it.
+    lua_pushvalue(L, -1);
+    const auto resumable = lua_rawget(L, waiting) != LUA_TNIL &&
+                               wait_done(co, lua_gettop(co));
+    lua_pop(L, 1);
+    if (resumable) {
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, waiting);
+
+      finish_wait(co);
+      resume_task(L, lua_gettop(L), 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_settop(L, waiting - 1);
+  return true;
+}
+
+// Waits for every child and sh.go coroutine started so far.
+static void
+finish_processes()
+{
+  if (process_state != nullptr) {
+    while (step_processes(process_state)) {
+    }
+  }
+}
+
+// Whether sh.wait may suspend `L` instead of blocking.
+static bool
+is_driven(lua_State* L)
+{
+  if (!lua_isyieldable(L)) {
+    return false;
+  }
+  if (dk::Lua::is_async(L)) {
+    return true;
+  }
+
+  push_registry_table(L, sh_tasks);
+  lua_pushthread(L);
+  lua_rawget(L, -2);
+  const bool task = lua_toboolean(L, -1);
+  lua_pop(L, 2);
+  return task;
+}
+
+static int
+wait_processes(lua_State* L, int index)
+{
+  if (!wait_done(L, index)) {
+    if (is_driven(L)) {
+      lua_pushlightuserdata(L, &wait_marker);
+      lua_pushvalue(L, index);
+      return lua_yield(L, 2);
+    }
+    while (!wait_done(L, index) && step_processes(L)) {
     }
   }
-  lua_settable(L, -3); // result["files"] = files
 
+  push_exit_codes(L, index);
   return 1;
 }
 
 extern "C" int
-lua_exists(lua_State* L)
+lua_wait(lua_State* L)
 {
-  if (lua_gettop(L) != 1 || !lua_isstring(L, 1)) {
-    lua_pushstring(
-      L, "Invalid argument. Expected a file or directory path string.");
+  check_process(L, 1);
+  return wait_processes(L, 1);
+}
+
+extern "C" int
+lua_wait_all(lua_State* L)
+{
+  if (!lua_istable(L, 1)) {
+    lua_pushstring(L, "Invalid argument. Expected an array of processes.");
     lua_error(L);
     return 0;
   }
 
-  auto path = std::string{ lua_tostring(L, 1) };
-  bool exists = std::filesystem::exists(path);
+  const auto size = lua_rawlen(L, 1);
+  for (size_t i = 1; i <= size; ++i) {
+    lua_rawgeti(L, 1, i);
+    if (luaL_testudata(L, -1, process_name) == nullptr) {
+      lua_pushstring(L, "Invalid argument. Expected an array of processes.");
+      lua_error(L);
+      return 0;
+    }
+    lua_pop(L, 1);
+  }
 
-  lua_pushboolean(L, exists);
+  return wait_processes(L, 1);
+}
 
+extern "C" int
+lua_process_pid(lua_State* L)
+{
+  lua_pushinteger(L, check_process(L, 1).pid());
   return 1;
 }
 
 extern "C" int
-lua_join(lua_State* L)
+lua_process_gc(lua_State* L)
 {
-  int nargs = lua_gettop(L);
-  auto joined_path = std::filesystem::path{};
+  auto& process = check_process(L, 1);
+  processes.unwatch(process);
+  process.~Process();
+  return 0;
+}
 
-  for (int i = 1; i <= nargs; ++i) {
-    if (!lua_isstring(L, i)) {
-      lua_pushstring(L, "Invalid argument. All arguments must be strings.");
-      lua_error(L);
-      return 0;
-    }
+static lua_State*
+main_thread(lua_State* L)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  auto* main = lua_tothread(L, -1);
+  lua_pop(L, 1);
+  return main;
+}
 
-    auto part = std::string{ lua_tostring(L, i) };
+// Starts a child and pushes its handle, or nil and a message. Returns the
+// number of values pushed.
+static int
+push_process(lua_State* L,
+             const std::vector<std::string>& argv,
+             const dk::ProcessOptions& options)
+{
+  auto* process = new (lua_newuserdatauv(L, sizeof(dk::Process), 0))
+    dk::Process{ argv, options };
 
-    if (!part.empty() && part[0] == '~') {
-      const char* home = std::getenv("HOME");
-      if (home != nullptr) {
-        part = dk::fmt("{}{}", home, part.substr(1));
-      }
-    }
+  if (luaL_newmetatable(L, process_name)) {
+    constexpr auto methods =
+      std::array{ luaL_Reg{ "pid", lua_process_pid },
+                  luaL_Reg{ "wait", lua_wait },
+                  luaL_Reg{ nullptr, nullptr } };
+    lua_createtable(L, 0, methods.size() - 1);
+    luaL_setfuncs(L, methods.data(), 0);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_process_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
 
-    if (joined_path.empty()) {
-      joined_path = part;
-    }
-    else {
-      joined_path = joined_path / part;
-    }
+  if (!process->valid()) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_pushstring(
+      L,
+      dk::fmt("Failed to start '{}'", argv.empty() ? "" : argv.front()).data());
+    return 2;
   }
 
-  lua_pushstring(L, joined_path.string().c_str());
+  processes.watch(*process);
+  process_state = main_thread(L);
 
+  push_registry_table(L, running_processes);
+  lua_pushlightuserdata(L, process);
+  lua_pushvalue(L, -3);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
   return 1;
 }
 
 extern "C" int
-lua_split_path(lua_State* L)
+lua_spawn(lua_State* L)
 {
-  if (lua_gettop(L) != 1 || !lua_isstring(L, 1)) {
-    lua_pushstring(L, "Invalid argument. Expected a path string.");
+  if (!(lua_isstring(L, 1) || lua_istable(L, 1)) ||
+      !(lua_isnoneornil(L, 2) || lua_istable(L, 2))) {
+    lua_pushstring(L,
+                   "Invalid argument. Expected a command or an array of "
+                   "arguments and optional options.");
     lua_error(L);
     return 0;
   }
 
-  auto path = std::string{ lua_tostring(L, 1) };
+  // A string runs in the shell, an array as it is.
+  auto argv = std::vector<std::string>{ "/bin/sh", "-c" };
+  if (lua_istable(L, 1)) {
+    argv = get_paths(L, 1);
+  }
+  else {
+    argv.emplace_back(lua_tostring(L, 1));
+  }
+
+  auto options = dk::ProcessOptions{};
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "cwd");
+    if (lua_isstring(L, -1)) {
+      options.cwd = lua_tostring(L, -1);
+    }
+    lua_pop(L, 1);
+    options.quiet = get_field_bool(L, 2, "quiet");
+  }
 
-  auto matches = std::smatch{};
-  auto pattern = std::regex{ R"((.*[\\/])?([^\\/]*?)(\.[^\\.]*?)?$)" };
+  return push_process(L, argv, options);
+}
 
-  if (std::regex_match(path, matches, pattern)) {
-    lua_newtable(L);
+// Fields of a task the alias yields, read raw: nothing may raise outside
+// of the coroutine. Flags are "true" as in the table an alias returns.
+static std::string
+task_string(lua_State* L, int index, const char* key)
+{
+  lua_pushstring(L, key);
+  lua_rawget(L, index);
+  auto value = lua_type(L, -1) == LUA_TSTRING
+                 ? std::string{ to_string_view(L, -1) }
+                 : std::string{};
+  lua_pop(L, 1);
+  return value;
+}
+
+static bool
+task_flag(lua_State* L, int index, const char* key)
+{
+  lua_pushstring(L, key);
+  lua_rawget(L, index);
+  const bool flag = lua_type(L, -1) == LUA_TSTRING
+                      ? to_string_view(L, -1) == "true"
+                      : lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return flag;
+}
+
+// The task described by the table at `index`, a yielded one or the one the
+// alias returns.
+static dk::details::TaskArg
+task_arg(lua_State* L, int index)
+{
+  return { .use_shell = task_flag(L, index, "use_shell"),
+           .new_process = task_flag(L, index, "new_process"),
+           .search_path = task_flag(L, index, "search_path"),
+           .command = task_string(L, index, "command") };
+}
 
-    lua_pushstring(L, "dir");
-    lua_pushstring(L, matches[1].str().c_str());
-    lua_settable(L, -3);
+// The exit code a streamed task that cannot start counts as, like a shell
+// that cannot run a command.
+constexpr auto start_failure = 127;
 
-    lua_pushstring(L, "name");
-    lua_pushstring(L, matches[2].str().c_str());
-    lua_settable(L, -3);
+// Starts the task on top of the stack in place of it, see push_process.
+static int
+stream_task(lua_State* L)
+{
+  const auto table = lua_gettop(L);
+  const auto task = dk::Task{ task_arg(L, table) };
+  const auto options =
+    dk::ProcessOptions{ .cwd = task_string(L, table, "cwd"),
+                        .quiet = task_flag(L, table, "quiet"),
+                        .search_path = task_flag(L, table, "search_path") };
+  lua_pop(L, 1);
 
-    lua_pushstring(L, "ext");
-    lua_pushstring(L, matches[3].str().c_str());
-    lua_settable(L, -3);
+  // A handle, or the code of a task that did not start.
+  const auto pushed = push_process(L, task.argv(), options);
+  process_state = main_thread(L);
+  push_registry_table(L, streamed_tasks);
+  if (pushed == 1) {
+    lua_pushvalue(L, -2);
   }
   else {
-    lua_newtable(L);
+    lua_pushinteger(L, start_failure);
   }
+  lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+  lua_pop(L, 1);
+  return pushed;
+}
 
-  return 1;
+// The exit code of the first streamed task that failed, 0 when none did.
+static int
+streamed_failure()
+{
+  if (process_state == nullptr) {
+    return 0;
+  }
+
+  auto* L = process_state;
+  push_registry_table(L, streamed_tasks);
+  const auto size = lua_rawlen(L, -1);
+  auto failure = 0;
+  for (size_t i = 1; i <= size && failure == 0; ++i) {
+    if (lua_rawgeti(L, -1, i) == LUA_TNUMBER) {
+      failure = static_cast<int>(lua_tointeger(L, -1));
+    }
+    else {
+      failure = to_process(L, -1).exit_code();
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return failure;
+}
+
+extern "C" int
+lua_go(lua_State* L)
+{
+  if (!lua_isfunction(L, 1)) {
+    lua_pushstring(
+      L, "Invalid argument. Expected a function and its arguments.");
+    lua_error(L);
+    return 0;
+  }
+
+  const auto nargs = lua_gettop(L) - 1;
+  auto* co = lua_newthread(L);
+  lua_insert(L, 1);
+  lua_xmove(L, co, nargs + 1);
+  process_state = main_thread(L);
+
+  lua_pushboolean(L, true);
+  set_thread_entry(L, sh_tasks, 1);
+  resume_task(L, 1, nargs);
+  return 0;
 }
 
 int
 main(int argc, char** argv)
 {
+  dk_trace("main");
   const auto home = fs::path{ std::getenv("HOME") };
-  auto args = dk::Args{ argc, const_cast<const char**>(argv) };
+  auto args = [&] {
+    dk_trace("parse args");
+    return dk::Args{ argc, const_cast<const char**>(argv) };
+  }();
 
   auto store = home / ".devkit";
   if (args.options["store"]->value.has_value()) {
@@ -188,25 +2040,93 @@ main(int argc, char** argv)
     exit(1);
   }
 
+  cache_dir = store / "cache";
+
   const auto apps = store / "apps";
   if (!fs::is_regular_file(apps / "sk.lua")) {
     dk_err("apps/sk.lua not found.");
     exit(1);
   }
 
-  constexpr auto fs_func = std::array{ luaL_Reg{ "ls_dir", lua_list_dir },
-                                       luaL_Reg{ "exists", lua_exists },
-                                       luaL_Reg{ "join", lua_join },
-                                       luaL_Reg{ "split_path", lua_split_path },
-                                       luaL_Reg{ nullptr, nullptr } };
-  constexpr auto sh_func = std::array{ luaL_Reg{ "set_env", lua_set_env },
-                                       luaL_Reg{ "get_env", lua_get_env },
-                                       luaL_Reg{ nullptr, nullptr } };
+  constexpr auto fs_func =
+    std::array{ luaL_Reg{ "ls_dir", dk::lua_function<list_dir> },
+                luaL_Reg{ "exists", dk::lua_function<exists> },
+                luaL_Reg{ "join", lua_join },
+                luaL_Reg{ "split_path", lua_split_path },
+                luaL_Reg{ "split_many", lua_split_many },
+                luaL_Reg{ "join_many", lua_join_many },
+                luaL_Reg{ "normalize_many", lua_normalize_many },
+                luaL_Reg{ "relative_many", lua_relative_many },
+                luaL_Reg{ "grep", lua_grep },
+                luaL_Reg{ "copy", lua_copy_tree },
+                luaL_Reg{ "sync", lua_sync_tree },
+                luaL_Reg{ "find_root", lua_find_root },
+                luaL_Reg{ nullptr, nullptr } };
+  constexpr auto sh_func =
+    std::array{ luaL_Reg{ "set_env", lua_set_env },
+                luaL_Reg{ "get_env", dk::lua_function<get_env> },
+                luaL_Reg{ "spawn", lua_spawn },
+                luaL_Reg{ "wait", lua_wait },
+                luaL_Reg{ "wait_all", lua_wait_all },
+                luaL_Reg{ "go", lua_go },
+                luaL_Reg{ nullptr, nullptr } };
+  constexpr auto complete_func =
+    std::array{ luaL_Reg{ "register", lua_complete_register },
+                luaL_Reg{ "has", lua_complete_has },
+                luaL_Reg{ "values", lua_complete_values },
+                luaL_Reg{ nullptr, nullptr } };
+  constexpr auto json_func =
+    std::array{ luaL_Reg{ "decode", lua_json_decode },
+                luaL_Reg{ "load", lua_json_load },
+                luaL_Reg{ "each", lua_json_each },
+                luaL_Reg{ "each_file", lua_json_each_file },
+                luaL_Reg{ nullptr, nullptr } };
+  constexpr auto ws_func =
+    std::array{ luaL_Reg{ "packages", lua_packages },
+                luaL_Reg{ "merge_compdb", lua_merge_compdb },
+                luaL_Reg{ "lookup_compdb", lua_lookup_compdb },
+                luaL_Reg{ nullptr, nullptr } };
+
+  // Aliases may loop on sh.wait or yield tasks for as long as they like, so
+  // the state collects: blocks come from a pool and the collector runs in
+  // generational mode, which is cheap for the short lived garbage of a
+  // planning script.
+  auto pool = dk::PoolAllocator{};
+  auto lua = [&] {
+    dk_trace("lua state");
+    return dk::Lua{ { .alloc = dk::PoolAllocator::lua_alloc,
+                      .userdata = &pool,
+                      .generational = true } };
+  }();
 
-  auto lua = dk::Lua{};
-  lua.register_module("fs", fs_func);
-  lua.register_module("sh", sh_func);
-  lua.exec_file(apps / "sk.lua");
+  // Memory of the state, as a counter next to the spans.
+  const auto trace_memory = [&] {
+    if (auto* trace = dk::Trace::instance()) {
+      const auto& stats = pool.stats();
+      trace->counter("lua memory",
+                     { { "in_use", stats.in_use },
+                       { "peak", stats.peak },
+                       { "reserved", stats.reserved },
+                       { "allocations", stats.allocations } });
+    }
+  };
+  defer
+  {
+    trace_memory();
+  };
+  {
+    dk_trace("register modules");
+    lua.register_module("fs", fs_func);
+    lua.register_module("sh", sh_func);
+    lua.register_module("ws", ws_func);
+    lua.register_module("json", json_func);
+    lua.register_module("complete", complete_func);
+    lua.exec("json.null = json.decode('null')");
+  }
+  {
+    dk_trace("exec_file");
+    lua.exec_file(apps / "sk.lua");
+  }
 
   std::string command;
   bool do_help = false;
@@ -232,25 +2152,83 @@ main(int argc, char** argv)
     count += 1;
   }
 
-  const auto help_msg = lua.call_module<std::string>("help", command);
+  const auto help_msg = [&] {
+    dk_trace("help");
+    return lua.call_module<std::string>("help", command);
+  }();
   if (!help_msg.has_value()) {
     dk_log("Help message not found.");
   }
 
-  args.document(help_msg.value());
+  {
+    dk_trace("document");
+    args.document(help_msg.value());
+  }
 
   if (do_complete) {
+    dk_trace("complete");
     if (args_num > argc || args_num < 0) {
       dk_err("Invalid SK_COMPLETE_ARGS_NUM.");
       return 1;
     }
 
+    constexpr auto limit = 100;
     const auto prefix = args_num == argc ? "" : argv[args_num];
-    const auto completes = args.complete({ prefix });
 
-    fmt::println("{}", "type_not_implemented");
+    // The first line is the type of the completed value: "file" or "dir"
+    // right after an option taking one, "none" otherwise. The value of
+    // --option=value completes the same way, printed after its option so
+    // the shell matches it against the whole word.
+    auto option = dk::details::Option{};
+    auto value_prefix = std::string_view{ prefix };
+    auto lead = std::string_view{};
+    if (const auto eq = value_prefix.find('=');
+        value_prefix.starts_with("--") && eq != std::string_view::npos) {
+      option = *args.options[value_prefix.substr(2, eq - 2)];
+      lead = value_prefix.substr(0, eq + 1);
+      value_prefix.remove_prefix(eq + 1);
+    }
+    else if (args_num > 1 && args_num <= argc) {
+      const auto prev = std::string_view{ argv[args_num - 1] };
+      if (prev.starts_with("--")) {
+        option = *args.options[prev.substr(2)];
+      }
+      else if (prev.size() == 2 && prev[0] == '-') {
+        option = *args.options[prev.substr(1)];
+      }
+    }
+    const auto value_type = option.value_type;
+
+    // Values from a provider registered with complete.register.
+    const auto name = std::string{ option.long_name.empty()
+                                     ? option.short_name
+                                     : option.long_name };
+    const auto has_provider =
+      !value_type.empty() &&
+      lua.call_field<bool>("complete", "has", command, name).value_or(false);
+    if (has_provider) {
+      fmt::println("{}", value_type);
+      const auto typed = std::string{ value_prefix };
+      const auto values = lua.call_field<std::vector<std::string>>(
+        "complete", "values", command, name, typed, limit);
+      for (const auto& value : values.value_or(std::vector<std::string>{})) {
+        fmt::println("{}{}", lead, value);
+      }
+      return 0;
+    }
+
+    if (value_type == "file" || value_type == "dir") {
+      fmt::println("{}", value_type);
+      for (const auto& path : dk::complete_path(
+             value_prefix, value_type == "dir", limit, home_dir())) {
+        fmt::println("{}{}", lead, path);
+      }
+      return 0;
+    }
 
-    for (const auto& [arg, desc] : completes) {
+    fmt::println("none");
+    for (const auto& [arg, desc] :
+         args.complete(prefix, { .limit = limit, .fuzzy = true })) {
       fmt::println("{}\t{}", arg, desc);
     }
     return 0;
@@ -265,42 +2243,73 @@ main(int argc, char** argv)
     lua.register_variable("Confirmed", true);
   }
 
+  // At most SK_JOBS children while the alias streams tasks, one per core
+  // by default.
+  const auto jobs = [] {
+    const char* env = std::getenv("SK_JOBS");
+    const auto n = env != nullptr ? std::atoi(env) : 0;
+    return n > 0 ? static_cast<size_t>(n) : dk::default_jobs();
+  }();
+
+  // The alias runs in a coroutine. sh.wait suspends it until its children
+  // exit. A generator alias yields task tables, each started right away
+  // while it goes on planning, and gets the handle back; it waits for a
+  // free job first.
+  const auto resume_alias = [&](lua_State* co, int nresults) {
+    auto* L = main_thread(co);
+    if (yielded_wait(co, nresults)) {
+      while (!wait_done(co, lua_gettop(co)) && step_processes(L)) {
+      }
+      finish_wait(co);
+      return 1;
+    }
+
+    if (nresults != 1 || !lua_istable(co, -1)) {
+      dk_err("Lua: error aliases may only yield tasks, or in sh.wait.");
+      return -1;
+    }
+    while (processes.pending() >= jobs && step_processes(L)) {
+    }
+    return stream_task(co);
+  };
+
   const auto options = args.options.to_map();
-  const auto result = lua.call_module<dk::Lua::map>(command,
-                                                    fs::current_path().string(),
-                                                    args.subcommands,
-                                                    options,
-                                                    args.rest_arguments,
-                                                    args.extra_arguments);
+  const auto result = [&] {
+    dk_trace(command, "alias");
+    return lua.call_module_async<dk::LuaRef>(
+      command,
+      resume_alias,
+      fs::current_path().string(),
+      dk::lua_view(args.subcommands),
+      dk::lua_view(options),
+      dk::lua_view(args.rest_arguments),
+      dk::lua_view(args.extra_arguments));
+  }();
+  finish_processes();
   if (!result.has_value()) {
     dk_err("Subcommand {} not found.", command);
     exit(1);
   }
+  trace_memory();
 
-  auto task_args = result.value();
+  // The table the alias returned, read raw like the tasks it yields; an
+  // alias returning nothing runs no command.
+  auto* L = result->push();
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+  }
+  const auto arg = task_arg(L, lua_gettop(L));
+  lua_pop(L, 1);
 
-  const auto to_bool = [](const std::string& str) -> bool {
-    if (str == "true") {
-      return true;
-    }
-    return false;
-  };
-  const auto set_default = [](dk::Lua::map& map,
-                              const std::vector<std::string>& keys) {
-    for (const auto& key : keys) {
-      if (map.find(key) == map.end()) {
-        map[key] = "";
-      }
+  // The command the alias returns runs once every streamed task succeeded.
+  if (const auto failure = streamed_failure(); failure != 0) {
+    if (!arg.command.empty()) {
+      dk_err("A streamed task failed with {}, skipping the command.", failure);
     }
-  };
-
-  set_default(task_args,
-              { "use_shell", "new_process", "search_path", "command" });
+    return failure;
+  }
 
-  const auto task =
-    dk::Task{ { .use_shell = to_bool(task_args.at("use_shell")),
-                .new_process = to_bool(task_args.at("new_process")),
-                .search_path = to_bool(task_args.at("search_path")),
-                .command = task_args.at("command") } };
+  const auto task = dk::Task{ arg };
   return task.run();
 }
@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "args.hh"
+#include "fmt.hh"
+
+namespace dk = devkit;
+namespace fs = std::filesystem;
+
+extern char** environ;
+
+struct Case
+{
+  std::string name;
+  std::vector<std::string> args;
+  std::string complete_args_num; // SK_COMPLETE_ARGS_NUM, if any
+};
+
+struct Stats
+{
+  size_t samples;
+  double min, p50, p90, p99, max, mean; // microseconds
+};
+
+// Writes a store with `count` aliases that do nothing: each one documents
+// two options and runs `true`, so a run measures sk itself.
+static void
+write_store(const fs::path& home, size_t count)
+{
+  const auto apps = home / ".devkit/apps";
+  fs::remove_all(home);
+  fs::create_directories(apps);
+
+  auto lua = std::string{ "local M = {}\n\n"
+                          "M.help = function(command)\n"
+                          "  if command ~= '' then\n"
+                          "    return [[\n"
+                          "    Usage: sk <alias> [options]\n\n"
+                          "    Options:\n"
+                          "      -n, --name <file>  A file\n"
+                          "      -v, --verbose      Verbose output\n"
+                          "    ]]\n"
+                          "  end\n"
+                          "  return [[\n"
+                          "    Usage: sk <alias> [options]\n\n"
+                          "    Commands:\n" };
+  for (size_t i = 0; i < count; ++i) {
+    lua += dk_fmt("      alias_{:<8} Alias number {}\n", i, i);
+  }
+  lua += "\n"
+         "    Options:\n"
+         "      -h, --help     Show help\n"
+         "      -y, --confirm  Confirm\n"
+         "    ]]\n"
+         "end\n\n"
+         "local noop = function()\n"
+         "  return { command = 'true', search_path = 'true' }\n"
+         "end\n";
+  for (size_t i = 0; i < count; ++i) {
+    lua += dk_fmt("M.alias_{} = noop\n", i);
+  }
+  lua += "\nreturn M\n";
+
+  std::ofstream{ apps / "sk.lua" } << lua;
+}
+
+// Wall time of one run of `sk`, in microseconds, or a negative value when
+// it could not be started or failed.
+static double
+run_once(const std::string& sk, const fs::path& home, const Case& test)
+{
+  auto argv_storage = std::vector<std::string>{ sk };
+  argv_storage.insert(argv_storage.end(), test.args.begin(), test.args.end());
+  auto argv = std::vector<char*>{};
+  for (auto& arg : argv_storage) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+
+  auto env_storage = std::vector<std::string>{ "HOME=" + home.string() };
+  if (!test.complete_args_num.empty()) {
+    env_storage.push_back("SK_COMPLETE_ARGS_NUM=" + test.complete_args_num);
+  }
+  for (char** env = environ; *env != nullptr; ++env) {
+    const auto entry = std::string_view{ *env };
+    if (!entry.starts_with("HOME=") && !entry.starts_with("SK_")) {
+      env_storage.emplace_back(entry);
+    }
+  }
+  auto envp = std::vector<char*>{};
+  for (auto& entry : env_storage) {
+    envp.push_back(entry.data());
+  }
+  envp.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(
+    &actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(
+    &actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+  const auto begin = std::chrono::steady_clock::now();
+  pid_t pid = 0;
+  const auto spawned =
+    posix_spawn(&pid, sk.c_str(), &actions, nullptr, argv.data(), envp.data());
+  posix_spawn_file_actions_destroy(&actions);
+  if (spawned != 0) {
+    return -1;
+  }
+
+  int status = 0;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    return -1;
+  }
+
+  return std::chrono::duration<double, std::micro>(
+           std::chrono::steady_clock::now() - begin)
+    .count();
+}
+
+static Stats
+summarize(std::vector<double> samples)
+{
+  std::sort(samples.begin(), samples.end());
+  const auto rank = [&](double p) {
+    const auto index = static_cast<size_t>(p * (samples.size() - 1) + 0.5);
+    return samples[index];
+  };
+
+  auto sum = 0.0;
+  for (const auto sample : samples) {
+    sum += sample;
+  }
+
+  return { samples.size(),   samples.front(), rank(0.5),
+           rank(0.9),        rank(0.99),      samples.back(),
+           sum / samples.size() };
+}
+
+static size_t
+to_size(const dk::details::OptionRef& option, size_t fallback)
+{
+  if (!option->value.has_value()) {
+    return fallback;
+  }
+  return std::strtoul(std::string{ *option->value }.c_str(), nullptr, 10);
+}
+
+int
+main(int argc, char** argv)
+{
+  auto args = dk::Args{ argc, const_cast<const char**>(argv) };
+  args.document(R"(
+    Usage: sk_bench <sk> [options]
+
+    Options:
+      -r, --runs <num>    Warm runs per case, 50 by default
+      -c, --cold <num>    Cold runs per case, 5 by default
+      -o, --output <file> Write the JSON report there instead of stdout
+      -s, --sizes <list>  Alias counts, 10,100,1000 by default
+    )");
+
+  if (args.subcommands.empty()) {
+    dk_err("Usage: sk_bench <sk> [--runs N] [--cold N] [--sizes 10,100]");
+    return 1;
+  }
+
+  const auto sk = fs::absolute(std::string{ args.subcommands.front() });
+  const auto runs = std::max<size_t>(to_size(args.options["runs"], 50), 1);
+  const auto cold = std::max<size_t>(to_size(args.options["cold"], 5), 1);
+
+  auto sizes = std::vector<size_t>{};
+  if (args.options["sizes"]->value.has_value()) {
+    auto list = std::string{ *args.options["sizes"]->value };
+    for (char* token = std::strtok(list.data(), ","); token != nullptr;
+         token = std::strtok(nullptr, ",")) {
+      sizes.push_back(std::strtoul(token, nullptr, 10));
+    }
+  }
+  else {
+    sizes = { 10, 100, 1000 };
+  }
+
+  const auto cases = std::vector<Case>{
+    { "help", { "help" }, {} },
+    { "complete ''", { "_complete", "" }, "2" },
+    { "complete '-'", { "_complete", "-" }, "2" },
+    { "complete 'alias_1'", { "_complete", "alias_1" }, "2" },
+    { "complete 'zzz'", { "_complete", "zzz" }, "2" },
+    { "complete option value", { "_complete", "alias_0", "-n", "" }, "4" },
+    { "noop alias", { "alias_0" }, {} },
+  };
+
+  const auto root = fs::temp_directory_path() / dk_fmt("sk_bench_{}", getpid());
+  auto report = dk_fmt("{{\n  \"sk\": \"{}\",\n  \"runs\": {},\n"
+                       "  \"cold_runs\": {},\n  \"unit\": \"us\",\n"
+                       "  \"results\": [",
+                       sk.string(),
+                       runs,
+                       cold);
+  auto first = true;
+  auto failed = false;
+
+  for (const auto size : sizes) {
+    const auto home = root / dk_fmt("{}", size);
+    write_store(home, size);
+
+    for (const auto& test : cases) {
+      // Cold runs start without the store's caches, warm runs reuse them.
+      for (const auto* mode : { "cold", "warm" }) {
+        const auto is_cold = std::string_view{ mode } == "cold";
+        auto samples = std::vector<double>{};
+
+        if (!is_cold) {
+          run_once(sk, home, test);
+        }
+        for (size_t i = 0; i < (is_cold ? cold : runs); ++i) {
+          if (is_cold) {
+            fs::remove_all(home / ".devkit/cache");
+          }
+          const auto sample = run_once(sk, home, test);
+          if (sample < 0) {
+            dk_err("sk_bench: {} with {} aliases failed.", test.name, size);
+            failed = true;
+            break;
+          }
+          samples.push_back(sample);
+        }
+        if (samples.empty()) {
+          continue;
+        }
+
+        const auto stats = summarize(std::move(samples));
+        report += dk_fmt("{}\n    {{ \"aliases\": {}, \"case\": \"{}\", "
+                         "\"mode\": \"{}\", \"samples\": {}, "
+                         "\"min\": {:.0f}, \"p50\": {:.0f}, "
+                         "\"p90\": {:.0f}, \"p99\": {:.0f}, "
+                         "\"max\": {:.0f}, \"mean\": {:.0f} }}",
+                         first ? "" : ",",
+                         size,
+                         test.name,
+                         mode,
+                         stats.samples,
+                         stats.min,
+                         stats.p50,
+                         stats.p90,
+                         stats.p99,
+                         stats.max,
+                         stats.mean);
+        first = false;
+      }
+    }
+  }
+  report += "\n  ]\n}\n";
+  fs::remove_all(root);
+
+  if (args.options["output"]->value.has_value()) {
+    std::ofstream{ std::string{ *args.options["output"]->value } } << report;
+  }
+  else {
+    fmt::print("{}", report);
+  }
+
+  return failed ? 1 : 0;
+}
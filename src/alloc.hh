@@ -0,0 +1,389 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace devkit
+{
+
+struct AllocStats
+{
+  size_t allocations = 0; // including reallocations that moved
+  size_t frees = 0;
+  size_t in_use = 0; // bytes requested and not freed yet
+  size_t peak = 0;
+  size_t reserved = 0; // bytes taken from malloc
+};
+
+namespace details
+{
+
+constexpr size_t alloc_align = alignof(std::max_align_t);
+
+constexpr size_t
+align_up(size_t size)
+{
+  return (size + alloc_align - 1) & ~(alloc_align - 1);
+}
+
+static void
+count_alloc(AllocStats& stats, size_t osize, size_t nsize)
+{
+  stats.in_use = stats.in_use - osize + nsize;
+  stats.peak = std::max(stats.peak, stats.in_use);
+}
+
+} // namespace details
+
+// Bump allocator for short lived states: allocating is a pointer increment
+// and nothing is given back before the arena goes away, except the most
+// recent block, which can also grow and shrink in place. Pair it with a
+// stopped collector, a process living for milliseconds never needs either.
+class ArenaAllocator
+{
+private:
+  struct Chunk
+  {
+    Chunk* next;
+    size_t size;
+    size_t used;
+  };
+
+  static constexpr size_t header = details::align_up(sizeof(Chunk));
+  static constexpr size_t max_chunk = 1 << 20;
+
+  Chunk* head = nullptr;
+  size_t chunk_size;
+  std::byte* last = nullptr;
+  AllocStats counters;
+
+  static std::byte*
+  data(Chunk* chunk)
+  {
+    return reinterpret_cast<std::byte*>(chunk) + header;
+  }
+
+  bool
+  is_last(void* ptr, size_t size) const
+  {
+    return ptr == last &&
+           last + details::align_up(size) == data(head) + head->used;
+  }
+
+  void*
+  bump(size_t size)
+  {
+    size = details::align_up(std::max<size_t>(size, 1));
+
+    if (head == nullptr || head->size - head->used < size) {
+      const auto capacity = std::max(size, chunk_size);
+      auto* chunk = static_cast<Chunk*>(std::malloc(header + capacity));
+      if (chunk == nullptr) {
+        return nullptr;
+      }
+      *chunk = { head, capacity, 0 };
+      head = chunk;
+      counters.reserved += header + capacity;
+      chunk_size = std::min(chunk_size * 2, max_chunk);
+    }
+
+    last = data(head) + head->used;
+    head->used += size;
+    return last;
+  }
+
+public:
+  explicit ArenaAllocator(size_t chunk_size = 64 * 1024)
+    : chunk_size{ std::max<size_t>(chunk_size, 1024) }
+  {}
+
+  ArenaAllocator(const ArenaAllocator&) = delete;
+  ArenaAllocator&
+  operator=(const ArenaAllocator&) = delete;
+
+  ~ArenaAllocator()
+  {
+    while (head != nullptr) {
+      std::free(std::exchange(head, head->next));
+    }
+  }
+
+  const AllocStats&
+  stats() const
+  {
+    return counters;
+  }
+
+  void*
+  reallocate(void* ptr, size_t osize, size_t nsize)
+  {
+    if (nsize == 0) {
+      if (ptr != nullptr) {
+        if (is_last(ptr, osize)) {
+          head->used -= details::align_up(osize);
+          last = nullptr;
+        }
+        counters.frees += 1;
+        details::count_alloc(counters, osize, 0);
+      }
+      return nullptr;
+    }
+
+    if (ptr != nullptr) {
+      if (is_last(ptr, osize)) {
+        const auto begin = static_cast<size_t>(last - data(head));
+        if (begin + details::align_up(nsize) <= head->size) {
+          head->used = begin + details::align_up(nsize);
+          details::count_alloc(counters, osize, nsize);
+          return ptr;
+        }
+      }
+      else if (nsize <= osize) {
+        details::count_alloc(counters, osize, nsize);
+        return ptr;
+      }
+    }
+
+    auto* block = bump(nsize);
+    if (block == nullptr) {
+      return nullptr;
+    }
+    counters.allocations += 1;
+
+    if (ptr != nullptr) {
+      std::memcpy(block, ptr, std::min(osize, nsize));
+      counters.frees += 1;
+      details::count_alloc(counters, osize, 0);
+    }
+    details::count_alloc(counters, 0, nsize);
+    return block;
+  }
+
+  // A lua_Alloc taking the allocator as its userdata.
+  static void*
+  lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+  {
+    // Lua passes a type tag in osize for new blocks.
+    return static_cast<ArenaAllocator*>(ud)->reallocate(
+      ptr, ptr != nullptr ? osize : 0, nsize);
+  }
+};
+
+// Size class allocator for long lived states: small blocks come from slabs
+// and go back to a free list per class, so a state churning through tables
+// and strings reuses memory without a malloc call. Larger blocks use malloc.
+class PoolAllocator
+{
+private:
+  static constexpr auto classes = std::array<size_t, 12>{
+    16, 32, 48, 64, 96, 128, 160, 192, 256, 320, 384, 512
+  };
+  static constexpr size_t max_small = classes.back();
+  static constexpr size_t slab_size = 64 * 1024;
+
+  // Class of every 16 byte step up to max_small.
+  static constexpr auto class_of = [] {
+    auto table = std::array<uint8_t, max_small / 16 + 1>{};
+    size_t index = 0;
+    for (size_t step = 0; step < table.size(); ++step) {
+      while (classes[index] < step * 16) {
+        ++index;
+      }
+      table[step] = static_cast<uint8_t>(index);
+    }
+    return table;
+  }();
+
+  struct FreeBlock
+  {
+    FreeBlock* next;
+  };
+
+  std::array<FreeBlock*, classes.size()> free_lists{};
+  std::vector<void*> slabs;
+  std::byte* slab_next = nullptr;
+  std::byte* slab_end = nullptr;
+  AllocStats counters;
+
+  static size_t
+  size_class(size_t size)
+  {
+    return class_of[(size + 15) / 16];
+  }
+
+  void*
+  allocate(size_t size)
+  {
+    if (size > max_small) {
+      counters.reserved += size;
+      return std::malloc(size);
+    }
+
+    const auto index = size_class(size);
+    if (auto* block = free_lists[index]; block != nullptr) {
+      free_lists[index] = block->next;
+      return block;
+    }
+
+    const auto block_size = classes[index];
+    if (slab_end - slab_next < static_cast<std::ptrdiff_t>(block_size)) {
+      auto* slab = static_cast<std::byte*>(std::malloc(slab_size));
+      if (slab == nullptr) {
+        return nullptr;
+      }
+      slabs.push_back(slab);
+      counters.reserved += slab_size;
+      slab_next = slab;
+      slab_end = slab + slab_size;
+    }
+
+    auto* block = slab_next;
+    slab_next += block_size;
+    return block;
+  }
+
+  void
+  deallocate(void* ptr, size_t size)
+  {
+    if (size > max_small) {
+      counters.reserved -= size;
+      std::free(ptr);
+      return;
+    }
+
+    const auto index = size_class(size);
+    free_lists[index] = new (ptr) FreeBlock{ free_lists[index] };
+  }
+
+public:
+  PoolAllocator() = default;
+
+  PoolAllocator(const PoolAllocator&) = delete;
+  PoolAllocator&
+  operator=(const PoolAllocator&) = delete;
+
+  ~PoolAllocator()
+  {
+    for (auto* slab : slabs) {
+      std::free(slab);
+    }
+  }
+
+  const AllocStats&
+  stats() const
+  {
+    return counters;
+  }
+
+  // Blocks above the largest class are not tracked, callers must hand back
+  // the size they asked for, as Lua does.
+  void*
+  reallocate(void* ptr, size_t osize, size_t nsize)
+  {
+    if (nsize == 0) {
+      if (ptr != nullptr) {
+        deallocate(ptr, osize);
+        counters.frees += 1;
+        details::count_alloc(counters, osize, 0);
+      }
+      return nullptr;
+    }
+
+    if (ptr != nullptr && osize <= max_small && nsize <= max_small &&
+        size_class(osize) == size_class(nsize)) {
+      details::count_alloc(counters, osize, nsize);
+      return ptr;
+    }
+
+    auto* block = allocate(nsize);
+    if (block == nullptr) {
+      return nullptr;
+    }
+    counters.allocations += 1;
+
+    if (ptr != nullptr) {
+      std::memcpy(block, ptr, std::min(osize, nsize));
+      deallocate(ptr, osize);
+      counters.frees += 1;
+      details::count_alloc(counters, osize, 0);
+    }
+    details::count_alloc(counters, 0, nsize);
+    return block;
+  }
+
+  // A lua_Alloc taking the allocator as its userdata.
+  static void*
+  lua_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+  {
+    return static_cast<PoolAllocator*>(ud)->reallocate(
+      ptr, ptr != nullptr ? osize : 0, nsize);
+  }
+};
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+TEST_CASE("testing alloc")
+{
+  SUBCASE("arena")
+  {
+    auto arena = devkit::ArenaAllocator{ 1024 };
+
+    auto* a = static_cast<char*>(arena.reallocate(nullptr, 0, 10));
+    std::memcpy(a, "arena", 6);
+
+    // The last block grows in place, earlier ones move.
+    CHECK(arena.reallocate(a, 10, 100) == a);
+    auto* b = arena.reallocate(nullptr, 0, 32);
+    auto* moved = static_cast<char*>(arena.reallocate(a, 100, 200));
+    CHECK(moved != a);
+    CHECK(std::strcmp(moved, "arena") == 0);
+    CHECK(arena.reallocate(b, 32, 16) == b);
+
+    // Blocks bigger than a chunk get a chunk of their own.
+    auto* big = arena.reallocate(nullptr, 0, 4096);
+    CHECK(big != nullptr);
+    CHECK(reinterpret_cast<uintptr_t>(big) % alignof(std::max_align_t) == 0);
+
+    arena.reallocate(big, 4096, 0);
+    arena.reallocate(moved, 200, 0);
+    arena.reallocate(b, 16, 0);
+
+    const auto& stats = arena.stats();
+    CHECK(stats.allocations == 4);
+    CHECK(stats.frees == 4);
+    CHECK(stats.in_use == 0);
+    CHECK(stats.peak == 200 + 16 + 4096);
+    CHECK(stats.reserved >= 1024 + 4096);
+  }
+
+  SUBCASE("pool")
+  {
+    auto pool = devkit::PoolAllocator{};
+
+    auto* a = pool.reallocate(nullptr, 0, 40);
+    CHECK(pool.reallocate(a, 40, 48) == a);
+    pool.reallocate(a, 48, 0);
+    CHECK(pool.reallocate(nullptr, 0, 33) == a);
+
+    auto* c = static_cast<char*>(pool.reallocate(nullptr, 0, 8));
+    std::memcpy(c, "pool", 5);
+    auto* grown = static_cast<char*>(pool.reallocate(c, 8, 1000));
+    CHECK(std::strcmp(grown, "pool") == 0);
+    CHECK(pool.reallocate(nullptr, 0, 16) == c);
+
+    pool.reallocate(grown, 1000, 0);
+    CHECK(pool.stats().in_use == 33 + 16);
+    CHECK(pool.stats().peak == 33 + 1000 + 16);
+  }
+}
+#endif
@@ -1,12 +1,18 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cstdint>
+#include <cstring>
 #include <deque>
 #include <optional>
 #include <regex>
 #include <set>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 #include "fmt.hh"
 
@@ -16,16 +22,17 @@ namespace devkit
 namespace details
 {
 
+// View of one option, valid until its Options change.
 struct Option
 {
-  std::string short_name;
-  std::string long_name;
-  std::string value_type;
-  std::string description;
-  std::optional<std::string> value;
+  std::string_view short_name;
+  std::string_view long_name;
+  std::string_view value_type;
+  std::string_view description;
+  std::optional<std::string_view> value;
 
   bool
-  to_bool()
+  to_bool() const
   {
     if (value.has_value()) {
       return value.value() == "true";
@@ -33,8 +40,8 @@ struct Option
     return false;
   }
 
-  std::string
-  to_string()
+  std::string_view
+  to_string() const
   {
     if (value.has_value()) {
       return value.value();
@@ -43,148 +50,694 @@ struct Option
   }
 };
 
-class Options
+// Handle returned by Options::operator[]. Handles to the short and the long
+// name of one option compare equal; handles to unknown names only when the
+// names do.
+class OptionRef
 {
 private:
-  std::unordered_map<std::string, std::shared_ptr<Option>> options_map;
+  static constexpr uint32_t unknown = UINT32_MAX;
+
+  Option option;
+  uint32_t index;
+  std::string unknown_name;
+
+public:
+  OptionRef(Option option, uint32_t index)
+    : option{ option }
+    , index{ index }
+  {}
+
+  explicit OptionRef(std::string_view name)
+    : index{ unknown }
+    , unknown_name{ name }
+  {}
+
+  const Option*
+  operator->() const
+  {
+    return &option;
+  }
+
+  const Option&
+  operator*() const
+  {
+    return option;
+  }
 
   bool
-  exist(const std::string& key)
+  operator==(const OptionRef& other) const
   {
-    if (options_map.find(key) != options_map.end() &&
-        options_map.at(key) != nullptr) {
-      return true;
-    }
-    return false;
+    return index == other.index &&
+           (index != unknown || unknown_name == other.unknown_name);
   }
+};
+
+class Options;
 
+// Name to value map of the options that are set, as returned by
+// Options::to_map. It reads the table of its Options directly and is valid
+// until they change.
+class OptionsMap
+{
 public:
-  std::shared_ptr<Option>&
-  operator[](const std::string& key)
+  using key_type = std::string_view;
+  using mapped_type = std::string_view;
+  using value_type = std::pair<std::string_view, std::string_view>;
+  using const_iterator = std::vector<value_type>::const_iterator;
+
+private:
+  const std::vector<value_type>* pairs;
+
+  explicit OptionsMap(const std::vector<value_type>& pairs)
+    : pairs{ &pairs }
+  {}
+
+  friend class Options;
+
+public:
+  const_iterator
+  begin() const
+  {
+    return pairs->begin();
+  }
+
+  const_iterator
+  end() const
+  {
+    return pairs->end();
+  }
+
+  size_t
+  size() const
+  {
+    return pairs->size();
+  }
+
+  const_iterator
+  find(std::string_view key) const
+  {
+    const auto it = std::lower_bound(
+      begin(), end(), key, [](const value_type& pair, std::string_view key) {
+        return pair.first < key;
+      });
+    return it != end() && it->first == key ? it : end();
+  }
+
+  // Empty for options that are not set.
+  std::string_view
+  operator[](std::string_view key) const
+  {
+    const auto it = find(key);
+    return it != end() ? it->second : std::string_view{};
+  }
+};
+
+// Options in one flat table. Every string lives in a single pool and is
+// referred to by offset; names are interned, so an option seen on the
+// command line and in the documentation shares its name. Short and long
+// names are two slots of one open addressing index pointing at the same
+// entry. Entries, slots and pool are plain data, so `dump` and `load` are
+// straight copies, e.g. to keep documented options in a cache file.
+class Options
+{
+private:
+  struct Span
   {
-    if (!exist(key)) {
-      options_map[key] = std::make_shared<Option>();
+    uint32_t offset = 0;
+    uint32_t size = 0;
+  };
+
+  struct Entry
+  {
+    Span short_name;
+    Span long_name;
+    Span value_type;
+    Span description;
+    Span value;
+    uint32_t has_value = 0;
+  };
+
+  struct Header
+  {
+    uint32_t magic;
+    uint32_t entries;
+    uint32_t slots;
+    uint32_t used;
+    uint32_t pool;
+  };
+
+  static_assert(std::is_trivially_copyable_v<Entry>);
+  static_assert(std::is_trivially_copyable_v<Header>);
+
+  static constexpr uint32_t magic = 0x444b4f31; // "DKO1"
+  static constexpr uint32_t empty_slot = UINT32_MAX;
+  static constexpr uint32_t no_entry = UINT32_MAX;
+
+  std::vector<Entry> entries;
+  std::vector<uint32_t> slots; // entry index << 1 | 1 for long names
+  uint32_t used = 0;
+  std::string pool;
+
+  // name/value pairs behind to_map, rebuilt after changes
+  mutable std::vector<OptionsMap::value_type> pairs;
+  mutable bool dirty = true;
+
+  std::string_view
+  view(Span span) const
+  {
+    return std::string_view{ pool }.substr(span.offset, span.size);
+  }
+
+  Span
+  append(std::string_view str)
+  {
+    const auto span = Span{ static_cast<uint32_t>(pool.size()),
+                            static_cast<uint32_t>(str.size()) };
+    pool += str;
+    return span;
+  }
+
+  std::string_view
+  slot_name(uint32_t slot) const
+  {
+    const auto& entry = entries[slot >> 1];
+    return view((slot & 1) != 0 ? entry.long_name : entry.short_name);
+  }
+
+  // Slot holding `name`, or the empty slot where it would go.
+  size_t
+  find_slot(std::string_view name) const
+  {
+    const auto mask = slots.size() - 1;
+    auto i = std::hash<std::string_view>{}(name) & mask;
+    while (slots[i] != empty_slot && slot_name(slots[i]) != name) {
+      i = (i + 1) & mask;
     }
-    return options_map.at(key);
+    return i;
   }
 
-  void
-  set_short(std::string&& key, std::string&& val)
+  uint32_t
+  find(std::string_view name) const
   {
-    std::shared_ptr<Option> option = nullptr;
-    if (exist(key)) {
-      dk_err("Args: Option {} is set twice! \"{}\" is used.", key, val);
-      option = options_map[key];
+    if (slots.empty()) {
+      return no_entry;
     }
-    else {
-      option = std::make_shared<Option>();
-      options_map[key] = option;
+    const auto slot = slots[find_slot(name)];
+    return slot == empty_slot ? no_entry : slot >> 1;
+  }
+
+  void
+  grow()
+  {
+    auto old = std::vector<uint32_t>(std::max<size_t>(16, slots.size() * 2),
+                                     empty_slot);
+    old.swap(slots);
+    for (const auto slot : old) {
+      if (slot != empty_slot) {
+        slots[find_slot(slot_name(slot))] = slot;
+      }
     }
-    option->short_name = std::move(key);
-    option->value = std::move(val);
   }
 
+  // Point `name` of entry `index` at that entry; `is_long` tells which of
+  // its names `name` is. The name must already be stored in the entry.
   void
-  set_long(std::string&& key, std::string&& val)
+  link(std::string_view name, uint32_t index, bool is_long)
   {
-    std::shared_ptr<Option> option = nullptr;
-    if (exist(key)) {
-      dk_err("Args: Option {} is set twice! \"{}\" is used.", key, val);
-      option = options_map[key];
+    if ((used + 1) * 4 > slots.size() * 3) {
+      grow();
     }
-    else {
-      option = std::make_shared<Option>();
-      options_map[key] = option;
+    auto& slot = slots[find_slot(name)];
+    if (slot == empty_slot) {
+      used += 1;
     }
-    option->long_name = std::move(key);
-    option->value = std::move(val);
+    slot = index << 1 | (is_long ? 1 : 0);
   }
 
-  std::shared_ptr<Option>
-  add_document(const std::string& short_name,
-               const std::string& long_name,
-               const std::string& value_type,
-               const std::string& description)
+  // Drop the slot of `name`. Slots name their entries, so this has to happen
+  // before the entry's name changes. Later slots of the probe run move back
+  // into the hole, so no lookup stops early.
+  void
+  unlink(std::string_view name)
   {
-    std::shared_ptr<Option> option = nullptr;
+    if (name.empty() || slots.empty()) {
+      return;
+    }
+    auto hole = find_slot(name);
+    if (slots[hole] == empty_slot) {
+      return;
+    }
 
-    bool exist_long = exist(long_name);
-    bool exist_short = exist(short_name);
+    const auto mask = slots.size() - 1;
+    for (auto i = (hole + 1) & mask; slots[i] != empty_slot;
+         i = (i + 1) & mask) {
+      const auto home = std::hash<std::string_view>{}(slot_name(slots[i])) &
+                        mask;
+      // `home` outside the cyclic range (hole, i] can move to the hole
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+        slots[hole] = slots[i];
+        hole = i;
+      }
+    }
+    slots[hole] = empty_slot;
+    used -= 1;
+  }
 
-    if (exist_long) {
-      option = options_map[long_name];
+  // Name span for `name`, reusing the pool bytes of a known name.
+  Span
+  intern(std::string_view name)
+  {
+    const auto index = find(name);
+    if (index != no_entry) {
+      const auto& entry = entries[index];
+      return view(entry.long_name) == name ? entry.long_name
+                                           : entry.short_name;
     }
-    else if (exist_short) {
-      option = options_map[short_name];
+    return append(name);
+  }
+
+  uint32_t
+  set(std::string_view key, std::string_view val, bool is_long)
+  {
+    dirty = true;
+
+    auto index = find(key);
+    if (index != no_entry) {
+      dk_err("Args: Option {} is set twice! \"{}\" is used.", key, val);
     }
     else {
-      option = std::make_shared<Option>();
+      index = entries.size();
+      entries.emplace_back();
+      auto& entry = entries[index];
+      (is_long ? entry.long_name : entry.short_name) = append(key);
+      link(key, index, is_long);
     }
 
-    if (exist_long && exist_short) {
+    auto& entry = entries[index];
+    entry.value = append(val);
+    entry.has_value = 1;
+    return index;
+  }
+
+public:
+  size_t
+  size() const
+  {
+    return entries.size();
+  }
+
+  Option
+  at(uint32_t index) const
+  {
+    const auto& entry = entries[index];
+    return Option{ .short_name = view(entry.short_name),
+                   .long_name = view(entry.long_name),
+                   .value_type = view(entry.value_type),
+                   .description = view(entry.description),
+                   .value = entry.has_value != 0
+                              ? std::optional{ view(entry.value) }
+                              : std::nullopt };
+  }
+
+  // Unknown names give an empty option.
+  OptionRef
+  operator[](std::string_view key) const
+  {
+    const auto index = find(key);
+    return index == no_entry ? OptionRef{ key } : OptionRef{ at(index), index };
+  }
+
+  void
+  set_short(std::string_view key, std::string_view val)
+  {
+    set(key, val, false);
+  }
+
+  void
+  set_long(std::string_view key, std::string_view val)
+  {
+    set(key, val, true);
+  }
+
+  // Record documentation for an option, merging it with what was set on the
+  // command line under either name. Returns the index of its entry.
+  uint32_t
+  add_document(std::string_view short_name,
+               std::string_view long_name,
+               std::string_view value_type,
+               std::string_view description)
+  {
+    dirty = true;
+
+    const auto by_long = find(long_name);
+    const auto by_short = short_name.empty() ? no_entry : find(short_name);
+
+    auto index = by_long != no_entry ? by_long : by_short;
+    if (index == no_entry) {
+      index = entries.size();
+      entries.emplace_back();
+    }
+
+    if (by_long != no_entry && by_short != no_entry && by_long != by_short) {
       dk_err("Args: Option {},{} is set twice! \"{}\" is used.",
              short_name,
              long_name,
-             option->value.value());
+             view(entries[index].value));
     }
 
-    option->long_name = long_name;
-    option->short_name = short_name;
-    option->value_type = value_type;
-    option->description = description;
+    const auto long_span = intern(long_name);
+    const auto short_span = intern(short_name);
 
-    options_map[long_name] = option;
+    // Either name may have been set as the other kind, or on another entry
+    // which is then left without names.
+    for (const auto old : { by_long, by_short }) {
+      if (old != no_entry) {
+        unlink(view(entries[old].long_name));
+        unlink(view(entries[old].short_name));
+      }
+    }
+    if (by_short != no_entry && by_short != index) {
+      entries[by_short] = Entry{};
+    }
+
+    auto& entry = entries[index];
+    entry.long_name = long_span;
+    entry.short_name = short_span;
+    entry.value_type = append(value_type);
+    entry.description = append(description);
+
+    link(long_name, index, true);
     if (!short_name.empty()) {
-      options_map[short_name] = option;
+      link(short_name, index, false);
     }
 
-    return option;
+    return index;
   }
 
-  std::unordered_map<std::string, std::string>
-  to_map()
+  OptionsMap
+  to_map() const
   {
-    auto map = std::unordered_map<std::string, std::string>{};
+    if (dirty) {
+      pairs.clear();
+      for (const auto slot : slots) {
+        if (slot == empty_slot || entries[slot >> 1].has_value == 0) {
+          continue;
+        }
+        const auto name = slot_name(slot);
+        if (!name.empty()) {
+          pairs.emplace_back(name, view(entries[slot >> 1].value));
+        }
+      }
+      std::sort(pairs.begin(), pairs.end());
+      dirty = false;
+    }
+    return OptionsMap{ pairs };
+  }
 
-    for (const auto& pair : options_map) {
-      if (pair.first.empty() || pair.second == nullptr ||
-          !pair.second->value.has_value()) {
-        continue;
+  // The whole table as bytes, for `load`.
+  std::string
+  dump() const
+  {
+    const auto header = Header{ magic,
+                                static_cast<uint32_t>(entries.size()),
+                                static_cast<uint32_t>(slots.size()),
+                                used,
+                                static_cast<uint32_t>(pool.size()) };
+
+    auto out = std::string{};
+    out.resize(sizeof(header) + entries.size() * sizeof(Entry) +
+               slots.size() * sizeof(uint32_t) + pool.size());
+
+    auto* it = out.data();
+    const auto copy = [&](const void* data, size_t size) {
+      if (size > 0) {
+        std::memcpy(it, data, size);
+        it += size;
       }
+    };
+    copy(&header, sizeof(header));
+    copy(entries.data(), entries.size() * sizeof(Entry));
+    copy(slots.data(), slots.size() * sizeof(uint32_t));
+    copy(pool.data(), pool.size());
+    return out;
+  }
 
-      const auto& option = pair.second;
-      const auto& value = option->value.value();
+  // Replace the table with one written by `dump`. Returns false, leaving
+  // the table alone, when `data` is not such a table.
+  bool
+  load(std::string_view data)
+  {
+    auto header = Header{};
+    if (data.size() < sizeof(header)) {
+      return false;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+
+    const auto size = sizeof(header) +
+                      size_t{ header.entries } * sizeof(Entry) +
+                      size_t{ header.slots } * sizeof(uint32_t) + header.pool;
+    // A lookup stops at an empty slot, so there has to be one.
+    if (header.magic != magic || data.size() != size ||
+        (header.slots & (header.slots - 1)) != 0 ||
+        (header.slots == 0 ? header.used != 0 : header.used >= header.slots)) {
+      return false;
+    }
 
-      if (!option->long_name.empty()) {
-        map[option->long_name] = value;
+    auto loaded_entries = std::vector<Entry>(header.entries);
+    auto loaded_slots = std::vector<uint32_t>(header.slots);
+    const auto* it = data.data() + sizeof(header);
+    const auto copy = [&](void* out, size_t size) {
+      if (size > 0) {
+        std::memcpy(out, it, size);
+        it += size;
       }
+    };
+    copy(loaded_entries.data(), header.entries * sizeof(Entry));
+    copy(loaded_slots.data(), header.slots * sizeof(uint32_t));
 
-      if (!option->short_name.empty()) {
-        map[option->short_name] = value;
+    const auto in_pool = [&](Span span) {
+      return size_t{ span.offset } + span.size <= header.pool;
+    };
+    for (const auto& entry : loaded_entries) {
+      if (!in_pool(entry.short_name) || !in_pool(entry.long_name) ||
+          !in_pool(entry.value_type) || !in_pool(entry.description) ||
+          !in_pool(entry.value)) {
+        return false;
+      }
+    }
+    const auto taken = std::count_if(
+      loaded_slots.begin(), loaded_slots.end(), [](uint32_t slot) {
+        return slot != empty_slot;
+      });
+    if (static_cast<size_t>(taken) != header.used) {
+      return false;
+    }
+    for (const auto slot : loaded_slots) {
+      if (slot != empty_slot && (slot >> 1) >= header.entries) {
+        return false;
       }
     }
 
-    return map;
+    entries = std::move(loaded_entries);
+    slots = std::move(loaded_slots);
+    used = header.used;
+    pool.assign(it, header.pool);
+    dirty = true;
+    return true;
+  }
+};
+
+// How well `query` matches `text` as a subsequence, or -1 when it does not.
+// Each character is located with memchr, which scans many bytes per step;
+// consecutive characters and characters starting a word score higher,
+// skipped characters lower.
+static int
+fuzzy_score(std::string_view text, std::string_view query)
+{
+  int score = 0;
+  size_t pos = 0;
+  size_t last = std::string_view::npos;
+
+  for (const auto c : query) {
+    const auto* hit = static_cast<const char*>(
+      std::memchr(text.data() + pos, c, text.size() - pos));
+    if (hit == nullptr) {
+      return -1;
+    }
+
+    const auto at = static_cast<size_t>(hit - text.data());
+    if (last != std::string_view::npos && at == last + 1) {
+      score += 8;
+    }
+    if (at == 0 || std::string_view{ "-_./ " }.find(text[at - 1]) !=
+                     std::string_view::npos) {
+      score += 4;
+    }
+    score -= static_cast<int>(std::min<size_t>(at - pos, 8));
+
+    last = at;
+    pos = at + 1;
+  }
+
+  return std::max(0, score + 64 - static_cast<int>(text.size()));
+}
+
+// Completion candidates behind a prefix trie. Candidates keep the order
+// they were added in; the trie is built over them sorted, so every node
+// covers a contiguous range of the sorted list and a prefix lookup is one
+// walk down the trie, however many candidates there are.
+class CompletionIndex
+{
+public:
+  struct Candidate
+  {
+    std::string text;
+    std::string description;
+  };
+
+private:
+  struct Node
+  {
+    uint32_t first_child = 0; // 0 for none; the root is never a child
+    uint32_t next_sibling = 0;
+    uint32_t begin = 0; // range in `sorted`
+    uint32_t end = 0;
+    char byte = 0;
+  };
+
+  std::vector<Candidate> candidates;
+  std::vector<uint32_t> sorted;
+  std::vector<Node> nodes;
+
+public:
+  void
+  clear()
+  {
+    candidates.clear();
+    sorted.clear();
+    nodes.clear();
+  }
+
+  void
+  add(std::string text, std::string description)
+  {
+    candidates.push_back({ std::move(text), std::move(description) });
+  }
+
+  void
+  build()
+  {
+    sorted.resize(candidates.size());
+    for (uint32_t i = 0; i < sorted.size(); ++i) {
+      sorted[i] = i;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [&](auto a, auto b) {
+      return candidates[a].text < candidates[b].text;
+    });
+
+    nodes.assign(1, Node{ .end = static_cast<uint32_t>(sorted.size()) });
+    for (uint32_t rank = 0; rank < sorted.size(); ++rank) {
+      uint32_t node = 0;
+      for (const auto c : candidates[sorted[rank]].text) {
+        auto child = nodes[node].first_child;
+        auto prev = uint32_t{ 0 };
+        while (child != 0 && nodes[child].byte != c) {
+          prev = child;
+          child = nodes[child].next_sibling;
+        }
+
+        if (child == 0) {
+          child = nodes.size();
+          nodes.push_back(Node{ .begin = rank, .byte = c });
+          if (prev == 0) {
+            nodes[node].first_child = child;
+          }
+          else {
+            nodes[prev].next_sibling = child;
+          }
+        }
+
+        nodes[child].end = rank + 1;
+        node = child;
+      }
+    }
+  }
+
+  const Candidate&
+  operator[](uint32_t id) const
+  {
+    return candidates[id];
+  }
+
+  size_t
+  size() const
+  {
+    return candidates.size();
+  }
+
+  // Ids of the candidates starting with `prefix`, in insertion order.
+  std::vector<uint32_t>
+  with_prefix(std::string_view prefix) const
+  {
+    if (nodes.empty()) {
+      return {};
+    }
+
+    uint32_t node = 0;
+    for (const auto c : prefix) {
+      node = nodes[node].first_child;
+      while (node != 0 && nodes[node].byte != c) {
+        node = nodes[node].next_sibling;
+      }
+      if (node == 0) {
+        return {};
+      }
+    }
+
+    auto ids = std::vector<uint32_t>(sorted.begin() + nodes[node].begin,
+                                     sorted.begin() + nodes[node].end);
+    std::sort(ids.begin(), ids.end());
+    return ids;
   }
 };
 
 } // namespace details
 
-class Args
+// Command line parsed into subcommands, options and arguments. Args owns
+// copies of everything; ArgsView keeps std::string_views into argv, which
+// must then outlive it, and does not allocate per argument.
+template<typename String>
+class BasicArgs
 {
 public:
-  std::string program;
-  std::deque<std::string> subcommands;
-  std::deque<std::string> rest_arguments;
-  std::deque<std::string> extra_arguments;
+  String program;
+  std::deque<String> subcommands;
+  std::deque<String> rest_arguments;
+  std::deque<String> extra_arguments;
   details::Options options;
 
 private:
-  std::set<std::pair<std::string, std::string>> commands_doc;
-  std::set<std::shared_ptr<details::Option>> options_doc;
+  std::set<std::pair<String, String>> commands_doc;
+  std::vector<uint32_t> options_doc;
+  std::deque<std::string> strings;
+  details::CompletionIndex completion_index;
+  bool completion_dirty = true;
+
+  // Own a copy of `str` for as long as the arguments live.
+  String
+  intern(std::string str)
+  {
+    if constexpr (std::is_same_v<String, std::string>) {
+      return str;
+    }
+    else {
+      return strings.emplace_back(std::move(str));
+    }
+  }
 
 public:
-  Args(int argc, const char* argv[])
+  BasicArgs(int argc, const char* argv[])
   {
     program = argv[0];
 
@@ -195,7 +748,7 @@ public:
     }
 
     while (i < argc) {
-      const auto arg = std::string{ argv[i] };
+      const auto arg = String{ argv[i] };
       const auto arg_size = arg.size();
 
       if (arg == "--") {
@@ -206,36 +759,36 @@ public:
       else if (arg_size > 1 && arg[0] == '-' && arg[1] != '-') {
         for (int j = 1; j < arg_size; j += 1) {
           if (arg[j] == '=') {
-            options.set_short(std::string{ arg[j - 1] }, arg.substr(j + 1));
+            options.set_short(arg.substr(j - 1, 1), arg.substr(j + 1));
             break;
           }
           else if (j == arg_size - 1 && i + 1 < argc && argv[i + 1][0] != '-') {
             i += 1;
-            options.set_short(std::string{ arg[j] }, std::string{ argv[i] });
+            options.set_short(arg.substr(j, 1), String{ argv[i] });
             break;
           }
           else {
-            options.set_short(std::string{ arg[j] }, std::string{ "true" });
+            options.set_short(arg.substr(j, 1), String{ "true" });
           }
         }
       }
       else if (arg_size > 2 && arg[0] == '-' && arg[1] == '-') {
         auto eq = arg.find('=');
-        if (eq != std::string::npos) {
+        if (eq != String::npos) {
           options.set_long(arg.substr(2, eq - 2), arg.substr(eq + 1));
         }
         else if (i + 1 < argc && argv[i + 1][0] != '-') {
           i += 1;
-          options.set_long(arg.substr(2), std::string{ argv[i] });
+          options.set_long(arg.substr(2), String{ argv[i] });
         }
         else {
-          options.set_long(arg.substr(2), std::string{ "true" });
+          options.set_long(arg.substr(2), String{ "true" });
         }
       }
       else {
         int j = i + 1;
         while (j < argc) {
-          auto arg = std::string{ argv[j] };
+          const auto arg = std::string_view{ argv[j] };
           if (arg == "--") {
             break;
           }
@@ -257,66 +810,114 @@ public:
   {
     parse_commands(doc);
     parse_options(doc);
+    completion_dirty = true;
   }
 
-  std::deque<std::pair<std::string, std::string>>
-  complete(std::string prefix)
+  // Same as documenting the schema's help text, without parsing it.
+  template<typename Schema>
+    requires requires(const Schema& schema) {
+      schema.commands;
+      schema.options;
+    }
+  void
+  document(const Schema& schema)
   {
-    auto completions = std::deque<std::pair<std::string, std::string>>{};
+    completion_dirty = true;
 
-    bool check_long = false;
-    bool check_short = false;
-    bool check_command = false;
+    for (const auto& command : schema.commands) {
+      commands_doc.insert({ intern(std::string{ command.name }),
+                            intern(std::string{ command.description }) });
+    }
 
-    if (prefix.empty()) {
-      check_long = true;
-      check_short = true;
-      check_command = true;
+    for (const auto& option : schema.options) {
+      const auto index = options.add_document(option.short_name,
+                                               option.long_name,
+                                               schema.value_type(option),
+                                               schema.description(option));
+      if (std::find(options_doc.begin(), options_doc.end(), index) ==
+          options_doc.end()) {
+        options_doc.push_back(index);
+      }
     }
-    else if (prefix == "-") {
-      check_long = true;
-      check_short = true;
+  }
+
+  struct CompleteOptions
+  {
+    size_t limit = 0;   // 0 for no limit
+    bool fuzzy = false; // add candidates containing the prefix as a subsequence
+  };
+
+  // Commands and options starting with `prefix`; an empty prefix lists them
+  // all. Short options only complete '-' or their own flag. An exact match
+  // comes first, then the others in documentation order; with `fuzzy`,
+  // subsequence matches follow, best first.
+  std::deque<std::pair<std::string, std::string>>
+  complete(std::string_view prefix, const CompleteOptions& opts = {})
+  {
+    if (completion_dirty) {
+      build_completion_index();
     }
-    else if (prefix[0] == '-') {
-      if (prefix[1] == '-') {
-        check_long = true;
+
+    auto ids = completion_index.with_prefix(prefix);
+    std::stable_partition(ids.begin(), ids.end(), [&](auto id) {
+      return completion_index[id].text == prefix;
+    });
+
+    if (opts.fuzzy && !prefix.empty() &&
+        (opts.limit == 0 || ids.size() < opts.limit)) {
+      const bool want_option = prefix[0] == '-';
+      auto ranked = std::vector<std::pair<int, uint32_t>>{};
+      for (uint32_t id = 0; id < completion_index.size(); ++id) {
+        const auto& text = completion_index[id].text;
+        if ((text[0] == '-') != want_option || text.starts_with(prefix)) {
+          continue;
+        }
+        if (const auto score = details::fuzzy_score(text, prefix); score >= 0) {
+          ranked.emplace_back(-score, id);
+        }
       }
-      else {
-        check_short = true;
+      std::sort(ranked.begin(), ranked.end());
+      for (const auto& [score, id] : ranked) {
+        ids.push_back(id);
       }
     }
-    else {
-      check_command = true;
-    }
 
-    const auto pos = prefix.find_first_not_of('-');
-    if (pos != std::string::npos) {
-      prefix = prefix.substr(pos);
+    if (opts.limit != 0 && ids.size() > opts.limit) {
+      ids.resize(opts.limit);
     }
-    else {
-      prefix.clear();
+
+    auto completions = std::deque<std::pair<std::string, std::string>>{};
+    for (const auto id : ids) {
+      completions.emplace_back(completion_index[id].text,
+                               completion_index[id].description);
     }
+    return completions;
+  }
 
-    for (const auto& option : options_doc) {
-      if (check_long && !option->long_name.empty() &&
-          option->long_name.starts_with(prefix)) {
-        completions.emplace_back("--" + option->long_name, option->description);
+private:
+  void
+  build_completion_index()
+  {
+    completion_index.clear();
+    for (const auto index : options_doc) {
+      const auto option = options.at(index);
+      const auto description = std::string{ option.description };
+      if (!option.long_name.empty()) {
+        completion_index.add(dk_fmt("--{}", option.long_name), description);
       }
-      if (check_short && !option->short_name.empty()) {
-        completions.emplace_back("-" + option->short_name, option->description);
+      if (!option.short_name.empty()) {
+        completion_index.add(dk_fmt("-{}", option.short_name), description);
       }
     }
-
     for (const auto& [cmd, desc] : commands_doc) {
-      if (check_command && cmd.starts_with(prefix)) {
-        completions.emplace_back(cmd, desc);
+      if (!cmd.empty()) {
+        completion_index.add(std::string{ cmd }, std::string{ desc });
       }
     }
-
-    return completions;
+    completion_index.build();
+    completion_dirty = false;
   }
 
-private:
   void
   parse_commands(const std::string& doc)
   {
@@ -349,7 +950,7 @@ private:
           continue;
         }
 
-        commands_doc.insert({ match.str(1), match.str(2) });
+        commands_doc.insert({ intern(match.str(1)), intern(match.str(2)) });
       }
     }
   }
@@ -398,9 +999,12 @@ private:
           continue;
         }
 
-        auto option = options.add_document(
+        const auto index = options.add_document(
           match.str(1), match.str(2), match.str(3), match.str(4));
-        options_doc.insert(std::move(option));
+        if (std::find(options_doc.begin(), options_doc.end(), index) ==
+            options_doc.end()) {
+          options_doc.push_back(index);
+        }
       }
     }
   }
@@ -431,17 +1035,22 @@ private:
   }
 };
 
+using Args = BasicArgs<std::string>;
+using ArgsView = BasicArgs<std::string_view>;
+
 } // namespace devkit
 
 #ifndef DOCTEST_CONFIG_DISABLE
 #include <doctest/doctest.h>
 
-TEST_CASE("testing args")
+#include <chrono>
+
+TEST_CASE_TEMPLATE("testing args", Args, devkit::Args, devkit::ArgsView)
 {
   SUBCASE("-ab")
   {
     auto argv = std::array{ "test", "-ab" };
-    auto args = devkit::Args(argv.size(), argv.data());
+    auto args = Args(argv.size(), argv.data());
     CHECK(args.program == "test");
     CHECK(args.options.to_map()["a"] == "true");
     CHECK(args.options.to_map()["b"] == "true");
@@ -450,7 +1059,7 @@ TEST_CASE("testing args")
   SUBCASE("sub -a -bc=2 --flag=1")
   {
     auto argv = std::array{ "test", "sub", "-a", "-bc=2", "--flag=1" };
-    auto args = devkit::Args(argv.size(), argv.data());
+    auto args = Args(argv.size(), argv.data());
     CHECK(args.program == "test");
     CHECK(args.subcommands[0] == "sub");
     CHECK(args.options.to_map()["a"] == "true");
@@ -465,7 +1074,7 @@ TEST_CASE("testing args")
       std::array{ "test",      "sub",    "-a", "-bc",     "2",  "--path",
                   "your_path", "--flag", "--", "--build", "--", "-j3" };
 
-    auto args = devkit::Args(argv.size(), argv.data());
+    auto args = Args(argv.size(), argv.data());
 
     CHECK(args.program == "test");
     CHECK(args.subcommands[0] == "sub");
@@ -484,7 +1093,7 @@ TEST_CASE("testing args")
     auto argv = std::array{ "test",      "sub",   "-a",   "--path",
                             "your_path", "rest1", "rest2" };
 
-    auto args = devkit::Args(argv.size(), argv.data());
+    auto args = Args(argv.size(), argv.data());
 
     CHECK(args.program == "test");
     CHECK(args.subcommands[0] == "sub");
@@ -500,7 +1109,7 @@ TEST_CASE("testing args")
       std::array{ "test",  "sub", "-a",      "--path", "your_path", "rest1",
                   "rest2", "--",  "--build", "--",     "-j3" };
 
-    auto args = devkit::Args(argv.size(), argv.data());
+    auto args = Args(argv.size(), argv.data());
 
     CHECK(args.program == "test");
     CHECK(args.subcommands[0] == "sub");
@@ -514,7 +1123,10 @@ TEST_CASE("testing args")
   }
 }
 
-TEST_CASE("testing document")
+TEST_CASE_TEMPLATE("testing document",
+                   Args,
+                   devkit::Args,
+                   devkit::ArgsView)
 {
   const auto doc = R"(
       Usage: test args [-abc] [--path --store]
@@ -540,7 +1152,7 @@ TEST_CASE("testing document")
       std::array{ "test",  "sub", "-a",      "--path", "your_path", "rest1",
                   "rest2", "--",  "--build", "--",     "-j3" };
 
-    auto args = devkit::Args(argv.size(), argv.data());
+    auto args = Args(argv.size(), argv.data());
     args.document(doc);
 
     auto map = args.options.to_map();
@@ -572,15 +1184,296 @@ TEST_CASE("testing document")
   {
     auto argv = std::array{ "test", "sub", "-a", "-A" };
 
-    auto args = devkit::Args(argv.size(), argv.data());
+    auto args = Args(argv.size(), argv.data());
     args.document(doc);
 
     auto map = args.options.to_map();
 
     CHECK(args.program == "test");
     CHECK(args.subcommands[0] == "sub");
+    CHECK(map.size() == 2);
     CHECK(map["a"] == "true");
     CHECK(map["A"] == "true");
+    CHECK(args.options["a"] == args.options["A"]);
+  }
+
+  SUBCASE("sub --a")
+  {
+    auto argv = std::array{ "test", "sub", "--a" };
+
+    auto args = Args(argv.size(), argv.data());
+    args.document(doc);
+
+    auto map = args.options.to_map();
+
+    CHECK(map.size() == 2);
+    CHECK(map["a"] == "true");
+    CHECK(map["A"] == "true");
+    CHECK(args.options["a"]->long_name == "A");
+  }
+}
+
+TEST_CASE("testing options")
+{
+  auto options = devkit::details::Options{};
+  options.set_short("a", "true");
+  options.set_long("path", "your_path");
+  options.set_long("C", "file.txt");
+  options.add_document("a", "all", "", "This is a");
+  options.add_document("c", "C", "file", "This is c");
+  options.add_document("", "store", "dir", "This is store");
+
+  SUBCASE("aliases")
+  {
+    CHECK(options.size() == 4);
+    CHECK(options["a"] == options["all"]);
+    CHECK(options["c"] == options["C"]);
+    CHECK(!(options["a"] == options["c"]));
+    CHECK(options["c"]->value == "file.txt");
+    CHECK(options["all"]->short_name == "a");
+    CHECK(options["store"]->value_type == "dir");
+    CHECK(!options["store"]->value.has_value());
+    CHECK(!options["missing"]->value.has_value());
+    CHECK(options["missing"]->to_string().empty());
+    CHECK(options["missing"] == options["missing"]);
+    CHECK(!(options["missing"] == options["other"]));
+  }
+
+  SUBCASE("map")
+  {
+    const auto map = options.to_map();
+    CHECK(map.size() == 5);
+    CHECK(map["a"] == "true");
+    CHECK(map["all"] == "true");
+    CHECK(map["c"] == "file.txt");
+    CHECK(map.find("store") == map.end());
+    CHECK(std::is_sorted(map.begin(), map.end()));
+    CHECK(options.to_map().begin() == map.begin());
+  }
+
+  SUBCASE("dump and load")
+  {
+    const auto data = options.dump();
+
+    auto loaded = devkit::details::Options{};
+    REQUIRE(loaded.load(data));
+    CHECK(loaded.dump() == data);
+    CHECK(loaded["C"] == loaded["c"]);
+    CHECK(loaded["all"]->description == "This is a");
+    CHECK(loaded.to_map()["path"] == "your_path");
+
+    loaded.set_long("store", "/tmp");
+    CHECK(loaded["store"]->value == "/tmp");
+    CHECK(loaded["store"]->value_type == "dir");
+
+    CHECK(!loaded.load(data.substr(1)));
+    CHECK(!loaded.load(""));
+    CHECK(loaded["store"]->value == "/tmp");
+
+    // every slot taken, so a lookup of a missing name would never stop
+    uint32_t header[5];
+    std::memcpy(header, data.data(), sizeof(header));
+    auto full = data;
+    const auto slots_at = data.size() - header[4] - header[2] * 4;
+    for (uint32_t i = 0; i < header[2]; ++i) {
+      const uint32_t slot = 0;
+      std::memcpy(full.data() + slots_at + i * 4, &slot, 4);
+    }
+    header[3] = header[2];
+    std::memcpy(full.data(), header, sizeof(header));
+    CHECK(!loaded.load(full));
+    CHECK(loaded["store"]->value == "/tmp");
+  }
+}
+
+TEST_CASE("testing complete")
+{
+  const auto doc = R"(
+      Usage: test [command] [options]
+
+      Commands:
+        build           Build the workspace
+        bench           Run the benchmarks
+        clean           Remove build outputs
+
+      Options:
+        -b, --buildtype <type>   Build type
+        -j, --jobs <num>         Parallel jobs
+        -v, --verbose            Verbose output
+      )";
+
+  auto argv = std::array{ "test" };
+  auto args = devkit::Args(argv.size(), argv.data());
+  args.document(doc);
+
+  const auto texts = [](const auto& completions) {
+    auto result = std::vector<std::string>{};
+    for (const auto& [text, desc] : completions) {
+      result.push_back(text);
+    }
+    return result;
+  };
+
+  SUBCASE("prefix")
+  {
+    using list = std::vector<std::string>;
+    CHECK(texts(args.complete("")) == list{ "--buildtype",
+                                            "-b",
+                                            "--jobs",
+                                            "-j",
+                                            "--verbose",
+                                            "-v",
+                                            "bench",
+                                            "build",
+                                            "clean" });
+    CHECK(texts(args.complete("b")) == list{ "bench", "build" });
+    CHECK(texts(args.complete("bu")) == list{ "build" });
+    CHECK(texts(args.complete("x")).empty());
+    CHECK(texts(args.complete("--")) ==
+          list{ "--buildtype", "--jobs", "--verbose" });
+    CHECK(texts(args.complete("-")) == list{ "--buildtype",
+                                             "-b",
+                                             "--jobs",
+                                             "-j",
+                                             "--verbose",
+                                             "-v" });
+    CHECK(texts(args.complete("-j")) == list{ "-j" });
+    CHECK(texts(args.complete("--v")) == list{ "--verbose" });
+    CHECK(args.complete("--jobs").front().second == "Parallel jobs");
+  }
+
+  SUBCASE("fuzzy")
+  {
+    const auto fuzzy = devkit::Args::CompleteOptions{ .fuzzy = true };
+    auto result = texts(args.complete("bd", fuzzy));
+    REQUIRE(result.size() == 1);
+    CHECK(result[0] == "build");
+
+    result = texts(args.complete("--bt", fuzzy));
+    REQUIRE(result.size() == 1);
+    CHECK(result[0] == "--buildtype");
+
+    // Prefix matches first, then the closest subsequence match.
+    result = texts(args.complete("--v", fuzzy));
+    REQUIRE(result.size() == 1);
+    CHECK(result[0] == "--verbose");
+
+    result = texts(args.complete("cn", fuzzy));
+    REQUIRE(result.size() == 1);
+    CHECK(result[0] == "clean");
+  }
+
+  SUBCASE("limit")
+  {
+    auto result =
+      texts(args.complete("-", { .limit = 2, .fuzzy = true }));
+    CHECK(result == std::vector<std::string>{ "--buildtype", "-b" });
+  }
+}
+
+TEST_CASE("benchmark args" * doctest::skip())
+{
+  // an alias forwarding a large file list after "--", xargs style
+  auto paths = std::vector<std::string>{};
+  for (int i = 0; i < 100000; ++i) {
+    paths.push_back(dk_fmt("src/module_{}/file_{}.cpp", i / 100, i));
+  }
+  auto argv = std::vector<const char*>{ "sk", "build", "-j", "8", "--" };
+  for (const auto& path : paths) {
+    argv.push_back(path.c_str());
+  }
+
+  const auto measure = [&]<typename Args>() {
+    constexpr int rounds = 20;
+    size_t count = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+      const auto args = Args(argv.size(), argv.data());
+      count += args.extra_arguments.size();
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    CHECK(count == rounds * paths.size());
+    return std::chrono::duration<double, std::micro>(elapsed).count() / rounds;
+  };
+
+  const auto owned = measure.template operator()<devkit::Args>();
+  const auto view = measure.template operator()<devkit::ArgsView>();
+  MESSAGE(dk_fmt("{} arguments: Args {:.0f}us, ArgsView {:.0f}us",
+                 argv.size(),
+                 owned,
+                 view));
+}
+#endif
+
+#ifdef DK_BENCH_ARGS
+#include "bench.hh"
+
+namespace
+{
+
+auto bench_argv = std::array{ "sk",      "build",    "pkg",    "-y",
+                              "--jobs",  "8",        "--type", "release",
+                              "-v",      "--store",  "~/.st",  "--path",
+                              "src",     "rest",     "--",     "--cmake",
+                              "-DX=1" };
+
+constexpr auto bench_doc = R"(
+    Usage: sk <command> [options]
+
+    Commands:
+      build           Build the workspace
+      test            Run the tests
+      clean           Remove build outputs
+      deploy          Copy the install tree
+      docs            Build the documentation
+      flake           Enter the dev shell
+
+    Options:
+      -h, --help          Show help
+      -y, --confirm       Do not ask
+      -j, --jobs <num>    Parallel jobs
+      -t, --type <type>   Build type
+      -v, --verbose       Verbose output
+      --store <dir>       Store path
+      --path <dir>        Workspace path
+    )";
+
+} // namespace
+
+DK_BENCH_CASE("Args construction")
+{
+  for (auto _ : state) {
+    auto args = devkit::Args(bench_argv.size(), bench_argv.data());
+    devkit::bench::do_not_optimize(args);
+  }
+}
+
+DK_BENCH_CASE("ArgsView construction")
+{
+  for (auto _ : state) {
+    auto args = devkit::ArgsView(bench_argv.size(), bench_argv.data());
+    devkit::bench::do_not_optimize(args);
+  }
+}
+
+DK_BENCH_CASE("Options::to_map")
+{
+  auto args = devkit::Args(bench_argv.size(), bench_argv.data());
+  args.document(bench_doc);
+  const auto table = args.options.dump();
+  for (auto _ : state) {
+    // Loading drops the cached pairs, so every call rebuilds them.
+    args.options.load(table);
+    devkit::bench::do_not_optimize(args.options.to_map());
+  }
+}
+
+DK_BENCH_CASE("Args::document")
+{
+  for (auto _ : state) {
+    auto args = devkit::Args(bench_argv.size(), bench_argv.data());
+    args.document(bench_doc);
+    devkit::bench::do_not_optimize(args);
   }
 }
 #endif
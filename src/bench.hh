@@ -0,0 +1,393 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <sched.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "fmt.hh"
+
+// Registers a microbenchmark. Headers keep them in a `#ifdef DK_BENCH_<NAME>`
+// block next to their tests, args.hh in `DK_BENCH_ARGS`. test/generator.py
+// --bench turns each header into a `<header>_bench` executable that defines
+// only its own macro, so the benches of included headers are not rerun:
+//
+//   DK_BENCH_CASE("tokens")
+//   {
+//     for (auto _ : state) {
+//       devkit::bench::do_not_optimize(arg.tokens());
+//     }
+//   }
+#define DK_BENCH_CONCAT_(A, B) A##B
+#define DK_BENCH_CONCAT(A, B) DK_BENCH_CONCAT_(A, B)
+#define DK_BENCH_CASE_(FN, NAME)                                               \
+  static void FN(devkit::bench::State& state);                                 \
+  static const devkit::bench::Register DK_BENCH_CONCAT(FN, _reg){ NAME, FN };  \
+  static void FN([[maybe_unused]] devkit::bench::State& state)
+#define DK_BENCH_CASE(NAME)                                                    \
+  DK_BENCH_CASE_(DK_BENCH_CONCAT(dk_bench_, __COUNTER__), NAME)
+
+namespace devkit
+{
+
+namespace bench
+{
+
+// Keeps `value` from being optimized away, without storing it anywhere.
+template<typename T>
+inline void
+do_not_optimize(const T& value)
+{
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Iterations of one timed repetition: `for (auto _ : state)` runs the body
+// `iterations` times. The clock runs from the start of the loop to its end,
+// so setup before it and teardown after it are not timed.
+class State
+{
+private:
+  using Clock = std::chrono::steady_clock;
+
+  size_t iterations;
+  Clock::time_point start;
+  Clock::time_point stop;
+
+public:
+  explicit State(size_t iterations)
+    : iterations{ iterations }
+  {}
+
+  struct Iterator
+  {
+    size_t left;
+    State* state;
+
+    bool
+    operator!=(const Iterator&) const
+    {
+      if (left != 0) {
+        return true;
+      }
+      state->stop = Clock::now();
+      return false;
+    }
+
+    void
+    operator++()
+    {
+      --left;
+    }
+
+    // Has a destructor, so the unused loop variable draws no warning.
+    struct Value
+    {
+      ~Value() {}
+    };
+
+    Value
+    operator*() const
+    {
+      return {};
+    }
+  };
+
+  Iterator
+  begin()
+  {
+    start = Clock::now();
+    stop = start;
+    return { iterations, this };
+  }
+
+  Iterator
+  end()
+  {
+    return { 0, this };
+  }
+
+  // Nanoseconds the loop ran, 0 before it did.
+  double
+  elapsed() const
+  {
+    return std::chrono::duration<double, std::nano>(stop - start).count();
+  }
+};
+
+struct Case
+{
+  const char* name;
+  void (*fn)(State&);
+};
+
+inline std::vector<Case>&
+registry()
+{
+  static auto cases = std::vector<Case>{};
+  return cases;
+}
+
+struct Register
+{
+  Register(const char* name, void (*fn)(State&))
+  {
+    registry().push_back({ name, fn });
+  }
+};
+
+struct Result
+{
+  std::string name;
+  size_t iterations;
+  double median; // nanoseconds per iteration
+  double min;
+  double mad; // median absolute deviation
+};
+
+struct Config
+{
+  size_t repetitions = 15;
+  std::chrono::nanoseconds min_time = std::chrono::milliseconds{ 20 };
+  int cpu = -1; // pin to this CPU; -1 for the one we start on
+  std::string_view filter = {};
+  bool json = false;
+};
+
+namespace details
+{
+
+static double
+median(std::vector<double> values)
+{
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  const auto mid = values.size() / 2;
+  return values.size() % 2 != 0 ? values[mid]
+                                 : (values[mid - 1] + values[mid]) / 2;
+}
+
+static double
+time_once(const Case& bench, size_t iterations)
+{
+  auto state = State{ iterations };
+  bench.fn(state);
+  return state.elapsed();
+}
+
+// Pins the process to one CPU, so repetitions don't pay for migrations.
+static bool
+pin_cpu(int cpu)
+{
+  if (cpu < 0) {
+    cpu = sched_getcpu();
+  }
+  if (cpu < 0) {
+    return false;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+} // namespace details
+
+// Finds an iteration count that runs for at least `min_time`, which doubles
+// as the warmup, then times `repetitions` runs of that many iterations.
+static Result
+measure(const Case& bench, const Config& config)
+{
+  const auto target = static_cast<double>(config.min_time.count());
+
+  auto iterations = size_t{ 1 };
+  for (auto elapsed = details::time_once(bench, iterations); elapsed < target;
+       elapsed = details::time_once(bench, iterations)) {
+    const auto scale = elapsed > 0 ? 1.4 * target / elapsed : 10.0;
+    iterations = static_cast<size_t>(
+      std::clamp(iterations * scale, iterations + 1.0, iterations * 10.0));
+  }
+
+  auto samples = std::vector<double>{};
+  for (size_t i = 0; i < std::max<size_t>(config.repetitions, 1); ++i) {
+    samples.push_back(details::time_once(bench, iterations) /
+                      static_cast<double>(iterations));
+  }
+
+  const auto median = details::median(samples);
+  auto deviations = std::vector<double>{};
+  for (const auto sample : samples) {
+    deviations.push_back(sample > median ? sample - median : median - sample);
+  }
+
+  return { bench.name,
+           iterations,
+           median,
+           *std::min_element(samples.begin(), samples.end()),
+           details::median(deviations) };
+}
+
+inline int
+run(const Config& config)
+{
+  if (!details::pin_cpu(config.cpu)) {
+    dk_err("bench: Cannot pin to a CPU, timings may be noisy.");
+  }
+
+  auto results = std::vector<Result>{};
+  for (const auto& bench : registry()) {
+    if (std::string_view{ bench.name }.find(config.filter) ==
+        std::string_view::npos) {
+      continue;
+    }
+
+    results.push_back(measure(bench, config));
+    if (!config.json) {
+      const auto& result = results.back();
+      fmt::println("{:<40} {:>12.1f} ns  ±{:>5.1f}%  min {:>12.1f} ns  ({})",
+                   result.name,
+                   result.median,
+                   result.median > 0 ? 100 * result.mad / result.median : 0,
+                   result.min,
+                   result.iterations);
+    }
+  }
+
+  if (config.json) {
+    fmt::print("[");
+    for (size_t i = 0; i < results.size(); ++i) {
+      const auto& result = results[i];
+      fmt::print("{}\n  {{ \"name\": \"{}\", \"iterations\": {}, "
+                 "\"median_ns\": {:.2f}, \"min_ns\": {:.2f}, "
+                 "\"mad_ns\": {:.2f} }}",
+                 i == 0 ? "" : ",",
+                 result.name,
+                 result.iterations,
+                 result.median,
+                 result.min,
+                 result.mad);
+    }
+    fmt::print("\n]\n");
+  }
+  return 0;
+}
+
+// Command line of the generated executables:
+//   [--filter <text>] [--repetitions <n>] [--min-time <ms>] [--cpu <n>]
+//   [--json]
+inline int
+run(int argc, char** argv)
+{
+  auto config = Config{};
+  for (int i = 1; i < argc; ++i) {
+    const auto arg = std::string_view{ argv[i] };
+    const auto* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+    if (arg == "--json") {
+      config.json = true;
+    }
+    else if (value == nullptr) {
+      dk_err("bench: Missing value for {}.", arg);
+      return 1;
+    }
+    else if (arg == "--filter") {
+      config.filter = argv[++i];
+    }
+    else if (arg == "--repetitions") {
+      config.repetitions = std::strtoul(argv[++i], nullptr, 10);
+    }
+    else if (arg == "--min-time") {
+      config.min_time =
+        std::chrono::milliseconds{ std::strtoul(argv[++i], nullptr, 10) };
+    }
+    else if (arg == "--cpu") {
+      config.cpu = std::atoi(argv[++i]);
+    }
+    else {
+      dk_err("bench: Unknown option {}.", arg);
+      return 1;
+    }
+  }
+  return run(config);
+}
+
+} // namespace bench
+
+} // namespace devkit
+
+#ifdef DK_BENCH_IMPLEMENT_WITH_MAIN
+int
+main(int argc, char** argv)
+{
+  return devkit::bench::run(argc, argv);
+}
+#endif
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <thread>
+
+TEST_CASE("testing bench")
+{
+  SUBCASE("median")
+  {
+    using devkit::bench::details::median;
+    CHECK(median({}) == 0);
+    CHECK(median({ 3 }) == 3);
+    CHECK(median({ 5, 1, 3 }) == 3);
+    CHECK(median({ 4, 1, 3, 2 }) == 2.5);
+  }
+
+  SUBCASE("state")
+  {
+    auto count = 0;
+    for (auto _ : devkit::bench::State{ 7 }) {
+      ++count;
+    }
+    CHECK(count == 7);
+  }
+
+  SUBCASE("setup")
+  {
+    // Only the loop is timed.
+    const auto bench = devkit::bench::Case{
+      "setup", [](devkit::bench::State& state) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{ 20 });
+        for (auto _ : state) {
+          devkit::bench::do_not_optimize(state);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds{ 20 });
+      }
+    };
+    CHECK(devkit::bench::details::time_once(bench, 10) < 10e6);
+  }
+
+  SUBCASE("measure")
+  {
+    static auto calls = size_t{ 0 };
+    const auto bench = devkit::bench::Case{
+      "count", [](devkit::bench::State& state) {
+        for (auto _ : state) {
+          devkit::bench::do_not_optimize(++calls);
+        }
+      }
+    };
+
+    const auto result = devkit::bench::measure(
+      bench,
+      { .repetitions = 5, .min_time = std::chrono::microseconds{ 100 } });
+    CHECK(result.name == "count");
+    CHECK(result.iterations > 1);
+    CHECK(result.median > 0);
+    CHECK(result.min <= result.median);
+    CHECK(calls >= result.iterations * 5);
+  }
+}
+#endif
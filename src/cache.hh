@@ -0,0 +1,156 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+
+#include "fmt.hh"
+
+namespace devkit
+{
+
+// Small key/value cache kept as one file per key under `dir`, normally
+// `<store>/cache/<name>`. Writes go through a temporary file and a rename, so
+// concurrent sk processes never see a torn entry.
+class Cache
+{
+private:
+  std::filesystem::path dir;
+
+  static uint64_t
+  hash(std::string_view key)
+  {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const auto c : key) {
+      h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+    }
+    return h;
+  }
+
+  std::filesystem::path
+  entry(std::string_view key) const
+  {
+    return dir / dk_fmt("{:016x}", hash(key));
+  }
+
+public:
+  explicit Cache(std::filesystem::path dir)
+    : dir{ std::move(dir) }
+  {}
+
+  const std::filesystem::path&
+  path() const
+  {
+    return dir;
+  }
+
+  // Keys must not contain newlines; the key is stored in front of the value
+  // so hash collisions read as misses.
+  std::optional<std::string>
+  get(std::string_view key) const
+  {
+    auto file = std::ifstream{ entry(key), std::ios::binary };
+    if (!file) {
+      return std::nullopt;
+    }
+
+    auto stored = std::string{};
+    if (!std::getline(file, stored) || stored != key) {
+      return std::nullopt;
+    }
+
+    auto ss = std::stringstream{};
+    ss << file.rdbuf();
+    return ss.str();
+  }
+
+  // Age of an entry, measured from the last put.
+  std::optional<std::chrono::seconds>
+  age(std::string_view key) const
+  {
+    auto ec = std::error_code{};
+    const auto time = std::filesystem::last_write_time(entry(key), ec);
+    if (ec) {
+      return std::nullopt;
+    }
+    return std::chrono::duration_cast<std::chrono::seconds>(
+      std::filesystem::file_time_type::clock::now() - time);
+  }
+
+  bool
+  put(std::string_view key, std::string_view value) const
+  {
+    auto ec = std::error_code{};
+    std::filesystem::create_directories(dir, ec);
+
+    const auto target = entry(key);
+    auto tmp = target;
+    tmp += dk_fmt(".{}", getpid());
+
+    {
+      auto file = std::ofstream{ tmp, std::ios::binary | std::ios::trunc };
+      if (!file) {
+        return false;
+      }
+      file << key << '\n' << value;
+      if (!file.flush()) {
+        return false;
+      }
+    }
+
+    std::filesystem::rename(tmp, target, ec);
+    if (ec) {
+      std::filesystem::remove(tmp, ec);
+      return false;
+    }
+    return true;
+  }
+
+  void
+  erase(std::string_view key) const
+  {
+    auto ec = std::error_code{};
+    std::filesystem::remove(entry(key), ec);
+  }
+};
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+TEST_CASE("testing cache")
+{
+  const auto dir = std::filesystem::temp_directory_path() / "devkit_cache_test";
+  std::filesystem::remove_all(dir);
+
+  const auto cache = devkit::Cache{ dir };
+
+  SUBCASE("miss")
+  {
+    CHECK(!cache.get("missing").has_value());
+    CHECK(!cache.age("missing").has_value());
+  }
+
+  SUBCASE("put and get")
+  {
+    CHECK(cache.put("key", "line one\nline two\n"));
+    CHECK(cache.get("key") == "line one\nline two\n");
+    CHECK(cache.age("key").value() < std::chrono::seconds{ 5 });
+
+    CHECK(cache.put("key", ""));
+    CHECK(cache.get("key") == "");
+
+    cache.erase("key");
+    CHECK(!cache.get("key").has_value());
+  }
+
+  std::filesystem::remove_all(dir);
+}
+#endif
@@ -0,0 +1,508 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+#include "fmt.hh"
+#include "json.hh"
+#include "mmap.hh"
+#include "parallel.hh"
+#include "path.hh"
+
+namespace devkit
+{
+
+struct CompdbStats
+{
+  size_t inputs = 0;     // databases read
+  size_t entries = 0;    // entries written
+  size_t duplicates = 0; // entries dropped because the file was already seen
+  size_t failed = 0;     // databases that could not be read or parsed
+};
+
+namespace details
+{
+
+constexpr std::string_view compdb_index_header = "devkit-compdb";
+
+// One object of a compilation database, as it appears in the input, and the
+// absolute, normalized path of the file it compiles.
+struct CompdbEntry
+{
+  std::string_view text;
+  std::string file;
+};
+
+// Scan the object starting at `pos`, picking up its top level "file" and
+// "directory" members. Returns the index just past the closing brace.
+static size_t
+scan_compdb_object(std::string_view json,
+                   size_t pos,
+                   std::string_view& file,
+                   std::string_view& directory)
+{
+  size_t depth = 0;
+  bool want_key = false;
+  auto key = std::string_view{};
+
+  for (; pos < json.size(); ++pos) {
+    switch (json[pos]) {
+      case '"': {
+        const auto end = skip_json_string(json, pos);
+        if (end == std::string_view::npos) {
+          return end;
+        }
+        if (depth == 1) {
+          const auto raw = json.substr(pos + 1, end - pos - 2);
+          if (want_key) {
+            key = raw;
+            want_key = false;
+          }
+          else if (key == "file") {
+            file = raw;
+          }
+          else if (key == "directory") {
+            directory = raw;
+          }
+        }
+        pos = end - 1;
+        break;
+      }
+      case '{':
+      case '[':
+        want_key = json[pos] == '{' && depth == 0;
+        depth += 1;
+        break;
+      case '}':
+      case ']':
+        if (--depth == 0) {
+          return pos + 1;
+        }
+        break;
+      case ',':
+        want_key = depth == 1;
+        break;
+    }
+  }
+
+  return std::string_view::npos;
+}
+
+// Split a compilation database into its entries. Only the layout of the
+// top level array is checked; entries are kept verbatim.
+static bool
+parse_compdb(std::string_view json, std::vector<CompdbEntry>& entries)
+{
+  constexpr auto space = std::string_view{ " \t\r\n" };
+
+  auto pos = json.find_first_not_of(space);
+  if (pos == std::string_view::npos || json[pos] != '[') {
+    return false;
+  }
+
+  auto joined = std::string{};
+  for (++pos;;) {
+    pos = json.find_first_not_of(space, pos);
+    if (pos == std::string_view::npos) {
+      return false;
+    }
+    if (json[pos] == ']') {
+      return true;
+    }
+    if (json[pos] == ',') {
+      ++pos;
+      continue;
+    }
+    if (json[pos] != '{') {
+      return false;
+    }
+
+    auto file = std::string_view{};
+    auto directory = std::string_view{};
+    const auto end = scan_compdb_object(json, pos, file, directory);
+    if (end == std::string_view::npos) {
+      return false;
+    }
+
+    if (!file.empty()) {
+      joined.clear();
+      append_path(joined, unescape_json(directory));
+      append_path(joined, unescape_json(file));
+
+      auto& entry = entries.emplace_back();
+      entry.text = json.substr(pos, end - pos);
+      normalize_path(entry.file, joined);
+    }
+    pos = end;
+  }
+}
+
+// Compilation databases named by `input`: the file itself, the database in
+// a directory, or the databases of its subdirectories (a colcon build base).
+// `output`, canonical, is the merged database of an earlier run and never an
+// input, so a directory holding it is scanned as a build base.
+static void
+find_compdbs(const std::filesystem::path& input,
+             const std::filesystem::path& output,
+             std::vector<std::filesystem::path>& found)
+{
+  namespace fs = std::filesystem;
+
+  auto ec = std::error_code{};
+  const auto is_output = [&](const fs::path& file) {
+    return fs::weakly_canonical(file, ec) == output;
+  };
+
+  if (!fs::is_directory(input, ec)) {
+    if (!is_output(input)) {
+      found.push_back(input);
+    }
+    return;
+  }
+
+  if (const auto db = input / "compile_commands.json";
+      fs::is_regular_file(db, ec) && !is_output(db)) {
+    found.push_back(db);
+    return;
+  }
+
+  auto nested = std::vector<fs::path>{};
+  for (const auto& entry : fs::directory_iterator{ input, ec }) {
+    const auto file = entry.path() / "compile_commands.json";
+    if (fs::is_regular_file(file, ec) && !is_output(file)) {
+      nested.push_back(file);
+    }
+  }
+  std::sort(nested.begin(), nested.end());
+  found.insert(found.end(), nested.begin(), nested.end());
+}
+
+static std::string
+compdb_index_path(const std::filesystem::path& db)
+{
+  return db.string() + ".idx";
+}
+
+} // namespace details
+
+// Merge the compilation databases found in `inputs` into `output`, keeping
+// the first entry for every file. Inputs are parsed in parallel but merged in
+// order, and entries are copied byte for byte.
+//
+// Next to the database, `<output>.idx` maps each file to the offset and
+// length of its entry, so `lookup_compdb` can read one entry without parsing
+// the whole database. Returns nullopt when the output cannot be written.
+static std::optional<CompdbStats>
+merge_compdb(const std::vector<std::filesystem::path>& inputs,
+             const std::filesystem::path& output,
+             size_t jobs = 0)
+{
+  namespace fs = std::filesystem;
+
+  auto ec = std::error_code{};
+  const auto canonical = fs::weakly_canonical(output, ec);
+  auto files = std::vector<fs::path>{};
+  for (const auto& input : inputs) {
+    details::find_compdbs(input, canonical, files);
+  }
+
+  auto mapped = std::vector<std::unique_ptr<MappedFile>>(files.size());
+  auto parsed = std::vector<std::vector<details::CompdbEntry>>(files.size());
+  auto ok = std::vector<char>(files.size(), 0);
+
+  parallel_for(files.size(), jobs, [&](size_t i) {
+    mapped[i] = std::make_unique<MappedFile>(files[i].string());
+    ok[i] = mapped[i]->valid() &&
+            details::parse_compdb(mapped[i]->view(), parsed[i]);
+  });
+
+  const auto tmp = output.string() + dk_fmt(".{}", getpid());
+  auto db = std::ofstream{ tmp, std::ios::binary | std::ios::trunc };
+  if (!db) {
+    dk_err("Compdb: Failed to write {}.", output.string());
+    return std::nullopt;
+  }
+
+  struct Indexed
+  {
+    std::string_view file;
+    size_t offset;
+    size_t length;
+  };
+
+  auto stats = CompdbStats{};
+  auto seen = std::unordered_set<std::string_view>{};
+  auto index = std::vector<Indexed>{};
+  size_t offset = 2;
+
+  db << "[\n";
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (!ok[i]) {
+      dk_err("Compdb: Failed to read {}.", files[i].string());
+      stats.failed += 1;
+      continue;
+    }
+
+    stats.inputs += 1;
+    for (const auto& entry : parsed[i]) {
+      if (!seen.insert(entry.file).second) {
+        stats.duplicates += 1;
+        continue;
+      }
+
+      if (stats.entries > 0) {
+        db << ",\n";
+        offset += 2;
+      }
+      db.write(entry.text.data(), entry.text.size());
+      index.push_back({ entry.file, offset, entry.text.size() });
+      offset += entry.text.size();
+      stats.entries += 1;
+    }
+  }
+  db << "\n]\n";
+  offset += 3;
+
+  if (!db.flush()) {
+    dk_err("Compdb: Failed to write {}.", output.string());
+    fs::remove(tmp, ec);
+    return std::nullopt;
+  }
+  db.close();
+
+  // Sorted so lookups can bisect the index. Paths with a tab or newline
+  // cannot be indexed and are only found in the database itself.
+  std::sort(index.begin(), index.end(), [](const auto& a, const auto& b) {
+    return a.file < b.file;
+  });
+
+  const auto index_tmp =
+    details::compdb_index_path(output) + dk_fmt(".{}", getpid());
+  {
+    auto idx = std::ofstream{ index_tmp, std::ios::binary | std::ios::trunc };
+    idx << details::compdb_index_header << '\t' << offset << '\n';
+    for (const auto& entry : index) {
+      if (entry.file.find_first_of("\t\n") == std::string_view::npos) {
+        idx << entry.file << '\t' << entry.offset << '\t' << entry.length
+            << '\n';
+      }
+    }
+    if (!idx.flush()) {
+      dk_err("Compdb: Failed to write {}.",
+             details::compdb_index_path(output));
+      fs::remove(tmp, ec);
+      fs::remove(index_tmp, ec);
+      return std::nullopt;
+    }
+  }
+
+  ec.clear();
+  fs::rename(tmp, output, ec);
+  if (!ec) {
+    fs::rename(index_tmp, details::compdb_index_path(output), ec);
+  }
+  if (ec) {
+    dk_err("Compdb: Failed to write {}: {}", output.string(), ec.message());
+    fs::remove(tmp, ec);
+    fs::remove(index_tmp, ec);
+    return std::nullopt;
+  }
+
+  return stats;
+}
+
+// The entry for `file` (absolute) in a database written by `merge_compdb`,
+// read through its index. Returns nullopt when the file has no entry or the
+// index does not belong to the database.
+static std::optional<std::string>
+lookup_compdb(const std::filesystem::path& db, std::string_view file)
+{
+  auto normal = std::string{};
+  normalize_path(normal, file);
+
+  const auto mapped = MappedFile{ details::compdb_index_path(db) };
+  const auto index = mapped.view();
+
+  const auto header_end = index.find('\n');
+  if (header_end == std::string_view::npos ||
+      !index.starts_with(details::compdb_index_header)) {
+    return std::nullopt;
+  }
+
+  const auto number = [](std::string_view text) {
+    size_t value = 0;
+    const auto end = text.data() + text.size();
+    return std::from_chars(text.data(), end, value).ptr == end
+             ? value
+             : std::string_view::npos;
+  };
+
+  const int fd = open(db.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return std::nullopt;
+  }
+
+  struct stat st;
+  const auto size =
+    number(index.substr(details::compdb_index_header.size() + 1,
+                        header_end - details::compdb_index_header.size() - 1));
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != size) {
+    close(fd);
+    return std::nullopt;
+  }
+
+  // bisect on line starts
+  const auto body = index.substr(header_end + 1);
+  size_t lo = 0;
+  size_t hi = body.size();
+  while (lo < hi) {
+    const auto mid = lo + (hi - lo) / 2;
+    const auto start = mid == 0 ? 0 : body.rfind('\n', mid - 1) + 1;
+    auto end = body.find('\n', start);
+    if (end == std::string_view::npos) {
+      end = body.size();
+    }
+
+    const auto line = body.substr(start, end - start);
+    const auto tab = line.find('\t');
+    const auto key = line.substr(0, tab);
+
+    if (key < normal) {
+      lo = end + 1;
+      continue;
+    }
+    if (key > normal) {
+      hi = start;
+      continue;
+    }
+
+    const auto fields = line.substr(tab + 1);
+    const auto sep = fields.find('\t');
+    const auto offset = number(fields.substr(0, sep));
+    const auto length = sep == std::string_view::npos
+                          ? std::string_view::npos
+                          : number(fields.substr(sep + 1));
+    if (offset == std::string_view::npos || length == std::string_view::npos ||
+        offset + length > size) {
+      break;
+    }
+
+    auto entry = std::string(length, '\0');
+    const auto n = pread(fd, entry.data(), length, offset);
+    close(fd);
+    if (n != static_cast<ssize_t>(length) || entry.front() != '{' ||
+        entry.back() != '}') {
+      return std::nullopt;
+    }
+    return entry;
+  }
+
+  close(fd);
+  return std::nullopt;
+}
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <sstream>
+
+TEST_CASE("testing compdb")
+{
+  namespace fs = std::filesystem;
+
+  const auto root = fs::temp_directory_path() / "devkit_compdb_test";
+  fs::remove_all(root);
+  fs::create_directories(root / "build/a");
+  fs::create_directories(root / "build/b");
+  fs::create_directories(root / "build/c");
+
+  const auto entry = [](std::string_view dir, std::string_view file) {
+    return dk_fmt(R"({{
+  "directory": "{}",
+  "arguments": ["c++", "-c", "{{\"}}"],
+  "file": "{}"
+}})",
+                  dir,
+                  file);
+  };
+
+  std::ofstream{ root / "build/a/compile_commands.json" }
+    << "[\n" << entry("/ws/build/a", "/ws/src/a/a.cpp") << ",\n"
+    << entry("/ws/build/a", "../../src/a/./util.cpp") << "\n]\n";
+  std::ofstream{ root / "build/b/compile_commands.json" }
+    << "[" << entry("/ws/build/b", "/ws/src/b/b.cpp") << ","
+    << entry("/ws/build/b", "/ws/src/a/util.cpp") << "]";
+  std::ofstream{ root / "build/c/compile_commands.json" } << "[{\"file\": ";
+
+  SUBCASE("parse")
+  {
+    auto entries = std::vector<devkit::details::CompdbEntry>{};
+    const auto json = "[" + entry("/d", "x\\u00e9\\\"y.cpp") + "]";
+    REQUIRE(devkit::details::parse_compdb(json, entries));
+    REQUIRE(entries.size() == 1);
+    CHECK(entries[0].file == "/d/x\xc3\xa9\"y.cpp");
+    CHECK(entries[0].text == json.substr(1, json.size() - 2));
+
+    CHECK(devkit::details::parse_compdb(" [ ] ", entries));
+    CHECK(!devkit::details::parse_compdb("{}", entries));
+    CHECK(!devkit::details::parse_compdb("[{\"file\": \"a]", entries));
+  }
+
+  SUBCASE("merge and lookup")
+  {
+    const auto output = root / "compile_commands.json";
+    const auto stats = devkit::merge_compdb({ root / "build" }, output);
+    REQUIRE(stats.has_value());
+    CHECK(stats->inputs == 2);
+    CHECK(stats->entries == 3);
+    CHECK(stats->duplicates == 1);
+    CHECK(stats->failed == 1);
+
+    auto merged = std::vector<devkit::details::CompdbEntry>{};
+    auto ss = std::stringstream{};
+    ss << std::ifstream{ output }.rdbuf();
+    const auto json = ss.str();
+    REQUIRE(devkit::details::parse_compdb(json, merged));
+    REQUIRE(merged.size() == 3);
+    CHECK(merged[1].file == "/ws/src/a/util.cpp");
+    CHECK(merged[1].text == entry("/ws/build/a", "../../src/a/./util.cpp"));
+
+    for (const auto& expected : merged) {
+      CHECK(devkit::lookup_compdb(output, expected.file) == expected.text);
+    }
+    CHECK(devkit::lookup_compdb(output, "/ws/src/a/../b/b.cpp") ==
+          merged[2].text);
+    CHECK(!devkit::lookup_compdb(output, "/ws/src/missing.cpp").has_value());
+    CHECK(!devkit::lookup_compdb(root / "missing.json", "/ws/src/a/a.cpp")
+             .has_value());
+
+    // the output is not read back when it lands in the build base
+    const auto inside = root / "build/compile_commands.json";
+    for (int run = 0; run < 2; ++run) {
+      const auto again = devkit::merge_compdb({ root / "build" }, inside);
+      REQUIRE(again.has_value());
+      CHECK(again->inputs == 2);
+      CHECK(again->entries == 3);
+    }
+
+    // an index left over from another database is ignored
+    std::ofstream{ output, std::ios::app } << "\n";
+    CHECK(!devkit::lookup_compdb(output, "/ws/src/a/a.cpp").has_value());
+  }
+
+  fs::remove_all(root);
+}
+#endif
@@ -4,7 +4,9 @@
 
 #ifndef defer
 
-#define DEFER_TOKEN(COUNTER) DEFER_##COUNTER
+// Two steps, so __COUNTER__ is expanded before it is pasted.
+#define DEFER_CONCAT(A, B) A##B
+#define DEFER_TOKEN(COUNTER) DEFER_CONCAT(DEFER_, COUNTER)
 #define defer                                                                  \
   auto DEFER_TOKEN(__COUNTER__) = devkit::details::Deferer{} << [&]()
 
@@ -81,5 +83,20 @@ TEST_CASE("testing options")
     }
     CHECK(i == 1);
   }
+
+  SUBCASE("Macro defer twice in one scope")
+  {
+    {
+      defer
+      {
+        i = i * 10;
+      };
+      defer
+      {
+        i += 1;
+      };
+    }
+    CHECK(i == 10);
+  }
 }
 #endif
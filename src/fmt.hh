@@ -5,7 +5,30 @@
 #include <fmt/compile.h>
 #include <fmt/core.h>
 
-#ifdef DEBUG
+#if defined(DK_ASYNC_LOG)
+
+#include "log.hh"
+
+#define dk_log(fmt_str, ...)                                                   \
+  do {                                                                         \
+    if constexpr (::devkit::log_enabled<::devkit::LogLevel::info>) {           \
+      ::devkit::AsyncLog::instance().write(stdout, fmt_str, ##__VA_ARGS__);    \
+    }                                                                          \
+  } while (0)
+
+#define dk_err(fmt_str, ...)                                                   \
+  do {                                                                         \
+    if constexpr (::devkit::log_enabled<::devkit::LogLevel::error>) {          \
+      ::devkit::AsyncLog::instance().write(stderr, fmt_str, ##__VA_ARGS__);    \
+    }                                                                          \
+  } while (0)
+
+#define dk_panic(fmt_str, ...)                                                 \
+  ::devkit::AsyncLog::instance().write(stderr, fmt_str, ##__VA_ARGS__);        \
+  ::devkit::AsyncLog::instance().flush();                                      \
+  exit(1)
+
+#elif defined(DEBUG)
 
 #define dk_log(fmt_str, ...)                                                   \
   fmt::print(stdout,                                                           \
@@ -0,0 +1,957 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "mmap.hh"
+#include "parallel.hh"
+
+namespace devkit
+{
+
+struct GrepOptions
+{
+  bool ignore_case = false;
+  bool fixed = false;  // pattern is a literal string, not a regex
+  bool hidden = false; // descend into dot files and directories
+  size_t jobs = 0;     // 0 uses every core
+  size_t max_count = 0;
+};
+
+struct GrepMatch
+{
+  std::string path;
+  size_t line;
+  size_t column;
+  std::string text;
+};
+
+namespace details
+{
+
+// Longest run of characters every match of `pattern` has to contain. Anything
+// that is not obviously mandatory (groups, classes, alternation, optional
+// atoms) ends the run, so the result can be shorter than ideal but is never
+// wrong.
+static std::string
+required_literal(std::string_view pattern)
+{
+  std::string best;
+  std::string run;
+
+  const auto flush = [&]() {
+    if (run.size() > best.size()) {
+      best = run;
+    }
+    run.clear();
+  };
+
+  const auto is_digit = [&](size_t i) {
+    return i < pattern.size() &&
+           std::isdigit(static_cast<unsigned char>(pattern[i]));
+  };
+
+  const auto skip_until = [&](size_t i, char open, char close) -> size_t {
+    int depth = 0;
+    for (; i < pattern.size(); ++i) {
+      if (pattern[i] == '\\') {
+        i += 1;
+      }
+      else if (pattern[i] == open) {
+        depth += 1;
+      }
+      else if (pattern[i] == close && (depth -= 1) == 0) {
+        break;
+      }
+    }
+    return i;
+  };
+
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    const char c = pattern[i];
+
+    switch (c) {
+      case '\\': {
+        if (i + 1 >= pattern.size() ||
+            std::isalnum(static_cast<unsigned char>(pattern[i + 1]))) {
+          // \d, \w, \b, back references ... \xHH, \uHHHH and \cX take the
+          // characters after them too.
+          flush();
+          i += 1;
+          if (i >= pattern.size()) {
+            break;
+          }
+          if (pattern[i] == 'x') {
+            i += 2;
+          }
+          else if (pattern[i] == 'u') {
+            i += 4;
+          }
+          else if (pattern[i] == 'c') {
+            i += 1;
+          }
+          while (is_digit(i) && is_digit(i + 1)) {
+            i += 1;
+          }
+        }
+        else {
+          run += pattern[++i];
+        }
+        break;
+      }
+      case '[': {
+        flush();
+        // a ']' right after '[' or '[^' is part of the class
+        auto j = i + 1;
+        if (j < pattern.size() && pattern[j] == '^') {
+          j += 1;
+        }
+        if (j < pattern.size() && pattern[j] == ']') {
+          j += 1;
+        }
+        for (; j < pattern.size() && pattern[j] != ']'; ++j) {
+          if (pattern[j] == '\\') {
+            j += 1;
+          }
+        }
+        i = j;
+        break;
+      }
+      case '(': {
+        flush();
+        i = skip_until(i, '(', ')');
+        break;
+      }
+      case '|': {
+        return "";
+      }
+      case '*':
+      case '?': {
+        if (!run.empty()) {
+          run.pop_back();
+        }
+        flush();
+        break;
+      }
+      case '{': {
+        if (!run.empty()) {
+          run.pop_back();
+        }
+        flush();
+        i = skip_until(i, '{', '}');
+        break;
+      }
+      case '+':
+      case '.':
+      case '^':
+      case '$':
+      case ')': {
+        flush();
+        break;
+      }
+      default: {
+        run += c;
+      }
+    }
+  }
+
+  flush();
+  return best;
+}
+
+static std::string
+to_lower(std::string_view text)
+{
+  auto lower = std::string{ text };
+  for (auto& c : lower) {
+    c = std::tolower(static_cast<unsigned char>(c));
+  }
+  return lower;
+}
+
+// Substring search anchored on the rarest byte of the needle: memchr skips to
+// candidates with the vectorized libc scan, and only those are compared. With
+// `ignore_case` the needle is lowercased and so has to be the haystack, see
+// to_lower; folding it once keeps every search linear.
+class Finder
+{
+private:
+  std::string needle;
+  size_t anchor = 0;
+
+  static int
+  rank(unsigned char c)
+  {
+    if (c != '\0' && std::strchr(" etaoinsrhl", c) != nullptr) {
+      return 3;
+    }
+    if (std::islower(c)) {
+      return 2;
+    }
+    if (std::isupper(c) || std::isdigit(c)) {
+      return 1;
+    }
+    return 0;
+  }
+
+public:
+  Finder(std::string_view needle, bool ignore_case)
+    : needle{ ignore_case ? to_lower(needle) : std::string{ needle } }
+  {
+    for (size_t i = 1; i < this->needle.size(); ++i) {
+      if (rank(this->needle[i]) < rank(this->needle[anchor])) {
+        anchor = i;
+      }
+    }
+  }
+
+  size_t
+  find(std::string_view haystack, size_t from) const
+  {
+    if (needle.empty()) {
+      return from <= haystack.size() ? from : std::string_view::npos;
+    }
+
+    const auto byte = static_cast<unsigned char>(needle[anchor]);
+    const char* begin = haystack.data();
+    const char* end = begin + haystack.size();
+
+    const auto tail = needle.size() - anchor;
+
+    for (auto pos = from + anchor; pos + tail <= haystack.size();) {
+      const auto* hit = static_cast<const char*>(
+        std::memchr(begin + pos, byte, end - begin - pos));
+      if (hit == nullptr) {
+        break;
+      }
+
+      const auto candidate = static_cast<size_t>(hit - begin) - anchor;
+      if (candidate + needle.size() > haystack.size()) {
+        break;
+      }
+      if (std::memcmp(begin + candidate, needle.data(), needle.size()) == 0) {
+        return candidate;
+      }
+      pos = hit - begin + 1;
+    }
+
+    return std::string_view::npos;
+  }
+};
+
+// Why std::regex would reject `pattern` as ECMAScript, or an empty view. The
+// regex constructor throws on a bad pattern, which ends the process when
+// exceptions are disabled, so patterns from users are checked here first.
+// Follows libstdc++: `[]` is an empty class, a '{' always starts a bound and
+// `\1` must name a group closed before it. Collating names other than single
+// characters are rejected although the library knows a few.
+class RegexChecker
+{
+private:
+  // libstdc++ refuses to build automatons with more states than this.
+  static constexpr size_t max_states = 100000;
+
+  std::string_view pattern;
+  size_t pos = 0;
+  size_t groups = 0;
+  std::vector<size_t> open;
+  std::string_view error;
+
+  // A bracket element: a character, or a class that cannot bound a range.
+  struct Element
+  {
+    char value = 0;
+    bool is_class = false;
+  };
+
+  bool
+  done() const
+  {
+    return pos >= pattern.size();
+  }
+
+  bool
+  fail(std::string_view message)
+  {
+    if (error.empty()) {
+      error = message;
+    }
+    return false;
+  }
+
+  bool
+  hex(size_t digits, char& value)
+  {
+    unsigned result = 0;
+    for (size_t i = 0; i < digits; ++i, ++pos) {
+      if (done() || !std::isxdigit(static_cast<unsigned char>(pattern[pos]))) {
+        return fail("incomplete \\x or \\u escape");
+      }
+      const auto c = static_cast<unsigned char>(pattern[pos]);
+      const auto digit = std::isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10;
+      result = result * 16 + digit;
+    }
+    value = static_cast<char>(result);
+    return true;
+  }
+
+  // The escape after a '\\' both inside and outside brackets. Sets
+  // `is_class` for \d, \s, \w and their negations.
+  bool
+  escape(Element& element)
+  {
+    if (done()) {
+      return fail("trailing backslash");
+    }
+
+    const char c = pattern[pos++];
+    switch (c) {
+      case 'd':
+      case 'D':
+      case 's':
+      case 'S':
+      case 'w':
+      case 'W':
+        element.is_class = true;
+        return true;
+      case 'x':
+        return hex(2, element.value);
+      case 'u':
+        return hex(4, element.value);
+      case 'c':
+        if (done()) {
+          return fail("incomplete \\c escape");
+        }
+        element.value = pattern[pos++];
+        return true;
+      case '0':
+        element.value = '\0';
+        return true;
+      case 'b':
+        element.value = '\b';
+        return true;
+      case 'f':
+        element.value = '\f';
+        return true;
+      case 'n':
+        element.value = '\n';
+        return true;
+      case 'r':
+        element.value = '\r';
+        return true;
+      case 't':
+        element.value = '\t';
+        return true;
+      case 'v':
+        element.value = '\v';
+        return true;
+      default:
+        element.value = c;
+        return true;
+    }
+  }
+
+  bool
+  bracket_element(Element& element)
+  {
+    const char c = pattern[pos++];
+    if (c == '\\') {
+      // \B and back references have no meaning in brackets.
+      if (!done() && (pattern[pos] == 'B' ||
+                      (pattern[pos] >= '1' && pattern[pos] <= '9'))) {
+        return fail("invalid escape in brackets");
+      }
+      return escape(element);
+    }
+    if (c != '[' || done() || std::strchr(":.=", pattern[pos]) == nullptr) {
+      element.value = c;
+      return true;
+    }
+
+    // [:class:], [.c.] or [=c=]
+    const char kind = pattern[pos++];
+    const auto close = pattern.find(std::string{ kind, ']' }, pos);
+    if (close == std::string_view::npos) {
+      return fail("unterminated character class name");
+    }
+    const auto name = pattern.substr(pos, close - pos);
+    pos = close + 2;
+
+    if (kind != ':') {
+      if (name.size() != 1) {
+        return fail("invalid collating element");
+      }
+      element.value = name[0];
+      return true;
+    }
+
+    constexpr auto names =
+      std::array<std::string_view, 15>{ "alnum", "alpha",  "blank", "cntrl",
+                                        "d",     "digit",  "graph", "lower",
+                                        "print", "punct",  "s",     "space",
+                                        "upper", "w",      "xdigit" };
+    if (std::find(names.begin(), names.end(), name) == names.end()) {
+      return fail("unknown character class");
+    }
+    element.is_class = true;
+    return true;
+  }
+
+  // After the '['. A ']' right away closes an empty class.
+  bool
+  bracket()
+  {
+    if (!done() && pattern[pos] == '^') {
+      pos += 1;
+    }
+
+    while (true) {
+      if (done()) {
+        return fail("unterminated '['");
+      }
+      if (pattern[pos] == ']') {
+        pos += 1;
+        return true;
+      }
+
+      auto first = Element{};
+      if (!bracket_element(first)) {
+        return false;
+      }
+      if (pos + 1 >= pattern.size() || pattern[pos] != '-' ||
+          pattern[pos + 1] == ']') {
+        continue;
+      }
+
+      pos += 1;
+      auto last = Element{};
+      if (!bracket_element(last)) {
+        return false;
+      }
+      if (first.is_class || last.is_class) {
+        return fail("character class in a range");
+      }
+      if (first.value > last.value) {
+        return fail("range out of order");
+      }
+    }
+  }
+
+  bool
+  number(size_t& value)
+  {
+    if (done() || !std::isdigit(static_cast<unsigned char>(pattern[pos]))) {
+      return false;
+    }
+    value = 0;
+    for (; !done() && std::isdigit(static_cast<unsigned char>(pattern[pos]));
+         ++pos) {
+      value = std::min(value * 10 + (pattern[pos] - '0'), max_states);
+    }
+    return true;
+  }
+
+  // Repeats an atom of `states` states, and returns false when there is no
+  // quantifier at `pos`.
+  bool
+  quantifier(size_t& states)
+  {
+    if (done()) {
+      return false;
+    }
+
+    // As many states as libstdc++ adds for each kind of repeat, or more.
+    size_t repeated = 0;
+    switch (pattern[pos]) {
+      case '*':
+      case '+':
+        pos += 1;
+        repeated = states + 1;
+        break;
+      case '?':
+        pos += 1;
+        repeated = states + 2;
+        break;
+      case '{': {
+        pos += 1;
+        size_t min = 0;
+        if (!number(min)) {
+          return fail("invalid bound in '{}'");
+        }
+        size_t max = min;
+        if (!done() && pattern[pos] == ',') {
+          pos += 1;
+          if (!number(max)) {
+            max = min;
+          }
+          else if (max < min) {
+            return fail("invalid bound in '{}'");
+          }
+        }
+        if (done()) {
+          return fail("unterminated '{'");
+        }
+        if (pattern[pos++] != '}') {
+          return fail("invalid bound in '{}'");
+        }
+        repeated = (states + 1) * (max + 1);
+        break;
+      }
+      default:
+        return false;
+    }
+
+    states = std::min(repeated, max_states + 1);
+    return true;
+  }
+
+  // States of the alternatives from `pos` up to a ')' or the end.
+  bool
+  disjunction(size_t& states)
+  {
+    // Every alternative ends in a dummy state and each '|' adds two more.
+    states = 1;
+    while (!done() && pattern[pos] != ')') {
+      const char c = pattern[pos];
+      if (c == '|') {
+        pos += 1;
+        states += 3;
+        continue;
+      }
+      if (std::strchr("*+?{", c) != nullptr) {
+        return fail("nothing to repeat");
+      }
+
+      size_t atom = 1;
+      auto repeatable = true;
+      pos += 1;
+      if (c == '^' || c == '$') {
+        repeatable = false;
+      }
+      else if (c == '\\') {
+        if (!done() && (pattern[pos] == 'b' || pattern[pos] == 'B')) {
+          pos += 1;
+          repeatable = false;
+        }
+        else if (!done() && pattern[pos] >= '1' && pattern[pos] <= '9') {
+          size_t index = 0;
+          number(index);
+          if (index > groups) {
+            return fail("back reference to a missing group");
+          }
+          if (std::find(open.begin(), open.end(), index) != open.end()) {
+            return fail("back reference to an open group");
+          }
+        }
+        else if (auto element = Element{}; !escape(element)) {
+          return false;
+        }
+      }
+      else if (c == '[') {
+        if (!bracket()) {
+          return false;
+        }
+      }
+      else if (c == '(') {
+        auto capture = true;
+        if (!done() && pattern[pos] == '?') {
+          if (pos + 1 >= pattern.size() ||
+              std::strchr(":=!", pattern[pos + 1]) == nullptr) {
+            return fail("invalid '(?' group");
+          }
+          capture = false;
+          repeatable = pattern[pos + 1] == ':';
+          pos += 2;
+        }
+        if (capture) {
+          open.push_back(++groups);
+        }
+        if (!disjunction(atom)) {
+          return false;
+        }
+        if (done()) {
+          return fail("unmatched '('");
+        }
+        pos += 1;
+        atom += repeatable && !capture ? 1 : 2;
+        if (capture) {
+          open.pop_back();
+        }
+      }
+
+      if (repeatable) {
+        while (quantifier(atom)) {
+        }
+        if (!error.empty()) {
+          return false;
+        }
+      }
+      states = std::min(states + atom, max_states + 1);
+      if (states > max_states - 8) {
+        return fail("pattern too large");
+      }
+    }
+    return true;
+  }
+
+public:
+  explicit RegexChecker(std::string_view pattern)
+    : pattern{ pattern }
+  {
+    size_t states = 0;
+    if (disjunction(states) && !done()) {
+      fail("unmatched ')'");
+    }
+  }
+
+  std::string_view
+  message() const
+  {
+    return error;
+  }
+};
+
+} // namespace details
+
+// Searches files line by line. A literal that every match must contain is
+// pulled out of the pattern and used to skip straight to candidate lines, so
+// the regex only runs on lines that can possibly match.
+class Grep
+{
+private:
+  GrepOptions options;
+  std::optional<std::regex> regex;
+  std::optional<details::Finder> finder;
+  std::string_view invalid;
+
+  static bool
+  is_binary(std::string_view data)
+  {
+    const auto head = data.substr(0, 8192);
+    return std::memchr(head.data(), '\0', head.size()) != nullptr;
+  }
+
+  static bool
+  is_hidden(const std::filesystem::path& path)
+  {
+    const auto name = path.filename().native();
+    return name.size() > 1 && name[0] == '.' && name != "..";
+  }
+
+public:
+  Grep(const std::string& pattern, const GrepOptions& options = {})
+    : options{ options }
+  {
+    if (options.fixed) {
+      finder.emplace(pattern, options.ignore_case);
+      return;
+    }
+
+    invalid = details::RegexChecker{ pattern }.message();
+    if (!invalid.empty()) {
+      return;
+    }
+
+    auto flags = std::regex::ECMAScript | std::regex::optimize;
+    if (options.ignore_case) {
+      flags |= std::regex::icase;
+    }
+    regex.emplace(pattern, flags);
+
+    if (const auto literal = details::required_literal(pattern);
+        !literal.empty()) {
+      finder.emplace(literal, options.ignore_case);
+    }
+  }
+
+  // Why the pattern is not a valid regex, or an empty view. An invalid Grep
+  // matches nothing.
+  std::string_view
+  error() const
+  {
+    return invalid;
+  }
+
+  std::vector<std::string>
+  collect(const std::vector<std::string>& paths) const
+  {
+    namespace fs = std::filesystem;
+
+    auto files = std::vector<std::string>{};
+
+    for (const auto& path : paths) {
+      auto ec = std::error_code{};
+
+      if (!fs::is_directory(path, ec)) {
+        files.push_back(path);
+        continue;
+      }
+
+      const auto first = files.size();
+      auto it = fs::recursive_directory_iterator{
+        path, fs::directory_options::skip_permission_denied, ec
+      };
+
+      for (; !ec && it != fs::recursive_directory_iterator{};
+           it.increment(ec)) {
+        if (!options.hidden && is_hidden(it->path())) {
+          it.disable_recursion_pending();
+          continue;
+        }
+        if (it->is_regular_file(ec)) {
+          files.push_back(it->path().string());
+        }
+      }
+
+      std::sort(files.begin() + first, files.end());
+    }
+
+    return files;
+  }
+
+  std::vector<GrepMatch>
+  search(const std::string& path) const
+  {
+    auto matches = std::vector<GrepMatch>{};
+
+    if (!invalid.empty()) {
+      return matches;
+    }
+
+    const auto file = MappedFile{ path };
+    const auto data = file.view();
+    if (!file.valid() || is_binary(data)) {
+      return matches;
+    }
+
+    // Folded once for the finder; offsets are the same as in `data`.
+    const auto folded = options.ignore_case && finder.has_value()
+                          ? details::to_lower(data)
+                          : std::string{};
+    const auto scanned = folded.empty() ? data : std::string_view{ folded };
+
+    size_t line_no = 1;
+    size_t counted = 0;
+    size_t pos = 0;
+
+    while (pos < data.size()) {
+      auto line_begin = pos;
+      auto hit = std::string_view::npos;
+
+      if (finder.has_value()) {
+        hit = finder->find(scanned, pos);
+        if (hit == std::string_view::npos) {
+          break;
+        }
+        const auto* nl = static_cast<const char*>(
+          memrchr(data.data() + pos, '\n', hit - pos));
+        if (nl != nullptr) {
+          line_begin = nl - data.data() + 1;
+        }
+      }
+
+      auto line_end =
+        data.find('\n', hit == std::string_view::npos ? pos : hit);
+      if (line_end == std::string_view::npos) {
+        line_end = data.size();
+      }
+
+      const auto line = data.substr(line_begin, line_end - line_begin);
+      auto column = hit - line_begin;
+      auto matched = true;
+
+      if (regex.has_value()) {
+        auto match = std::cmatch{};
+        matched = std::regex_search(
+          line.data(), line.data() + line.size(), match, regex.value());
+        column = matched ? match.position(0) : 0;
+      }
+
+      if (matched) {
+        line_no += std::count(
+          data.begin() + counted, data.begin() + line_begin, '\n');
+        counted = line_begin;
+
+        matches.push_back(
+          { path, line_no, column + 1, std::string{ line } });
+
+        if (options.max_count != 0 && matches.size() >= options.max_count) {
+          break;
+        }
+      }
+
+      pos = line_end + 1;
+    }
+
+    return matches;
+  }
+
+  // Files are searched on worker threads while the calling thread hands
+  // matches to `on_match` in file order as soon as each file is done.
+  template<typename Fn>
+  void
+  run(const std::vector<std::string>& paths, Fn&& on_match) const
+  {
+    const auto files = collect(paths);
+
+    auto results = std::vector<std::vector<GrepMatch>>(files.size());
+    auto done = std::vector<bool>(files.size(), false);
+    auto mutex = std::mutex{};
+    auto ready = std::condition_variable{};
+
+    auto workers = std::thread{ [&]() {
+      parallel_for(files.size(), options.jobs, [&](size_t i) {
+        auto found = search(files[i]);
+        {
+          auto lock = std::lock_guard{ mutex };
+          results[i] = std::move(found);
+          done[i] = true;
+        }
+        ready.notify_one();
+      });
+    } };
+
+    for (size_t i = 0; i < files.size(); ++i) {
+      auto found = std::vector<GrepMatch>{};
+      {
+        auto lock = std::unique_lock{ mutex };
+        ready.wait(lock, [&]() {
+          return done[i];
+        });
+        found = std::move(results[i]);
+      }
+
+      for (const auto& match : found) {
+        on_match(match);
+      }
+    }
+
+    workers.join();
+  }
+
+  std::vector<GrepMatch>
+  run(const std::vector<std::string>& paths) const
+  {
+    auto matches = std::vector<GrepMatch>{};
+    run(paths, [&](const GrepMatch& match) {
+      matches.push_back(match);
+    });
+    return matches;
+  }
+};
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <fstream>
+
+TEST_CASE("testing grep")
+{
+  namespace fs = std::filesystem;
+
+  SUBCASE("required literal")
+  {
+    using devkit::details::required_literal;
+
+    CHECK(required_literal("TODO") == "TODO");
+    CHECK(required_literal("TODO\\(\\w+\\):") == "TODO(");
+    CHECK(required_literal("colou?r") == "colo");
+    CHECK(required_literal("a+bcd") == "bcd");
+    CHECK(required_literal("[abc]hello.*") == "hello");
+    CHECK(required_literal("foo|bar") == "");
+    CHECK(required_literal("(foo|bar)_topic") == "_topic");
+    CHECK(required_literal("x{2,3}yz") == "yz");
+    CHECK(required_literal("\\x41BC") == "BC");
+    CHECK(required_literal("\\u0041BC") == "BC");
+    CHECK(required_literal("\\cJab") == "ab");
+    CHECK(required_literal("(a)\\12b") == "b");
+  }
+
+  SUBCASE("regex checker")
+  {
+    const auto error = [](std::string_view pattern) {
+      return devkit::details::RegexChecker{ pattern }.message();
+    };
+
+    CHECK(error("TODO\\(\\w+\\):").empty());
+    CHECK(error("(a|b)+\\1[^x-z[:digit:]\\]-]{2,3}?").empty());
+    CHECK(error("(?:a)(?=b)(?!c)\\x41\\u0041\\cA").empty());
+    CHECK(error("(unclosed") == "unmatched '('");
+    CHECK(error("a)") == "unmatched ')'");
+    CHECK(error("[a") == "unterminated '['");
+    CHECK(error("[z-a]") == "range out of order");
+    CHECK(error("*a") == "nothing to repeat");
+    CHECK(error("^*") == "nothing to repeat");
+    CHECK(error("a{2,1}") == "invalid bound in '{}'");
+    CHECK(error("\\x4") == "incomplete \\x or \\u escape");
+    CHECK(error("(a\\1)") == "back reference to an open group");
+    CHECK(error("\\") == "trailing backslash");
+    CHECK(error("a{100000}") == "pattern too large");
+  }
+
+  SUBCASE("finder")
+  {
+    const auto finder = devkit::details::Finder{ "topic", false };
+    CHECK(finder.find("a topic, b topic", 0) == 2);
+    CHECK(finder.find("a topic, b topic", 3) == 11);
+    CHECK(finder.find("a Topic", 0) == std::string_view::npos);
+
+    const auto icase = devkit::details::Finder{ "ToPic", true };
+    CHECK(icase.find(devkit::details::to_lower("a tOpIc"), 0) == 2);
+    CHECK(icase.find("top", 0) == std::string_view::npos);
+  }
+
+  SUBCASE("search files")
+  {
+    const auto root = fs::temp_directory_path() / "devkit_grep_test";
+    fs::create_directories(root / "src");
+    fs::create_directories(root / ".git");
+    std::ofstream{ root / "src/a.cpp" } << "int a;\n// TODO: fix\nint b;\n";
+    std::ofstream{ root / "src/b.cpp" } << "// todo lower\n// TODO(me): more\n";
+    std::ofstream{ root / ".git/c.cpp" } << "// TODO: hidden\n";
+
+    const auto matches =
+      devkit::Grep{ "TODO\\S*:" }.run({ root.string() });
+
+    REQUIRE(matches.size() == 2);
+    CHECK(matches[0].path == (root / "src/a.cpp").string());
+    CHECK(matches[0].line == 2);
+    CHECK(matches[0].column == 4);
+    CHECK(matches[0].text == "// TODO: fix");
+    CHECK(matches[1].path == (root / "src/b.cpp").string());
+    CHECK(matches[1].line == 2);
+
+    const auto icase = devkit::Grep{
+      "todo", { .ignore_case = true, .fixed = true, .hidden = true, .jobs = 2 }
+    }.run({ root.string() });
+    CHECK(icase.size() == 4);
+
+    const auto escaped = devkit::Grep{ "\\x54ODO\\(" }.run({ root.string() });
+    REQUIRE(escaped.size() == 1);
+    CHECK(escaped[0].text == "// TODO(me): more");
+
+    const auto invalid = devkit::Grep{ "TODO(" };
+    CHECK(invalid.error() == "unmatched '('");
+    CHECK(invalid.run({ root.string() }).empty());
+
+    const auto limited = devkit::Grep{ "int", { .max_count = 1 } }.search(
+      (root / "src/a.cpp").string());
+    CHECK(limited.size() == 1);
+
+    fs::remove_all(root);
+  }
+}
+#endif
@@ -0,0 +1,719 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace devkit
+{
+
+namespace details
+{
+
+// First position at or after `pos` holding one of `Cs`, or npos. Sixteen
+// bytes are compared at a time where SSE2 is available.
+template<char... Cs>
+static size_t
+scan_for(std::string_view text, size_t pos)
+{
+#ifdef __SSE2__
+  for (; pos + 16 <= text.size(); pos += 16) {
+    const auto chunk = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(text.data() + pos));
+    auto hits = _mm_setzero_si128();
+    ((hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(Cs)))),
+     ...);
+    if (const int mask = _mm_movemask_epi8(hits); mask != 0) {
+      return pos + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; pos < text.size(); ++pos) {
+    if (((text[pos] == Cs) || ...)) {
+      return pos;
+    }
+  }
+  return std::string_view::npos;
+}
+
+// Index just past the closing quote of the string starting at `pos`.
+static size_t
+skip_json_string(std::string_view json, size_t pos)
+{
+  for (++pos;;) {
+    pos = scan_for<'"', '\\'>(json, pos);
+    if (pos == std::string_view::npos) {
+      return pos;
+    }
+    if (json[pos] == '"') {
+      return pos + 1;
+    }
+    pos += 2;
+  }
+}
+
+static void
+append_utf8(std::string& out, uint32_t code)
+{
+  if (code < 0x80) {
+    out += static_cast<char>(code);
+  }
+  else if (code < 0x800) {
+    out += static_cast<char>(0xc0 | (code >> 6));
+    out += static_cast<char>(0x80 | (code & 0x3f));
+  }
+  else if (code < 0x10000) {
+    out += static_cast<char>(0xe0 | (code >> 12));
+    out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (code & 0x3f));
+  }
+  else {
+    out += static_cast<char>(0xf0 | (code >> 18));
+    out += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+    out += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+    out += static_cast<char>(0x80 | (code & 0x3f));
+  }
+}
+
+// Decode the body of a JSON string, without the quotes, appending to `out`.
+static void
+unescape_json(std::string& out, std::string_view raw)
+{
+  const auto hex = [&](size_t pos) {
+    uint32_t code = 0;
+    if (pos + 4 > raw.size() ||
+        std::from_chars(raw.data() + pos, raw.data() + pos + 4, code, 16).ptr !=
+          raw.data() + pos + 4) {
+      return 0xfffdu;
+    }
+    return code;
+  };
+
+  for (size_t i = 0; i < raw.size(); ++i) {
+    const auto next = scan_for<'\\'>(raw, i);
+    if (next == std::string_view::npos || next + 1 == raw.size()) {
+      out += raw.substr(i);
+      return;
+    }
+    out += raw.substr(i, next - i);
+    i = next + 1;
+
+    switch (raw[i]) {
+      case 'b':
+        out += '\b';
+        break;
+      case 'f':
+        out += '\f';
+        break;
+      case 'n':
+        out += '\n';
+        break;
+      case 'r':
+        out += '\r';
+        break;
+      case 't':
+        out += '\t';
+        break;
+      case 'u': {
+        auto code = hex(i + 1);
+        i += 4;
+        if (code >= 0xd800 && code < 0xdc00 && i + 2 < raw.size() &&
+            raw[i + 1] == '\\' && raw[i + 2] == 'u') {
+          const auto low = hex(i + 3);
+          if (low >= 0xdc00 && low < 0xe000) {
+            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            i += 6;
+          }
+        }
+        append_utf8(out, code);
+        break;
+      }
+      default:
+        out += raw[i];
+    }
+  }
+}
+
+static std::string
+unescape_json(std::string_view raw)
+{
+  auto out = std::string{};
+  out.reserve(raw.size());
+  unescape_json(out, raw);
+  return out;
+}
+
+// Encode `raw` as the body of a JSON string, without the quotes, appending
+// to `out`. Bytes above 0x7f are copied as they are.
+static void
+escape_json(std::string& out, std::string_view raw)
+{
+  constexpr auto hex = std::string_view{ "0123456789abcdef" };
+
+  for (const auto c : raw) {
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      case '\r':
+        out += "\\r";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          out += "\\u00";
+          out += hex[c >> 4];
+          out += hex[c & 0xf];
+        }
+        else {
+          out += c;
+        }
+    }
+  }
+}
+
+} // namespace details
+
+// Pull parser over a JSON document held in memory. `parse` walks one value
+// and reports it to a SAX handler providing
+//
+//   null(), boolean(bool), integer(int64_t), number(double),
+//   string(string_view), key(string_view),
+//   begin_object(), end_object(), begin_array(), end_array()
+//
+// Strings and keys handed to the handler only live until the next callback.
+// The cursor can also be moved by hand (`seek`, `peek`, `skip`), which is
+// what lazy and streaming consumers use to step over values they do not
+// need without decoding them.
+class JsonReader
+{
+private:
+  std::string_view json;
+  size_t pos = 0;
+  const char* failure = nullptr;
+  std::string scratch;
+
+  static constexpr size_t max_depth = 512;
+
+  bool
+  fail(const char* message)
+  {
+    if (failure == nullptr) {
+      failure = message;
+    }
+    return false;
+  }
+
+  bool
+  literal(std::string_view word)
+  {
+    if (json.substr(pos, word.size()) != word) {
+      return fail("invalid literal");
+    }
+    pos += word.size();
+    return true;
+  }
+
+  template<typename Handler>
+  bool
+  number(Handler& handler)
+  {
+    const auto start = pos;
+    bool integral = true;
+    for (; pos < json.size(); ++pos) {
+      const char c = json[pos];
+      if (c == '.' || c == 'e' || c == 'E' || c == '+') {
+        integral = false;
+      }
+      else if (!((c >= '0' && c <= '9') || c == '-')) {
+        break;
+      }
+    }
+
+    const auto* first = json.data() + start;
+    const auto* last = json.data() + pos;
+    if (integral) {
+      int64_t value = 0;
+      const auto [end, ec] = std::from_chars(first, last, value);
+      if (ec == std::errc{} && end == last) {
+        handler.integer(value);
+        return true;
+      }
+    }
+
+    double value = 0;
+    const auto [end, ec] = std::from_chars(first, last, value);
+    if (end != last || start == pos ||
+        (ec != std::errc{} && ec != std::errc::result_out_of_range)) {
+      pos = start;
+      return fail("invalid number");
+    }
+    handler.number(value);
+    return true;
+  }
+
+  template<typename Handler>
+  bool
+  value(Handler& handler, size_t depth)
+  {
+    if (depth > max_depth) {
+      return fail("nesting too deep");
+    }
+
+    skip_space();
+    if (pos >= json.size()) {
+      return fail("unexpected end of input");
+    }
+
+    switch (json[pos]) {
+      case '{': {
+        handler.begin_object();
+        ++pos;
+        skip_space();
+        if (pos < json.size() && json[pos] == '}') {
+          ++pos;
+          handler.end_object();
+          return true;
+        }
+        for (;;) {
+          if (peek() != '"') {
+            return fail("expected a member name");
+          }
+          auto name = std::string_view{};
+          if (!string(name)) {
+            return false;
+          }
+          handler.key(name);
+          skip_space();
+          if (pos >= json.size() || json[pos] != ':') {
+            return fail("expected ':'");
+          }
+          ++pos;
+          if (!value(handler, depth + 1)) {
+            return false;
+          }
+          skip_space();
+          if (pos < json.size() && json[pos] == ',') {
+            ++pos;
+            continue;
+          }
+          if (pos < json.size() && json[pos] == '}') {
+            ++pos;
+            handler.end_object();
+            return true;
+          }
+          return fail("expected ',' or '}'");
+        }
+      }
+      case '[': {
+        handler.begin_array();
+        ++pos;
+        skip_space();
+        if (pos < json.size() && json[pos] == ']') {
+          ++pos;
+          handler.end_array();
+          return true;
+        }
+        for (;;) {
+          if (!value(handler, depth + 1)) {
+            return false;
+          }
+          skip_space();
+          if (pos < json.size() && json[pos] == ',') {
+            ++pos;
+            continue;
+          }
+          if (pos < json.size() && json[pos] == ']') {
+            ++pos;
+            handler.end_array();
+            return true;
+          }
+          return fail("expected ',' or ']'");
+        }
+      }
+      case '"': {
+        auto text = std::string_view{};
+        if (!string(text)) {
+          return false;
+        }
+        handler.string(text);
+        return true;
+      }
+      case 't':
+        if (!literal("true")) {
+          return false;
+        }
+        handler.boolean(true);
+        return true;
+      case 'f':
+        if (!literal("false")) {
+          return false;
+        }
+        handler.boolean(false);
+        return true;
+      case 'n':
+        if (!literal("null")) {
+          return false;
+        }
+        handler.null();
+        return true;
+      default:
+        return number(handler);
+    }
+  }
+
+public:
+  explicit JsonReader(std::string_view json)
+    : json{ json }
+  {}
+
+  // Offset of the cursor, or of the error once one occurred.
+  size_t
+  position() const
+  {
+    return pos;
+  }
+
+  void
+  seek(size_t offset)
+  {
+    pos = offset;
+    failure = nullptr;
+  }
+
+  // Null while no error occurred.
+  const char*
+  error() const
+  {
+    return failure;
+  }
+
+  void
+  skip_space()
+  {
+    while (pos < json.size() && (json[pos] == ' ' || json[pos] == '\n' ||
+                                 json[pos] == '\r' || json[pos] == '\t')) {
+      ++pos;
+    }
+  }
+
+  // Next significant character, or '\0' at the end of the input.
+  char
+  peek()
+  {
+    skip_space();
+    return pos < json.size() ? json[pos] : '\0';
+  }
+
+  // Step over the next character if it is `c`.
+  bool
+  consume(char c)
+  {
+    if (peek() != c) {
+      return false;
+    }
+    ++pos;
+    return true;
+  }
+
+  // Read the string at the cursor. The view points into the document when
+  // the string has no escapes, and into a buffer of the reader otherwise.
+  bool
+  string(std::string_view& out)
+  {
+    if (peek() != '"') {
+      return fail("expected a string");
+    }
+
+    const auto end = details::skip_json_string(json, pos);
+    if (end == std::string_view::npos) {
+      return fail("unterminated string");
+    }
+
+    const auto raw = json.substr(pos + 1, end - pos - 2);
+    pos = end;
+    if (raw.find('\\') == std::string_view::npos) {
+      out = raw;
+      return true;
+    }
+
+    scratch.clear();
+    details::unescape_json(scratch, raw);
+    out = scratch;
+    return true;
+  }
+
+  // Step over the value at the cursor. Containers are only checked for
+  // balanced brackets, which makes skipping much cheaper than parsing.
+  bool
+  skip()
+  {
+    const char c = peek();
+    if (c == '"') {
+      pos = details::skip_json_string(json, pos);
+      return pos != std::string_view::npos || fail("unterminated string");
+    }
+
+    if (c != '{' && c != '[') {
+      const auto start = pos;
+      while (pos < json.size() && json[pos] != ',' && json[pos] != ']' &&
+             json[pos] != '}' && json[pos] != ' ' && json[pos] != '\n' &&
+             json[pos] != '\r' && json[pos] != '\t') {
+        ++pos;
+      }
+      return pos != start || fail("expected a value");
+    }
+
+    size_t depth = 0;
+    for (;;) {
+      pos = details::scan_for<'"', '{', '}', '[', ']'>(json, pos);
+      if (pos == std::string_view::npos) {
+        pos = json.size();
+        return fail("unexpected end of input");
+      }
+      switch (json[pos]) {
+        case '"':
+          pos = details::skip_json_string(json, pos);
+          if (pos == std::string_view::npos) {
+            pos = json.size();
+            return fail("unterminated string");
+          }
+          continue;
+        case '{':
+        case '[':
+          depth += 1;
+          break;
+        default:
+          depth -= 1;
+      }
+      ++pos;
+      if (depth == 0) {
+        return true;
+      }
+    }
+  }
+
+  // Parse the value at the cursor.
+  template<typename Handler>
+  bool
+  parse(Handler& handler)
+  {
+    return value(handler, 0);
+  }
+
+  // Parse a whole document: one value and nothing but whitespace after it.
+  template<typename Handler>
+  bool
+  parse_document(Handler& handler)
+  {
+    if (!value(handler, 0)) {
+      return false;
+    }
+    return peek() == '\0' || fail("unexpected data after the document");
+  }
+};
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include "fmt.hh"
+
+namespace
+{
+
+// Re-serializes events in a compact form, to check what the reader saw.
+struct JsonEcho
+{
+  std::string out;
+  bool first = true;
+
+  void
+  separate()
+  {
+    if (!first) {
+      out += ',';
+    }
+    first = false;
+  }
+
+  void
+  null()
+  {
+    separate();
+    out += "null";
+  }
+
+  void
+  boolean(bool value)
+  {
+    separate();
+    out += value ? "true" : "false";
+  }
+
+  void
+  integer(int64_t value)
+  {
+    separate();
+    out += dk_fmt("i{}", value);
+  }
+
+  void
+  number(double value)
+  {
+    separate();
+    out += dk_fmt("d{}", value);
+  }
+
+  void
+  string(std::string_view value)
+  {
+    separate();
+    out += dk_fmt("'{}'", value);
+  }
+
+  void
+  key(std::string_view name)
+  {
+    separate();
+    out += dk_fmt("{}:", name);
+    first = true;
+  }
+
+  void
+  begin_object()
+  {
+    separate();
+    out += '{';
+    first = true;
+  }
+
+  void
+  end_object()
+  {
+    out += '}';
+    first = false;
+  }
+
+  void
+  begin_array()
+  {
+    separate();
+    out += '[';
+    first = true;
+  }
+
+  void
+  end_array()
+  {
+    out += ']';
+    first = false;
+  }
+};
+
+std::string
+echo(std::string_view json)
+{
+  auto handler = JsonEcho{};
+  auto reader = devkit::JsonReader{ json };
+  if (!reader.parse_document(handler)) {
+    return dk_fmt("error: {} at {}", reader.error(), reader.position());
+  }
+  return handler.out;
+}
+
+} // namespace
+
+TEST_CASE("testing json")
+{
+  SUBCASE("parse")
+  {
+    CHECK(echo(R"( {"a": [1, -2.5, 1e3, true, false, null], "b": {}} )") ==
+          "{a:[i1,d-2.5,d1000,true,false,null],b:{}}");
+    CHECK(echo(R"(["tab\there", "é😀", "q\"\\/"])") ==
+          "['tab\there','\xc3\xa9\xf0\x9f\x98\x80','q\"\\/']");
+    CHECK(echo("9223372036854775807") == "i9223372036854775807");
+    CHECK(echo("18446744073709551616") == "d1.8446744073709552e+19");
+    CHECK(echo("[]") == "[]");
+  }
+
+  SUBCASE("errors")
+  {
+    CHECK(echo("") == "error: unexpected end of input at 0");
+    CHECK(echo("[1,]") == "error: invalid number at 3");
+    CHECK(echo("{\"a\" 1}") == "error: expected ':' at 5");
+    CHECK(echo("{\"a\": 1,}") == "error: expected a member name at 8");
+    CHECK(echo("[1] 2") == "error: unexpected data after the document at 4");
+    CHECK(echo("[\"abc") == "error: unterminated string at 1");
+    CHECK(echo("nul") == "error: invalid literal at 0");
+    CHECK(echo(std::string(600, '[')) == "error: nesting too deep at 513");
+  }
+
+  SUBCASE("escape")
+  {
+    const auto raw = std::string_view{ "q\"\\ \n\t\r\x01\x1f é" };
+    auto escaped = std::string{};
+    devkit::details::escape_json(escaped, raw);
+    CHECK(escaped == R"(q\"\\ \n\t\r\u0001\u001f é)");
+    CHECK(devkit::details::unescape_json(escaped) == raw);
+  }
+
+  SUBCASE("long strings")
+  {
+    // quotes and escapes on both sides of a 16 byte block
+    for (size_t n = 0; n < 40; ++n) {
+      const auto padding = std::string(n, 'x');
+      CHECK(echo(dk_fmt(R"("{}\"{}")", padding, padding)) ==
+            dk_fmt("'{}\"{}'", padding, padding));
+    }
+  }
+
+  SUBCASE("skip")
+  {
+    const auto json = std::string_view{
+      R"([{"s": "]}\"", "n": [[1], {"x": null}]}, 12.5, "tail", true])"
+    };
+    auto reader = devkit::JsonReader{ json };
+    REQUIRE(reader.consume('['));
+
+    REQUIRE(reader.skip());
+    CHECK(reader.consume(','));
+    CHECK(reader.peek() == '1');
+    const auto number = reader.position();
+    REQUIRE(reader.skip());
+    CHECK(json.substr(number, reader.position() - number) == "12.5");
+    CHECK(reader.consume(','));
+
+    auto text = std::string_view{};
+    REQUIRE(reader.string(text));
+    CHECK(text == "tail");
+    CHECK(reader.consume(','));
+    REQUIRE(reader.skip());
+    CHECK(reader.consume(']'));
+    CHECK(reader.peek() == '\0');
+
+    reader.seek(1);
+    auto handler = JsonEcho{};
+    REQUIRE(reader.parse(handler));
+    CHECK(handler.out == "{s:']}\"',n:[[i1],{x:null}]}");
+
+    auto broken = devkit::JsonReader{ "[{\"a\": [1, 2}" };
+    CHECK(!broken.skip());
+    CHECK(broken.error() != nullptr);
+  }
+}
+#endif
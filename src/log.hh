@@ -0,0 +1,451 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <fmt/core.h>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+
+// Lowest level that is compiled in: 0 debug, 1 info, 2 error, 3 none. Calls
+// below it are discarded by `if constexpr`, arguments included.
+#ifndef DK_LOG_LEVEL
+#define DK_LOG_LEVEL 0
+#endif
+
+namespace devkit
+{
+
+enum class LogLevel
+{
+  debug,
+  info,
+  error,
+};
+
+enum class Overflow
+{
+  drop,  // discard the message and count it
+  block, // wait for the writer thread to make room
+};
+
+template<LogLevel Level>
+inline constexpr bool log_enabled = static_cast<int>(Level) >= DK_LOG_LEVEL;
+
+// Logger formatting on the calling thread into a bounded lock-free ring
+// buffer; a background thread writes the messages out in order. Any number
+// of threads may log at once. Messages longer than a slot are formatted on
+// the heap instead, and still written in order.
+// The writer thread does not survive fork: a child logging through an
+// instance created by its parent writes synchronously instead.
+class AsyncLog
+{
+public:
+  static constexpr size_t message_size = 248;
+
+private:
+  struct Slot
+  {
+    std::atomic<size_t> sequence;
+    FILE* file;
+    uint32_t size;
+    std::array<char, message_size> text;
+    std::unique_ptr<char[]> long_text;
+  };
+
+  std::unique_ptr<Slot[]> slots;
+  size_t mask;
+  Overflow overflow;
+
+  alignas(64) std::atomic<size_t> enqueue_pos{ 0 };
+  alignas(64) std::atomic<size_t> dequeue_pos{ 0 };
+  alignas(64) std::atomic<uint32_t> pushed{ 0 };
+  std::atomic<size_t> flushed{ 0 };
+  std::atomic<size_t> dropped{ 0 };
+  std::atomic<bool> stopping{ false };
+  std::thread writer;
+  int owner = getpid();
+
+  // Whether this is a forked copy, without the writer thread.
+  bool
+  forked() const
+  {
+    return getpid() != owner;
+  }
+
+  // Writes out everything published so far. Only one thread may drain.
+  void
+  drain()
+  {
+    FILE* touched[2] = {};
+    auto pos = dequeue_pos.load(std::memory_order_relaxed);
+
+    for (;;) {
+      auto& slot = slots[pos & mask];
+      if (slot.sequence.load(std::memory_order_acquire) != pos + 1) {
+        break;
+      }
+
+      if (slot.long_text != nullptr) {
+        std::fwrite(slot.long_text.get(), 1, slot.size, slot.file);
+        slot.long_text.reset();
+      }
+      else {
+        std::fwrite(slot.text.data(), 1, slot.size, slot.file);
+      }
+      if (touched[0] != slot.file && touched[1] != slot.file) {
+        touched[touched[0] == nullptr ? 0 : 1] = slot.file;
+      }
+
+      slot.sequence.store(pos + mask + 1, std::memory_order_release);
+      dequeue_pos.store(++pos, std::memory_order_release);
+    }
+
+    if (const auto count = dropped.exchange(0); count != 0) {
+      fmt::println(stderr, "log: {} messages dropped", count);
+    }
+    for (auto* file : touched) {
+      if (file != nullptr) {
+        std::fflush(file);
+      }
+    }
+
+    flushed.store(pos, std::memory_order_release);
+    flushed.notify_all();
+  }
+
+  void
+  run()
+  {
+    for (;;) {
+      const auto seen = pushed.load(std::memory_order_acquire);
+      drain();
+      if (stopping.load(std::memory_order_acquire)) {
+        drain();
+        return;
+      }
+      pushed.wait(seen, std::memory_order_acquire);
+    }
+  }
+
+public:
+  explicit AsyncLog(size_t capacity = 1024, Overflow overflow = Overflow::drop)
+    : slots{ new Slot[std::bit_ceil(std::max<size_t>(capacity, 2))] }
+    , mask{ std::bit_ceil(std::max<size_t>(capacity, 2)) - 1 }
+    , overflow{ overflow }
+  {
+    for (size_t i = 0; i <= mask; ++i) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  AsyncLog(const AsyncLog&) = delete;
+  AsyncLog&
+  operator=(const AsyncLog&) = delete;
+
+  ~AsyncLog()
+  {
+    if (forked()) {
+      // The parent writes what it logged, its writer is not ours to join.
+      if (writer.joinable()) {
+        writer.detach();
+      }
+      return;
+    }
+
+    if (writer.joinable()) {
+      stopping.store(true, std::memory_order_release);
+      pushed.fetch_add(1, std::memory_order_release);
+      pushed.notify_one();
+      writer.join();
+    }
+    else {
+      drain();
+    }
+  }
+
+  // The process wide logger behind dk_log and dk_err.
+  static AsyncLog&
+  instance()
+  {
+    static auto log = [] {
+      auto log = std::make_unique<AsyncLog>();
+      log->start();
+      return log;
+    }();
+    return *log;
+  }
+
+  void
+  start()
+  {
+    if (!writer.joinable()) {
+      writer = std::thread{ [this] { run(); } };
+    }
+  }
+
+  // Waits until everything logged before the call is written and flushed.
+  // Without a writer thread, the caller drains the buffer itself.
+  void
+  flush()
+  {
+    if (forked()) {
+      return;
+    }
+
+    const auto target = enqueue_pos.load(std::memory_order_acquire);
+    if (!writer.joinable()) {
+      drain();
+      return;
+    }
+
+    pushed.fetch_add(1, std::memory_order_release);
+    pushed.notify_one();
+    for (auto done = flushed.load(std::memory_order_acquire); done < target;
+         done = flushed.load(std::memory_order_acquire)) {
+      flushed.wait(done, std::memory_order_acquire);
+    }
+  }
+
+  size_t
+  dropped_count() const
+  {
+    return dropped.load(std::memory_order_relaxed);
+  }
+
+  template<typename... T>
+  bool
+  write(FILE* file, fmt::format_string<T...> fmt, T&&... args)
+  {
+    // Arguments are formatted as the lvalues they are here, the format string
+    // was checked against the types as passed.
+    const auto format = fmt::string_view{ fmt };
+    const auto format_args = fmt::make_format_args(args...);
+
+    if (forked()) {
+      fmt::vprint(file, format, format_args);
+      std::fputc('\n', file);
+      std::fflush(file);
+      return true;
+    }
+
+    auto pos = enqueue_pos.load(std::memory_order_relaxed);
+    Slot* slot = nullptr;
+
+    for (;;) {
+      slot = &slots[pos & mask];
+      const auto sequence = slot->sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(
+              pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      }
+      else if (diff < 0) {
+        if (overflow == Overflow::drop) {
+          dropped.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+        std::this_thread::yield();
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+      else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+
+    // One byte is kept for the newline. A message that does not fit is
+    // formatted again into a buffer of its own.
+    const auto result = fmt::vformat_to_n(
+      slot->text.data(), message_size - 1, format, format_args);
+    auto size = result.size;
+    if (size > message_size - 1) {
+      slot->long_text.reset(new char[size + 1]);
+      fmt::vformat_to(slot->long_text.get(), format, format_args);
+      slot->long_text[size++] = '\n';
+    }
+    else {
+      slot->text[size++] = '\n';
+    }
+    slot->file = file;
+    slot->size = static_cast<uint32_t>(size);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+
+    pushed.fetch_add(1, std::memory_order_release);
+    pushed.notify_one();
+    return true;
+  }
+};
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <string>
+#include <sys/wait.h>
+#include <vector>
+
+TEST_CASE("testing log")
+{
+  const auto read_lines = [](FILE* file) {
+    std::rewind(file);
+    auto lines = std::vector<std::string>{};
+    auto line = std::string{};
+    for (int c = std::fgetc(file); c != EOF; c = std::fgetc(file)) {
+      if (c == '\n') {
+        lines.push_back(line);
+        line.clear();
+      }
+      else {
+        line += static_cast<char>(c);
+      }
+    }
+    return lines;
+  };
+
+  SUBCASE("order")
+  {
+    auto* file = std::tmpfile();
+    {
+      auto log = devkit::AsyncLog{ 8, devkit::Overflow::block };
+      log.start();
+      for (int i = 0; i < 100; ++i) {
+        log.write(file, "line {}", i);
+      }
+      log.flush();
+
+      const auto lines = read_lines(file);
+      REQUIRE(lines.size() == 100);
+      CHECK(lines.front() == "line 0");
+      CHECK(lines.back() == "line 99");
+    }
+    std::fclose(file);
+  }
+
+  SUBCASE("threads")
+  {
+    auto* file = std::tmpfile();
+    {
+      auto log = devkit::AsyncLog{ 16, devkit::Overflow::block };
+      log.start();
+
+      auto threads = std::vector<std::thread>{};
+      for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t] {
+          for (int i = 0; i < 1000; ++i) {
+            log.write(file, "{} {}", t, i);
+          }
+        });
+      }
+      for (auto& thread : threads) {
+        thread.join();
+      }
+      log.flush();
+
+      // Every message arrives, and each thread's messages stay in order.
+      const auto lines = read_lines(file);
+      CHECK(lines.size() == 4000);
+      auto next = std::array<int, 4>{};
+      for (const auto& line : lines) {
+        const auto t = line[0] - '0';
+        CHECK(line.substr(2) == std::to_string(next[t]++));
+      }
+      CHECK(log.dropped_count() == 0);
+    }
+    std::fclose(file);
+  }
+
+  SUBCASE("arguments")
+  {
+    auto* file = std::tmpfile();
+    {
+      auto log = devkit::AsyncLog{ 4 };
+      const auto name = std::string{ "lvalue" };
+      log.write(file, "{} {} {}", 5, std::string{ "rvalue" }, name);
+      log.flush();
+
+      const auto lines = read_lines(file);
+      REQUIRE(lines.size() == 1);
+      CHECK(lines[0] == "5 rvalue lvalue");
+    }
+    std::fclose(file);
+  }
+
+  SUBCASE("fork")
+  {
+    auto* file = std::tmpfile();
+    {
+      auto log = std::make_unique<devkit::AsyncLog>(4);
+      log->start();
+
+      // The child writes on its own and does not wait for the writer
+      // thread it does not have.
+      const auto pid = fork();
+      if (pid == 0) {
+        log->write(file, "child {}", 1);
+        log.reset();
+        _exit(0);
+      }
+      auto status = 0;
+      waitpid(pid, &status, 0);
+      CHECK(WIFEXITED(status));
+
+      log->write(file, "parent");
+      log->flush();
+      const auto lines = read_lines(file);
+      REQUIRE(lines.size() == 2);
+      CHECK(lines[0] == "child 1");
+      CHECK(lines[1] == "parent");
+    }
+    std::fclose(file);
+  }
+
+  SUBCASE("drop")
+  {
+    auto* file = std::tmpfile();
+    {
+      auto log = devkit::AsyncLog{ 4, devkit::Overflow::drop };
+      for (int i = 0; i < 10; ++i) {
+        log.write(file, "line {}", i);
+      }
+      CHECK(log.dropped_count() == 6);
+
+      log.flush();
+      const auto lines = read_lines(file);
+      REQUIRE(lines.size() == 4);
+      CHECK(lines.back() == "line 3");
+    }
+    std::fclose(file);
+  }
+
+  SUBCASE("long")
+  {
+    auto* file = std::tmpfile();
+    {
+      auto log = devkit::AsyncLog{ 4, devkit::Overflow::block };
+      log.start();
+      const auto text = std::string(devkit::AsyncLog::message_size * 4, 'x');
+      for (int i = 0; i < 10; ++i) {
+        log.write(file, "{}", i);
+        log.write(file, "{} {}", i, text);
+      }
+      log.flush();
+
+      const auto lines = read_lines(file);
+      REQUIRE(lines.size() == 20);
+      for (int i = 0; i < 10; ++i) {
+        CHECK(lines[i * 2] == std::to_string(i));
+        CHECK(lines[i * 2 + 1] == std::to_string(i) + " " + text);
+      }
+    }
+    std::fclose(file);
+  }
+}
+#endif
@@ -1,12 +1,20 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
 #include <filesystem>
+#include <iterator>
+#include <limits>
 #include <lua.hpp>
 #include <map>
+#include <new>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "fmt.hh"
@@ -17,16 +25,15 @@ namespace devkit
 namespace details
 {
 
-template<typename T>
+template<typename T, typename = void>
 struct is_map : std::false_type
 {};
 
-template<typename Key, typename Val>
-struct is_map<std::map<Key, Val>> : std::true_type
-{};
-
-template<typename Key, typename Val>
-struct is_map<std::unordered_map<Key, Val>> : std::true_type
+template<typename T>
+struct is_map<
+  T,
+  typename std::void_t<typename T::key_type, typename T::mapped_type>>
+  : std::true_type
 {};
 
 template<typename T>
@@ -48,8 +55,907 @@ struct is_iterable<
 template<typename T>
 constexpr bool is_iterable_v = is_iterable<T>::value;
 
+// Whether T is or holds a std::string_view, which points into a Lua string
+// and is only valid while that string is anchored.
+template<typename T>
+constexpr bool
+holds_view()
+{
+  if constexpr (std::is_same_v<T, std::string_view>) {
+    return true;
+  }
+  else if constexpr (is_map_v<T>) {
+    return holds_view<typename T::key_type>() ||
+           holds_view<typename T::mapped_type>();
+  }
+  else if constexpr (is_iterable_v<T>) {
+    return holds_view<typename T::value_type>();
+  }
+  else {
+    return false;
+  }
+}
+
+// Preallocation hint for the table of a container, 0 when its size is not
+// known up front.
+template<typename T>
+int
+size_hint(const T& container)
+{
+  if constexpr (requires { std::size(container); }) {
+    return static_cast<int>(std::min<size_t>(
+      std::size(container), std::numeric_limits<int>::max()));
+  }
+  else {
+    return 0;
+  }
+}
+
+// Reads the string or number at `index` as T. Lua converts a number in place,
+// so a view of one would point into a string that nothing anchors: views only
+// take strings, copies convert a copy of the value and leave it untouched.
+template<typename T>
+T
+to_string_value(lua_State* L, int index)
+{
+  size_t size = 0;
+  if (lua_type(L, index) == LUA_TSTRING) {
+    const auto* str = lua_tolstring(L, index, &size);
+    return T{ str, size };
+  }
+
+  if constexpr (std::is_same_v<T, std::string_view>) {
+    dk_err("Lua: Expected a string to view, got a {}.",
+           luaL_typename(L, index));
+    exit(1);
+  }
+  else {
+    lua_pushvalue(L, index);
+    const auto* str = luaL_checklstring(L, -1, &size);
+    auto value = T{ str, size };
+    lua_pop(L, 1);
+    return value;
+  }
+}
+
+// Converts the value on top of the stack, leaving it there. Strings are
+// copied unless T asks for views. Sequences are read up to their length,
+// with the container reserved beforehand.
+template<typename T>
+T
+to_value(lua_State* L)
+{
+  if constexpr (std::is_same_v<T, bool>) {
+    return static_cast<bool>(lua_toboolean(L, -1));
+  }
+  else if constexpr (std::is_integral_v<T>) {
+    return static_cast<T>(luaL_checkinteger(L, -1));
+  }
+  else if constexpr (std::is_floating_point_v<T>) {
+    return static_cast<T>(luaL_checknumber(L, -1));
+  }
+  else if constexpr (std::is_same_v<T, std::string> ||
+                     std::is_same_v<T, std::string_view>) {
+    return to_string_value<T>(L, -1);
+  }
+  else if constexpr (is_map_v<T>) {
+    using Key = typename T::key_type;
+    using Val = typename T::mapped_type;
+
+    auto map = T{};
+    if (!lua_istable(L, -1)) {
+      return map;
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+      if constexpr (std::is_integral_v<Key>) {
+        const auto key = static_cast<Key>(luaL_checkinteger(L, -2));
+        map.insert_or_assign(key, to_value<Val>(L));
+      }
+      else if constexpr (std::is_same_v<Key, std::string> ||
+                         std::is_same_v<Key, std::string_view>) {
+        map.insert_or_assign(to_string_value<Key>(L, -2), to_value<Val>(L));
+      }
+      else {
+        dk_err("Lua: Wrong return type.");
+        exit(1);
+      }
+      lua_pop(L, 1);
+    }
+    return map;
+  }
+  else if constexpr (is_iterable_v<T>) {
+    using Val = typename T::value_type;
+
+    auto vec = T{};
+    if (!lua_istable(L, -1)) {
+      return vec;
+    }
+
+    const auto size = static_cast<lua_Integer>(lua_rawlen(L, -1));
+    if constexpr (requires { vec.reserve(size_t{}); }) {
+      vec.reserve(static_cast<size_t>(size));
+    }
+    for (lua_Integer i = 1; i <= size; ++i) {
+      lua_rawgeti(L, -1, i);
+      vec.push_back(to_value<Val>(L));
+      lua_pop(L, 1);
+    }
+    return vec;
+  }
+  else {
+    dk_err("Lua: Return type not supported!");
+    exit(1);
+  }
+}
+
+} // namespace details
+
+// A const container passed to Lua by reference: pushed as a userdata proxy
+// indexing, measuring and iterating the container in place instead of a
+// table with a copy of it. Lua sees a read only table, which works with
+// `#`, `pairs`, `ipairs`, `table.concat` and `table.unpack`, but not with
+// `next` or `type(t) == 'table'`. Nested containers become proxies as
+// well. The container must outlive every use of the proxy, so scripts may
+// only use it during the call it was passed to.
+template<typename T>
+struct LuaView
+{
+  const T* container;
+};
+
+template<typename T>
+LuaView<T>
+lua_view(const T& container)
+{
+  return { &container };
+}
+
+template<typename T>
+LuaView<T>
+lua_view(const T&&) = delete;
+
+namespace details
+{
+
+template<typename T>
+struct is_lua_view : std::false_type
+{};
+
+template<typename T>
+struct is_lua_view<LuaView<T>> : std::true_type
+{};
+
+template<typename T>
+constexpr bool is_container_v =
+  is_map_v<T> || (is_iterable_v<T> && !std::is_same_v<T, std::string_view>);
+
+template<typename Arg>
+void
+push_value(lua_State* L, Arg&& arg);
+
+// Metamethods of the proxies of containers of type T.
+template<typename T>
+struct LuaProxy
+{
+  // The address is the registry key of the metatable.
+  static inline char key;
+
+  static const T&
+  self(lua_State* L)
+  {
+    auto* data = lua_touserdata(L, 1);
+    auto same = false;
+    if (data != nullptr && lua_getmetatable(L, 1)) {
+      lua_rawgetp(L, LUA_REGISTRYINDEX, &key);
+      same = lua_rawequal(L, -1, -2);
+      lua_pop(L, 2);
+    }
+    if (!same) {
+      luaL_typeerror(L, 1, "devkit.view");
+    }
+    return **static_cast<const T**>(data);
+  }
+
+  template<typename V>
+  static void
+  push_element(lua_State* L, const V& value)
+  {
+    if constexpr (is_container_v<V>) {
+      LuaProxy<V>::push(L, value);
+    }
+    else {
+      push_value(L, value);
+    }
+  }
+
+  // Iterator to the key at `index`, end() when there is no such key.
+  static auto
+  find(lua_State* L, const T& map, int index)
+  {
+    using Key = typename T::key_type;
+
+    if constexpr (std::is_integral_v<Key>) {
+      int is_num = 0;
+      const auto key = lua_tointegerx(L, index, &is_num);
+      return is_num != 0 ? map.find(static_cast<Key>(key)) : map.end();
+    }
+    else {
+      if (lua_type(L, index) != LUA_TSTRING) {
+        return map.end();
+      }
+      size_t size = 0;
+      const auto* key = lua_tolstring(L, index, &size);
+      return map.find(Key{ key, size });
+    }
+  }
+
+  // 1 based position at `index`, 0 when it is out of range.
+  static size_t
+  position(lua_State* L, const T& seq, int index)
+  {
+    int is_num = 0;
+    const auto pos = lua_tointegerx(L, index, &is_num);
+    if (is_num == 0 || pos < 1 ||
+        static_cast<lua_Unsigned>(pos) > std::size(seq)) {
+      return 0;
+    }
+    return static_cast<size_t>(pos);
+  }
+
+  static int
+  index(lua_State* L)
+  {
+    const auto& container = self(L);
+
+    if constexpr (is_map_v<T>) {
+      const auto it = find(L, container, 2);
+      if (it == container.end()) {
+        return 0;
+      }
+      push_element(L, it->second);
+    }
+    else {
+      const auto pos = position(L, container, 2);
+      if (pos == 0) {
+        return 0;
+      }
+      push_element(L, *std::next(std::begin(container), pos - 1));
+    }
+    return 1;
+  }
+
+  static int
+  newindex(lua_State* L)
+  {
+    self(L);
+    return luaL_error(L, "Cannot modify a read only view.");
+  }
+
+  static int
+  len(lua_State* L)
+  {
+    lua_pushinteger(L, static_cast<lua_Integer>(std::size(self(L))));
+    return 1;
+  }
+
+  static int
+  next(lua_State* L)
+  {
+    const auto& container = self(L);
+
+    if constexpr (is_map_v<T>) {
+      auto it = container.begin();
+      if (!lua_isnil(L, 2)) {
+        it = find(L, container, 2);
+        if (it != container.end()) {
+          ++it;
+        }
+      }
+      if (it == container.end()) {
+        return 0;
+      }
+      push_value(L, it->first);
+      push_element(L, it->second);
+    }
+    else {
+      auto pos = size_t{ 1 };
+      if (!lua_isnil(L, 2)) {
+        pos = position(L, container, 2);
+        if (pos == 0) {
+          return 0;
+        }
+        ++pos;
+      }
+      if (pos > std::size(container)) {
+        return 0;
+      }
+      lua_pushinteger(L, static_cast<lua_Integer>(pos));
+      push_element(L, *std::next(std::begin(container), pos - 1));
+    }
+    return 2;
+  }
+
+  static int
+  pairs(lua_State* L)
+  {
+    self(L);
+    lua_pushcfunction(L, next);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+  }
+
+  static void
+  push(lua_State* L, const T& container)
+  {
+    auto** data =
+      static_cast<const T**>(lua_newuserdatauv(L, sizeof(const T*), 0));
+    *data = &container;
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &key) == LUA_TNIL) {
+      lua_pop(L, 1);
+
+      constexpr auto meta = std::array{ luaL_Reg{ "__index", index },
+                                        luaL_Reg{ "__newindex", newindex },
+                                        luaL_Reg{ "__len", len },
+                                        luaL_Reg{ "__pairs", pairs },
+                                        luaL_Reg{ nullptr, nullptr } };
+      lua_createtable(L, 0, meta.size());
+      luaL_setfuncs(L, meta.data(), 0);
+      lua_pushliteral(L, "devkit.view");
+      lua_setfield(L, -2, "__name");
+
+      lua_pushvalue(L, -1);
+      lua_rawsetp(L, LUA_REGISTRYINDEX, &key);
+    }
+    lua_setmetatable(L, -2);
+  }
+};
+
+// Pushes a copy of `arg`, or a proxy for a LuaView. Tables are created with
+// room for every element of the container.
+template<typename Arg>
+void
+push_value(lua_State* L, Arg&& arg)
+{
+  using T = std::remove_cvref_t<Arg>;
+
+  if constexpr (std::is_same_v<T, bool>) {
+    lua_pushboolean(L, arg);
+  }
+  else if constexpr (std::is_integral_v<T>) {
+    lua_pushinteger(L, static_cast<lua_Integer>(arg));
+  }
+  else if constexpr (std::is_floating_point_v<T>) {
+    lua_pushnumber(L, arg);
+  }
+  else if constexpr (std::is_convertible_v<T, const char*>) {
+    lua_pushstring(L, arg);
+  }
+  else if constexpr (std::is_same_v<T, std::string> ||
+                     std::is_same_v<T, std::string_view>) {
+    lua_pushlstring(L, arg.data(), arg.size());
+  }
+  else if constexpr (is_lua_view<T>::value) {
+    using Container = std::remove_cvref_t<decltype(*arg.container)>;
+    LuaProxy<Container>::push(L, *arg.container);
+  }
+  else if constexpr (is_map_v<T>) {
+    lua_createtable(L, 0, size_hint(arg));
+    for (const auto& [key, value] : arg) {
+      push_value(L, key);
+      push_value(L, value);
+      lua_rawset(L, -3);
+    }
+  }
+  else if constexpr (is_iterable_v<T>) {
+    lua_createtable(L, size_hint(arg), 0);
+    lua_Integer index = 1;
+    for (const auto& elem : arg) {
+      push_value(L, elem);
+      lua_rawseti(L, -2, index++);
+    }
+  }
+  else {
+    dk_err("Lua: Wrong argument type!");
+    exit(1);
+  }
+}
+
 } // namespace details
 
+// How a Lua state is created. `alloc` replaces malloc for every allocation
+// of the state, e.g. ArenaAllocator::lua_alloc with the arena as `userdata`,
+// which must outlive the state. `one_shot` stops the collector for states
+// that live as long as a short command does. `generational` switches the
+// collector to generational mode, for states running scripts of unbounded
+// length that mostly make short lived garbage.
+struct LuaConfig
+{
+  lua_Alloc alloc = nullptr;
+  void* userdata = nullptr;
+  bool one_shot = false;
+  bool generational = false;
+};
+
+// A value anchored in the registry of a state, returned by the call
+// functions for Ret = LuaRef. Neither the value nor anything it references
+// is collected while the handle lives, so `get` can hand out views into its
+// strings instead of copies; they stay valid until the handle goes away or
+// the value is modified. A handle must not outlive its state.
+class LuaRef
+{
+private:
+  lua_State* L = nullptr;
+  int ref = LUA_NOREF;
+
+public:
+  LuaRef() = default;
+
+  // Anchors the value on top of the stack and pops it.
+  explicit LuaRef(lua_State* L)
+    : L{ L }
+    , ref{ luaL_ref(L, LUA_REGISTRYINDEX) }
+  {}
+
+  ~LuaRef()
+  {
+    if (L != nullptr) {
+      luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    }
+  }
+
+  LuaRef(const LuaRef&) = delete;
+  LuaRef&
+  operator=(const LuaRef&) = delete;
+
+  LuaRef(LuaRef&& other)
+    : L{ std::exchange(other.L, nullptr) }
+    , ref{ std::exchange(other.ref, LUA_NOREF) }
+  {}
+
+  LuaRef&
+  operator=(LuaRef&& other)
+  {
+    if (this != &other) {
+      if (L != nullptr) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref);
+      }
+      L = std::exchange(other.L, nullptr);
+      ref = std::exchange(other.ref, LUA_NOREF);
+    }
+    return *this;
+  }
+
+  // LUA_TNIL for an empty handle.
+  int
+  type() const
+  {
+    if (L == nullptr) {
+      return LUA_TNIL;
+    }
+    const auto type = lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_pop(L, 1);
+    return type;
+  }
+
+  // Pushes the value on the stack of its state and returns the state, to
+  // read it with the C API. An empty handle pushes nothing, nullptr.
+  lua_State*
+  push() const
+  {
+    if (L != nullptr) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    }
+    return L;
+  }
+
+  template<typename T>
+  T
+  get() const
+  {
+    if (L == nullptr) {
+      return T{};
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    auto value = details::to_value<T>(L);
+    lua_pop(L, 1);
+    return value;
+  }
+};
+
+// Returned by a bound function failing at runtime: Lua gets nil and the
+// message, as from the io library.
+struct LuaFailure
+{
+  std::string message;
+};
+
+// Result of a bound function that can fail.
+template<typename T>
+struct LuaResult
+{
+  std::optional<T> value;
+  std::string error;
+
+  LuaResult(T value)
+    : value{ std::move(value) }
+  {}
+
+  LuaResult(LuaFailure failure)
+    : error{ std::move(failure.message) }
+  {}
+};
+
+// A named callable for Lua::register_module.
+template<typename F>
+struct LuaBinding
+{
+  const char* name;
+  F fn;
+};
+
+template<typename F>
+LuaBinding<std::decay_t<F>>
+lua_bind(const char* name, F&& fn)
+{
+  return { name, std::forward<F>(fn) };
+}
+
+namespace details
+{
+
+template<typename T>
+struct is_optional : std::false_type
+{};
+
+template<typename T>
+struct is_optional<std::optional<T>> : std::true_type
+{};
+
+template<typename T>
+struct is_lua_result : std::false_type
+{};
+
+template<typename T>
+struct is_lua_result<LuaResult<T>> : std::true_type
+{};
+
+template<typename T>
+constexpr bool dependent_false = false;
+
+// Whether converting an argument to T allocates.
+template<typename T>
+constexpr bool
+allocates()
+{
+  if constexpr (is_optional<T>::value) {
+    return allocates<typename T::value_type>();
+  }
+  else {
+    return std::is_same_v<T, std::string> || is_container_v<T>;
+  }
+}
+
+// Raises the error for argument `arg` unless the element of a container on
+// top of the stack converts to T, descending into nested containers.
+template<typename T>
+void
+check_element(lua_State* L, int arg)
+{
+  const char* expected = nullptr;
+  auto valid = false;
+
+  if constexpr (std::is_same_v<T, bool>) {
+    valid = true;
+  }
+  else if constexpr (std::is_integral_v<T>) {
+    auto is_integer = 0;
+    lua_tointegerx(L, -1, &is_integer);
+    valid = is_integer != 0;
+    expected = "integer";
+  }
+  else if constexpr (std::is_floating_point_v<T>) {
+    valid = lua_type(L, -1) == LUA_TNUMBER;
+    expected = "number";
+  }
+  else if constexpr (std::is_same_v<T, std::string_view>) {
+    // Views only take strings, see to_string_value.
+    valid = lua_type(L, -1) == LUA_TSTRING;
+    expected = "string";
+  }
+  else if constexpr (std::is_same_v<T, std::string>) {
+    valid = lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER;
+    expected = "string";
+  }
+  else if constexpr (is_map_v<T>) {
+    valid = lua_istable(L, -1);
+    expected = "table";
+    if (valid) {
+      lua_pushnil(L);
+      while (lua_next(L, -2) != 0) {
+        lua_pushvalue(L, -2);
+        check_element<typename T::key_type>(L, arg);
+        lua_pop(L, 1);
+        check_element<typename T::mapped_type>(L, arg);
+        lua_pop(L, 1);
+      }
+    }
+  }
+  else if constexpr (is_iterable_v<T>) {
+    valid = lua_istable(L, -1);
+    expected = "table";
+    if (valid) {
+      const auto size = static_cast<lua_Integer>(lua_rawlen(L, -1));
+      for (lua_Integer i = 1; i <= size; ++i) {
+        lua_rawgeti(L, -1, i);
+        check_element<typename T::value_type>(L, arg);
+        lua_pop(L, 1);
+      }
+    }
+  }
+  else {
+    static_assert(dependent_false<T>, "Lua: Argument type not supported.");
+  }
+
+  if (!valid) {
+    luaL_argerror(L,
+                  arg,
+                  lua_pushfstring(L,
+                                  "%s expected in the table, got %s",
+                                  expected,
+                                  luaL_typename(L, -1)));
+  }
+}
+
+// Raises the error for an argument Lua cannot convert to T. Errors unwind
+// with longjmp and would skip the destructors of arguments converted
+// already, so when any of them allocates, every argument is checked before
+// the first is converted, containers element by element.
+template<typename T>
+void
+check_arg(lua_State* L, int index)
+{
+  if constexpr (is_optional<T>::value) {
+    if (!lua_isnoneornil(L, index)) {
+      check_arg<typename T::value_type>(L, index);
+    }
+  }
+  else if constexpr (std::is_same_v<T, bool>) {
+    // Any value converts to a boolean.
+  }
+  else if constexpr (std::is_integral_v<T>) {
+    luaL_checkinteger(L, index);
+  }
+  else if constexpr (std::is_floating_point_v<T>) {
+    luaL_checknumber(L, index);
+  }
+  else if constexpr (std::is_same_v<T, const char*> ||
+                     std::is_same_v<T, std::string> ||
+                     std::is_same_v<T, std::string_view>) {
+    luaL_checkstring(L, index);
+  }
+  else if constexpr (is_container_v<T>) {
+    luaL_checktype(L, index, LUA_TTABLE);
+    lua_pushvalue(L, index);
+    check_element<T>(L, index);
+    lua_pop(L, 1);
+  }
+  else {
+    static_assert(dependent_false<T>, "Lua: Argument type not supported.");
+  }
+}
+
+// Converts an argument, checking it on the way unless check_arg did.
+// Views and C strings point into the argument, valid during the call.
+template<typename T, bool Checked>
+T
+get_arg(lua_State* L, int index)
+{
+  if constexpr (is_optional<T>::value) {
+    if (lua_isnoneornil(L, index)) {
+      return std::nullopt;
+    }
+    return get_arg<typename T::value_type, Checked>(L, index);
+  }
+  else if constexpr (std::is_same_v<T, bool>) {
+    return lua_toboolean(L, index) != 0;
+  }
+  else if constexpr (std::is_integral_v<T>) {
+    return static_cast<T>(Checked ? lua_tointeger(L, index)
+                                  : luaL_checkinteger(L, index));
+  }
+  else if constexpr (std::is_floating_point_v<T>) {
+    return static_cast<T>(Checked ? lua_tonumber(L, index)
+                                  : luaL_checknumber(L, index));
+  }
+  else if constexpr (std::is_same_v<T, const char*>) {
+    return Checked ? lua_tostring(L, index) : luaL_checkstring(L, index);
+  }
+  else if constexpr (std::is_same_v<T, std::string> ||
+                     std::is_same_v<T, std::string_view>) {
+    size_t size = 0;
+    const auto* str = Checked ? lua_tolstring(L, index, &size)
+                              : luaL_checklstring(L, index, &size);
+    return T{ str, size };
+  }
+  else if constexpr (is_container_v<T>) {
+    if constexpr (!Checked) {
+      luaL_checktype(L, index, LUA_TTABLE);
+    }
+    lua_pushvalue(L, index);
+    auto value = to_value<T>(L);
+    lua_pop(L, 1);
+    return value;
+  }
+  else {
+    static_assert(dependent_false<T>, "Lua: Argument type not supported.");
+  }
+}
+
+// Pushes what a bound function returned, returns the number of results.
+template<typename R>
+int
+push_result(lua_State* L, R&& result)
+{
+  using T = std::remove_cvref_t<R>;
+
+  if constexpr (is_optional<T>::value) {
+    if (!result.has_value()) {
+      lua_pushnil(L);
+      return 1;
+    }
+    return push_result(L, *result);
+  }
+  else if constexpr (is_lua_result<T>::value) {
+    if (!result.value.has_value()) {
+      lua_pushnil(L);
+      lua_pushlstring(L, result.error.data(), result.error.size());
+      return 2;
+    }
+    return push_result(L, *result.value);
+  }
+  else {
+    push_value(L, std::forward<R>(result));
+    return 1;
+  }
+}
+
+template<typename Ret, typename... Args>
+struct Signature
+{
+  template<typename F, size_t... I>
+  static int
+  call(lua_State* L, F& fn, std::index_sequence<I...>)
+  {
+    constexpr auto checked = (allocates<std::remove_cvref_t<Args>>() || ...);
+    if constexpr (checked) {
+      (check_arg<std::remove_cvref_t<Args>>(L, I + 1), ...);
+    }
+
+    if constexpr (std::is_void_v<Ret>) {
+      fn(get_arg<std::remove_cvref_t<Args>, checked>(L, I + 1)...);
+      return 0;
+    }
+    else {
+      return push_result(
+        L, fn(get_arg<std::remove_cvref_t<Args>, checked>(L, I + 1)...));
+    }
+  }
+
+  template<typename F>
+  static int
+  call(lua_State* L, F& fn)
+  {
+    return call(L, fn, std::index_sequence_for<Args...>{});
+  }
+};
+
+template<typename F>
+struct signature_of : signature_of<decltype(&F::operator())>
+{};
+
+template<typename R, typename... A>
+struct signature_of<R (*)(A...)>
+{
+  using type = Signature<R, A...>;
+};
+
+template<typename R, typename... A>
+struct signature_of<R (*)(A...) noexcept> : signature_of<R (*)(A...)>
+{};
+
+template<typename C, typename R, typename... A>
+struct signature_of<R (C::*)(A...)> : signature_of<R (*)(A...)>
+{};
+
+template<typename C, typename R, typename... A>
+struct signature_of<R (C::*)(A...) const> : signature_of<R (*)(A...)>
+{};
+
+template<typename C, typename R, typename... A>
+struct signature_of<R (C::*)(A...) noexcept> : signature_of<R (*)(A...)>
+{};
+
+template<typename C, typename R, typename... A>
+struct signature_of<R (C::*)(A...) const noexcept> : signature_of<R (*)(A...)>
+{};
+
+template<typename F>
+using signature_t = typename signature_of<std::decay_t<F>>::type;
+
+// Thunk of a callable without state, default constructed on each call.
+template<typename F>
+int
+stateless_thunk(lua_State* L)
+{
+  auto fn = F{};
+  return signature_t<F>::call(L, fn);
+}
+
+// Thunk of a callable stored in the userdata of its first upvalue.
+template<typename F>
+int
+closure_thunk(lua_State* L)
+{
+  auto& fn = *static_cast<F*>(lua_touserdata(L, lua_upvalueindex(1)));
+  return signature_t<F>::call(L, fn);
+}
+
+// Pushes `fn` as a Lua function. C functions are pushed as they are and
+// stateless lambdas need nothing but their thunk; anything else is moved
+// into a userdata owned by the closure.
+template<typename F>
+void
+push_function(lua_State* L, F&& fn)
+{
+  using T = std::decay_t<F>;
+
+  if constexpr (std::is_convertible_v<T, lua_CFunction>) {
+    lua_pushcfunction(L, static_cast<lua_CFunction>(fn));
+  }
+  else if constexpr (std::is_empty_v<T> &&
+                     std::is_default_constructible_v<T>) {
+    lua_pushcfunction(L, stateless_thunk<T>);
+  }
+  else {
+    static_assert(alignof(T) <= alignof(std::max_align_t));
+    new (lua_newuserdatauv(L, sizeof(T), 0)) T{ std::forward<F>(fn) };
+
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      lua_createtable(L, 0, 1);
+      lua_pushcfunction(L, [](lua_State* L) -> int {
+        static_cast<T*>(lua_touserdata(L, 1))->~T();
+        return 0;
+      });
+      lua_setfield(L, -2, "__gc");
+      lua_setmetatable(L, -2);
+    }
+    lua_pushcclosure(L, closure_thunk<T>, 1);
+  }
+}
+
+} // namespace details
+
+// lua_CFunction generated at compile time for a function or a lambda
+// without captures: arguments are checked and converted to the parameter
+// types, the result is pushed back. E.g.
+//
+//   luaL_Reg{ "exists", lua_function<exists> }
+//
+// Parameters can be numbers, booleans, strings, views, C strings,
+// containers and optionals of them. Results can be anything the call
+// functions take as arguments, optionals (nil when empty) and LuaResult.
+template<auto Fn>
+int
+lua_function(lua_State* L)
+{
+  auto fn = Fn;
+  return details::signature_t<decltype(Fn)>::call(L, fn);
+}
+
 class Lua
 {
 public:
@@ -58,6 +964,12 @@ public:
 private:
   lua_State* L;
 
+  // Registry keys of what snapshot saves.
+  static inline char snapshot_globals;
+  static inline char snapshot_top;
+  // Registry key of the set of coroutines of call_module_async.
+  static inline char async_threads;
+
   bool
   checkLua(int r)
   {
@@ -65,140 +977,131 @@ private:
       const auto errorMsg = std::string{ lua_tostring(L, -1) };
       lua_pop(L, 1);
 
-      dk_err("Lua: error {}", errorMsg);
-      return false;
-    }
-    return true;
-  }
-
-  template<typename Ret>
-  std::enable_if_t<details::is_map_v<Ret>, Ret>
-  get_return_value()
-  {
-    using Key = typename Ret::key_type;
-    using Val = typename Ret::mapped_type;
-
-    Ret map;
-    lua_pushnil(L);
-
-    while (lua_next(L, -2) != 0) {
-      if constexpr (std::is_integral_v<Key>) {
-        const auto key = luaL_checkinteger(L, -2);
-        map[key] = get_return_value<Val>();
-        lua_pop(L, 1);
-      }
-      else if constexpr (std::is_same_v<Key, std::string>) {
-        const auto key = std::string{ luaL_checkstring(L, -2) };
-        map[key] = get_return_value<Val>();
-        lua_pop(L, 1);
-      }
-      else {
-        dk_err("Lua: Wrong return type.");
-        exit(1);
-      }
+      dk_err("Lua: error {}", errorMsg);
+      return false;
     }
+    return true;
+  }
 
-    return map;
+  // Makes the table on top of the stack the module `name`, as require
+  // would, and pops it.
+  void
+  load_module(const std::string& name)
+  {
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+    lua_pushvalue(L, -2);
+    lua_setfield(L, -2, name.c_str());
+    lua_pop(L, 1);
+    lua_setglobal(L, name.c_str());
   }
 
-  template<typename Ret>
-  std::enable_if_t<details::is_iterable_v<Ret>, Ret>
-  get_return_value()
+  template<typename Ret, typename... Args>
+  std::optional<Ret>
+  call(Args&&... args)
   {
-    using Val = typename Ret::value_type;
+    static_assert(!details::holds_view<Ret>(),
+                  "Views need an anchored value, call with LuaRef and read "
+                  "them with LuaRef::get.");
 
-    Ret vec;
-    lua_pushnil(L);
+    (details::push_value(L, std::forward<Args>(args)), ...);
 
-    while (lua_next(L, -2) != 0) {
-      vec.push_back(get_return_value<Val>());
+    if (lua_pcall(L, sizeof...(Args), 1, 0) != LUA_OK) {
+      const auto errorMsg = std::string{ lua_tostring(L, -1) };
       lua_pop(L, 1);
+
+      dk_err("Lua: error {}", errorMsg);
+      return std::nullopt;
     }
 
-    return vec;
+    return result<Ret>();
   }
 
-  template<typename Ret>
-  std::enable_if_t<!details::is_map_v<Ret> && !details::is_iterable_v<Ret>, Ret>
-  get_return_value()
+  // Runs the function on top of the stack in a coroutine, see
+  // call_module_async.
+  template<typename Ret, typename OnYield, typename... Args>
+  std::optional<Ret>
+  call_async(OnYield& on_yield, Args&&... args)
   {
-    if constexpr (std::is_same_v<Ret, bool>) {
-      return static_cast<bool>(lua_toboolean(L, -1));
-    }
-    else if constexpr (std::is_integral_v<Ret>) {
-      return luaL_checkinteger(L, -1);
+    static_assert(!details::holds_view<Ret>(),
+                  "Views need an anchored value, call with LuaRef and read "
+                  "them with LuaRef::get.");
+
+    // The thread stays on the stack under the call, which anchors it.
+    auto* co = lua_newthread(L);
+    lua_insert(L, -2);
+    lua_xmove(L, co, 1);
+    (details::push_value(co, std::forward<Args>(args)), ...);
+    mark_async(true);
+
+    int nresults = 0;
+    auto status = lua_resume(co, L, sizeof...(Args), &nresults);
+    while (status == LUA_YIELD) {
+      const int nargs = on_yield(co, nresults);
+      if (nargs < 0) {
+        status = LUA_ERRRUN;
+        lua_pushstring(co, "coroutine abandoned");
+        break;
+      }
+      status = lua_resume(co, L, nargs, &nresults);
     }
-    else if constexpr (std::is_same_v<Ret, double> ||
-                       std::is_same_v<Ret, float>) {
-      return luaL_checknumber(L, -1);
+    mark_async(false);
+
+    if (status != LUA_OK) {
+      const auto errorMsg = std::string{ lua_tostring(co, -1) };
+      lua_pop(L, 1);
+
+      dk_err("Lua: error {}", errorMsg);
+      return std::nullopt;
     }
-    else if constexpr (std::is_same_v<Ret, std::string>) {
-      return std::string{ luaL_checkstring(L, -1) };
+
+    // Its first result, as a call adjusted to one result.
+    if (nresults == 0) {
+      lua_pushnil(co);
     }
     else {
-      dk_err("Lua: Return type not supported!");
-      exit(1);
+      lua_pop(co, nresults - 1);
     }
+    lua_xmove(co, L, 1);
+    lua_remove(L, -2);
+
+    return result<Ret>();
   }
 
-  template<typename Arg>
+  // Adds the thread on top of the stack to the async set, or removes it.
   void
-  push_arg(Arg arg)
+  mark_async(bool async)
   {
-    if constexpr (std::is_same_v<Arg, bool>) {
-      lua_pushboolean(L, arg);
-    }
-    else if constexpr (std::is_same_v<Arg, int>) {
-      lua_pushinteger(L, arg);
-    }
-    else if constexpr (std::is_same_v<Arg, double> ||
-                       std::is_same_v<Arg, float>) {
-      lua_pushnumber(L, arg);
-    }
-    else if constexpr (std::is_same_v<Arg, std::string>) {
-      lua_pushstring(L, arg.c_str());
-    }
-    else if constexpr (details::is_map_v<Arg>) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &async_threads) != LUA_TTABLE) {
+      lua_pop(L, 1);
       lua_newtable(L);
-      for (const auto& [key, value] : arg) {
-        lua_pushstring(L, key.c_str());
-        push_arg(value);
-        lua_settable(L, -3);
-      }
+      lua_pushvalue(L, -1);
+      lua_rawsetp(L, LUA_REGISTRYINDEX, &async_threads);
     }
-    else if constexpr (details::is_iterable_v<Arg>) {
-      lua_newtable(L);
-      int index = 1;
-      for (const auto& elem : arg) {
-        lua_pushinteger(L, index++);
-        push_arg(elem);
-        lua_settable(L, -3);
-      }
+    lua_pushvalue(L, -2);
+    if (async) {
+      lua_pushboolean(L, true);
     }
     else {
-      dk_err("Lua: Wrong argument type!");
-      exit(1);
+      lua_pushnil(L);
     }
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
   }
 
-  template<typename Ret, typename... Args>
+  // Converts the result on top of the stack and pops it.
+  template<typename Ret>
   std::optional<Ret>
-  call(Args... args)
+  result()
   {
-    (push_arg(args), ...);
-
-    if (lua_pcall(L, sizeof...(Args), 1, 0) != LUA_OK) {
-      const auto errorMsg = std::string{ lua_tostring(L, -1) };
+    if constexpr (std::is_same_v<Ret, LuaRef>) {
+      return LuaRef{ L };
+    }
+    else {
+      auto result = details::to_value<Ret>(L);
       lua_pop(L, 1);
 
-      dk_err("Lua: error {}", errorMsg);
-      return std::nullopt;
+      return result;
     }
-
-    auto result = get_return_value<Ret>();
-    lua_pop(L, 1);
-
-    return result;
   }
 
 public:
@@ -208,6 +1111,28 @@ public:
     luaL_openlibs(L);
   }
 
+  explicit Lua(const LuaConfig& config)
+  {
+    if (config.alloc == nullptr) {
+      L = luaL_newstate();
+    }
+    else {
+      L = lua_newstate(config.alloc, config.userdata);
+      lua_atpanic(L, [](lua_State* L) -> int {
+        dk_err("Lua: unprotected error {}", lua_tostring(L, -1));
+        return 0;
+      });
+    }
+    luaL_openlibs(L);
+
+    if (config.one_shot) {
+      lua_gc(L, LUA_GCSTOP);
+    }
+    else if (config.generational) {
+      lua_gc(L, LUA_GCGEN, 0, 0);
+    }
+  }
+
   explicit Lua(const char* script)
   {
     L = luaL_newstate();
@@ -260,6 +1185,126 @@ public:
     return *this;
   }
 
+  // Whether `L` is a coroutine of call_module_async, which a function bound
+  // in C may yield to hand something to on_yield.
+  static bool
+  is_async(lua_State* L)
+  {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &async_threads) != LUA_TTABLE) {
+      lua_pop(L, 1);
+      return false;
+    }
+    lua_pushthread(L);
+    lua_rawget(L, -2);
+    const bool async = lua_toboolean(L, -1) && lua_isyieldable(L);
+    lua_pop(L, 2);
+    return async;
+  }
+
+  // Runs a chunk of source or bytecode and leaves what it returns on the
+  // stack, as exec does, but keeps the state usable when it fails.
+  bool
+  load(std::string_view chunk, const std::string& name = "=chunk")
+  {
+    return checkLua(luaL_loadbufferx(
+             L, chunk.data(), chunk.size(), name.c_str(), nullptr)) &&
+           checkLua(lua_pcall(L, 0, LUA_MULTRET, 0));
+  }
+
+  // Bytecode of `source`, which loads faster than the source itself.
+  std::optional<std::string>
+  compile(std::string_view source, const std::string& name = "=chunk")
+  {
+    if (!checkLua(luaL_loadbufferx(
+          L, source.data(), source.size(), name.c_str(), "t"))) {
+      return std::nullopt;
+    }
+
+    auto bytecode = std::string{};
+    lua_dump(
+      L,
+      [](lua_State*, const void* data, size_t size, void* out) -> int {
+        static_cast<std::string*>(out)->append(static_cast<const char*>(data),
+                                               size);
+        return 0;
+      },
+      &bytecode,
+      0);
+    lua_pop(L, 1);
+    return bytecode;
+  }
+
+  // Remembers the globals and the stack for reset.
+  void
+  snapshot()
+  {
+    lua_createtable(L, 0, 64);
+    lua_pushglobaltable(L);
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, -5);
+    }
+    lua_pop(L, 1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &snapshot_globals);
+
+    lua_pushinteger(L, lua_gettop(L));
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &snapshot_top);
+  }
+
+  // Undoes what happened to the globals since snapshot: new globals are
+  // removed, replaced and removed ones restored. It is shallow, changes
+  // inside tables stay. The stack is cut back to its size at the snapshot.
+  // Without a snapshot there is nothing to go back to, it does nothing.
+  void
+  reset()
+  {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &snapshot_top) != LUA_TNUMBER) {
+      lua_pop(L, 1);
+      return;
+    }
+    const auto top = static_cast<int>(lua_tointeger(L, -1));
+    lua_settop(L, top);
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &snapshot_globals) != LUA_TTABLE) {
+      lua_pop(L, 1);
+      return;
+    }
+    const auto saved = lua_gettop(L);
+    lua_pushglobaltable(L);
+    const auto globals = lua_gettop(L);
+
+    // Existing fields may be changed while traversing.
+    lua_pushnil(L);
+    while (lua_next(L, globals) != 0) {
+      lua_pushvalue(L, -2);
+      lua_rawget(L, saved);
+      if (!lua_rawequal(L, -1, -2)) {
+        lua_pushvalue(L, -3);
+        lua_insert(L, -2);
+        lua_rawset(L, globals);
+        lua_pop(L, 1);
+      }
+      else {
+        lua_pop(L, 2);
+      }
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, saved) != 0) {
+      lua_pushvalue(L, -2);
+      if (lua_rawget(L, globals) == LUA_TNIL) {
+        lua_pushvalue(L, -3);
+        lua_pushvalue(L, -3);
+        lua_rawset(L, globals);
+      }
+      lua_pop(L, 2);
+    }
+
+    lua_settop(L, top);
+  }
+
   void
   exec(const std::string& script)
   {
@@ -287,9 +1332,9 @@ public:
 
   template<typename Arg>
   void
-  register_variable(const std::string& name, Arg arg)
+  register_variable(const std::string& name, Arg&& arg)
   {
-    push_arg(arg);
+    details::push_value(L, std::forward<Arg>(arg));
     lua_setglobal(L, name.c_str());
   }
 
@@ -299,28 +1344,62 @@ public:
     lua_register(L, name.c_str(), function);
   }
 
+  // Binds any callable, see lua_function.
+  template<typename F>
+  void
+  register_function(const std::string& name, F&& fn)
+  {
+    details::push_function(L, std::forward<F>(fn));
+    lua_setglobal(L, name.c_str());
+  }
+
   template<size_t Size>
   void
   register_module(const std::string& name,
                   const std::array<luaL_Reg, Size>& reg)
   {
-    static luaL_Reg arr[Size];
-    std::copy(reg.begin(), reg.end(), arr);
+    lua_createtable(L, 0, Size - 1);
+    luaL_setfuncs(L, reg.data(), 0);
+    load_module(name);
+  }
 
-    luaL_requiref(
-      L,
-      name.c_str(),
-      [](lua_State* L) -> int {
-        luaL_newlib(L, arr);
-        return 1;
-      },
-      1);
-    lua_pop(L, 1);
+  template<typename... Fns>
+  void
+  register_module(const std::string& name, LuaBinding<Fns>... bindings)
+  {
+    lua_createtable(L, 0, sizeof...(Fns));
+    ((details::push_function(L, std::move(bindings.fn)),
+      lua_setfield(L, -2, bindings.name)),
+     ...);
+    load_module(name);
   }
 
   template<typename Ret, typename... Args>
   std::optional<Ret>
-  call_module(const std::string& name, Args... args)
+  call_module(const std::string& name, Args&&... args)
+  {
+    lua_getfield(L, -1, name.c_str());
+
+    if (!lua_isfunction(L, -1)) {
+      lua_pop(L, 1);
+
+      dk_err("Lua: No member function: {}", name);
+      return std::nullopt;
+    }
+
+    return call<Ret>(std::forward<Args>(args)...);
+  }
+
+  // Calls `name` as call_module does, but in a coroutine, e.g. a generator
+  // yielding work to start while it goes on. Each time it yields,
+  // on_yield(co, nresults) gets the coroutine with the yielded values on
+  // top of its stack. It pops them, pushes what the yield returns in the
+  // coroutine and returns how many; -1 gives up and the call fails.
+  template<typename Ret, typename OnYield, typename... Args>
+  std::optional<Ret>
+  call_module_async(const std::string& name,
+                    OnYield&& on_yield,
+                    Args&&... args)
   {
     lua_getfield(L, -1, name.c_str());
 
@@ -331,12 +1410,34 @@ public:
       return std::nullopt;
     }
 
-    return call<Ret>(args...);
+    return call_async<Ret>(on_yield, std::forward<Args>(args)...);
+  }
+
+  // Calls `table.name`, e.g. a function of a registered module.
+  template<typename Ret, typename... Args>
+  std::optional<Ret>
+  call_field(const std::string& table,
+             const std::string& name,
+             Args&&... args)
+  {
+    if (lua_getglobal(L, table.c_str()) == LUA_TTABLE) {
+      lua_getfield(L, -1, name.c_str());
+      lua_remove(L, -2);
+    }
+
+    if (!lua_isfunction(L, -1)) {
+      lua_pop(L, 1);
+
+      dk_err("Lua: No function: {}.{}", table, name);
+      return std::nullopt;
+    }
+
+    return call<Ret>(std::forward<Args>(args)...);
   }
 
   template<typename Ret, typename... Args>
   std::optional<Ret>
-  call_global(const std::string& name, Args... args)
+  call_global(const std::string& name, Args&&... args)
   {
     lua_getglobal(L, name.c_str());
 
@@ -347,7 +1448,7 @@ public:
       return std::nullopt;
     }
 
-    return call<Ret>(args...);
+    return call<Ret>(std::forward<Args>(args)...);
   }
 };
 
@@ -356,6 +1457,17 @@ public:
 #ifndef DOCTEST_CONFIG_DISABLE
 #include <doctest/doctest.h>
 
+#include <deque>
+
+#include "alloc.hh"
+
+static int
+twice_c(lua_State* L)
+{
+  lua_pushinteger(L, 2 * luaL_checkinteger(L, 1));
+  return 1;
+}
+
 TEST_CASE("testing lua")
 {
   SUBCASE("square")
@@ -384,6 +1496,240 @@ TEST_CASE("testing lua")
     CHECK(!result.has_value());
   }
 
+  SUBCASE("field")
+  {
+    auto lua = devkit::Lua{ "util = { twice = function(n) return 2 * n end }" };
+
+    CHECK(lua.call_field<int>("util", "twice", 21) == 42);
+    CHECK(!lua.call_field<int>("util", "thrice", 21).has_value());
+    CHECK(!lua.call_field<int>("missing", "twice", 21).has_value());
+  }
+
+  SUBCASE("arguments")
+  {
+    auto lua = devkit::Lua{ R"(
+      function describe(name, count, ratio, list, map)
+        return ('%s %d %.1f %d %s'):format(name, count, ratio, #list, map.key)
+      end
+      )" };
+    const auto list = std::deque<std::string>{ "a", "b", "c" };
+    const auto map = std::unordered_map<std::string_view, int>{ { "key", 7 } };
+
+    CHECK(lua.call_global<std::string>(
+            "describe", "name", size_t{ 2 }, 0.5f, list, map) ==
+          "name 2 0.5 3 7");
+  }
+
+  SUBCASE("view")
+  {
+    auto lua = devkit::Lua{ R"(
+      function describe(list, map, nested)
+        local keys = {}
+        for k, v in pairs(map) do keys[#keys + 1] = k .. '=' .. v end
+        local count = 0
+        for i, v in ipairs(list) do count = count + i end
+        return ('%d %s %s %s %s %d %s %s %d'):format(
+          #list, list[2], tostring(list[9]), map.b, tostring(map.z), count,
+          table.concat(keys, ','), table.concat(list, '+'), nested.x[2])
+      end
+      function modify(list) list[1] = 'x' end
+      function count(map)
+        local n = 0
+        for _ in pairs(map) do n = n + 1 end
+        return n
+      end
+      )" };
+
+    const auto list = std::deque<std::string>{ "one", "two", "three" };
+    const auto map = devkit::Lua::map{ { "a", "1" }, { "b", "2" } };
+    const auto nested = std::map<std::string, std::vector<int>>{
+      { "x", { 10, 20 } }
+    };
+
+    CHECK(lua.call_global<std::string>("describe",
+                                       devkit::lua_view(list),
+                                       devkit::lua_view(map),
+                                       devkit::lua_view(nested)) ==
+          "3 two nil 2 nil 6 a=1,b=2 one+two+three 20");
+    CHECK(!lua.call_global<bool>("modify", devkit::lua_view(list)));
+    CHECK(list[0] == "one");
+
+    const auto options = std::unordered_map<int, bool>{ { 1, true } };
+    CHECK(lua.call_global<int>("count", devkit::lua_view(options)) == 1);
+  }
+
+  SUBCASE("ref")
+  {
+    auto lua = devkit::Lua{ R"(
+      function alias(args)
+        return { command = 'make ' .. table.concat(args, ' '), shell = 'true' }
+      end
+      function list() return { 'one', 'two', key = 'value' } end
+      )" };
+
+    auto ref = lua.call_global<devkit::LuaRef>(
+      "alias", std::vector<std::string>{ "-j", "8" });
+    REQUIRE(ref.has_value());
+    CHECK(ref->type() == LUA_TTABLE);
+
+    // The views point into the anchored table, a collection keeps them.
+    const auto map = ref->get<std::map<std::string_view, std::string_view>>();
+    lua.exec("collectgarbage()");
+    CHECK(map.at("command") == "make -j 8");
+    CHECK(map.at("shell") == "true");
+
+    // Only the sequence part is read into a vector.
+    auto seq = lua.call_global<devkit::LuaRef>("list");
+    REQUIRE(seq.has_value());
+    const auto items = seq->get<std::vector<std::string_view>>();
+    REQUIRE(items.size() == 2);
+    CHECK(items[1] == "two");
+
+    auto moved = std::move(*seq);
+    CHECK(seq->type() == LUA_TNIL);
+    CHECK(moved.get<std::vector<std::string>>().size() == 2);
+    auto* L = moved.push();
+    CHECK(lua_rawlen(L, -1) == 2);
+    lua_pop(L, 1);
+    CHECK(devkit::LuaRef{}.push() == nullptr);
+    CHECK(devkit::LuaRef{}.get<std::vector<int>>().empty());
+
+    // Numbers are converted on a copy, the keys stay usable by lua_next.
+    lua.exec("function numbers() return { 10, [2.5] = 8, jobs = 4 } end");
+    auto numbers = lua.call_global<devkit::LuaRef>("numbers");
+    REQUIRE(numbers.has_value());
+    const auto strings = numbers->get<std::map<std::string, std::string>>();
+    CHECK(strings.size() == 3);
+    CHECK(strings.at("1") == "10");
+    CHECK(strings.at("2.5") == "8");
+    CHECK(strings.at("jobs") == "4");
+    CHECK(numbers->type() == LUA_TTABLE);
+  }
+
+  SUBCASE("async")
+  {
+    auto lua = devkit::Lua{ R"(
+      local M = {}
+      M.sum = function(n)
+        local total = 0
+        for i = 1, n do total = total + coroutine.yield(i) end
+        return total, 'ignored'
+      end
+      M.stuck = function() coroutine.yield() end
+      return M
+      )" };
+
+    // Every yield gets back twice what it yielded.
+    auto yields = 0;
+    const auto twice = [&](lua_State* co, int nresults) {
+      CHECK(devkit::Lua::is_async(co));
+      yields += nresults;
+      const auto value = lua_tointeger(co, -1);
+      lua_pop(co, nresults);
+      lua_pushinteger(co, 2 * value);
+      return 1;
+    };
+    CHECK(lua.call_module_async<int>("sum", twice, 4) == 20);
+    CHECK(yields == 4);
+
+    const auto give_up = [](lua_State*, int) { return -1; };
+    CHECK(!lua.call_module_async<int>("stuck", give_up).has_value());
+    CHECK(lua.call_module<int>("sum", 0) == 0);
+  }
+
+  SUBCASE("bind")
+  {
+    auto lua = devkit::Lua{};
+    lua.register_function(
+      "add", [](int a, std::optional<int> b) { return a + b.value_or(1); });
+    lua.register_function(
+      "label", [prefix = std::string{ "item " }](std::string_view name) {
+        return prefix + std::string{ name };
+      });
+    lua.register_function("half", [](double n) -> devkit::LuaResult<double> {
+      if (n < 0) {
+        return devkit::LuaFailure{ "negative" };
+      }
+      return n / 2;
+    });
+    using Groups = std::map<std::string, std::vector<int>>;
+    lua.register_module(
+      "list",
+      devkit::lua_bind("size",
+                       [](const std::vector<std::string>& list) {
+                         return list.size();
+                       }),
+      devkit::lua_bind("first", [](const std::vector<std::string>& list) {
+        return list.empty() ? std::nullopt : std::optional{ list[0] };
+      }),
+      devkit::lua_bind("count", [](std::string label, const Groups& groups) {
+        return label + std::to_string(groups.size());
+      }));
+
+    constexpr auto twice = [](int n) { return 2 * n; };
+    constexpr auto one = std::array{ luaL_Reg{ "twice", twice_c },
+                                     luaL_Reg{ nullptr, nullptr } };
+    constexpr auto other = std::array{
+      luaL_Reg{ "twice", devkit::lua_function<twice> },
+      luaL_Reg{ nullptr, nullptr }
+    };
+    lua.register_module("one", one);
+    lua.register_module("other", other);
+
+    lua.exec(R"(
+      function check()
+        local value, err = half(-1)
+        local ok, msg = pcall(add, 'x')
+        local checked = msg:find('number expected') ~= nil
+        local _, nested = pcall(list.count, 'ok', { a = { 1, {} } })
+        local expected = '#2 .* %(integer expected in the table, got table%)'
+        checked = checked and nested:find(expected) ~= nil
+        return table.concat({ add(2), add(2, 3), label('a'), half(3),
+          tostring(value), err, tostring(ok), tostring(checked),
+          list.size({ 'a', 'b' }), list.first({ 'a' }),
+          list.count(',', { a = { 1 }, b = {} }),
+          tostring(list.first({})), one.twice(2), other.twice(3),
+          require('other').twice(4) }, ' ')
+      end
+      )");
+    CHECK(lua.call_global<std::string>("check") ==
+          "3 5 item a 1.5 nil negative false true 2 a ,2 nil 4 6 8");
+  }
+
+  SUBCASE("allocator")
+  {
+    auto arena = devkit::ArenaAllocator{};
+    {
+      auto lua = devkit::Lua{ { .alloc = devkit::ArenaAllocator::lua_alloc,
+                                .userdata = &arena,
+                                .one_shot = true } };
+      lua.exec(R"(
+        function build(n)
+          local t = {}
+          for i = 1, n do t[i] = ('item %d'):format(i) end
+          return #t
+        end
+        function running() return collectgarbage('isrunning') end
+        )");
+
+      CHECK(lua.call_global<int>("build", 1000) == 1000);
+      CHECK(lua.call_global<bool>("running") == false);
+      CHECK(arena.stats().allocations > 1000);
+      CHECK(arena.stats().in_use > 0);
+    }
+    CHECK(arena.stats().in_use == 0);
+
+    auto pool = devkit::PoolAllocator{};
+    {
+      auto lua = devkit::Lua{ { .alloc = devkit::PoolAllocator::lua_alloc,
+                                .userdata = &pool } };
+      lua.exec("function running() return collectgarbage('isrunning') end");
+      CHECK(lua.call_global<bool>("running") == true);
+    }
+    CHECK(pool.stats().in_use == 0);
+    CHECK(pool.stats().frees == pool.stats().allocations);
+  }
+
   SUBCASE("map")
   {
     auto lua = devkit::Lua{ R"(
@@ -453,3 +1799,149 @@ TEST_CASE("testing lua")
 }
 
 #endif
+
+#ifdef DK_BENCH_LUA
+#include "bench.hh"
+
+DK_BENCH_CASE("Lua::call_global number")
+{
+  auto lua = devkit::Lua{ "function square(n) return n * n end" };
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(lua.call_global<int>("square", 5));
+  }
+}
+
+DK_BENCH_CASE("Lua::call_global string vector")
+{
+  auto lua = devkit::Lua{ "function echo(list) return list end" };
+  const auto list = std::vector<std::string>{ "alpha", "beta",  "gamma",
+                                              "delta", "eps",   "zeta",
+                                              "eta",   "theta", "iota" };
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(
+      lua.call_global<std::vector<std::string>>("echo", list));
+  }
+}
+
+DK_BENCH_CASE("Lua::call_module map")
+{
+  auto lua = devkit::Lua{ R"(
+    local M = {}
+    M.alias = function(cwd, options)
+      return { command = 'make -C ' .. cwd, use_shell = options.shell }
+    end
+    return M
+    )" };
+  const auto options = devkit::Lua::map{
+    { "shell", "true" }, { "jobs", "8" }, { "type", "release" }
+  };
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(lua.call_module<devkit::Lua::map>(
+      "alias", std::string{ "/home/me/ws" }, options));
+  }
+}
+
+// The same function bound by hand and generated by lua_function, called
+// 1000 times per iteration from Lua.
+static int
+bench_label_hand(lua_State* L)
+{
+  size_t size = 0;
+  luaL_checklstring(L, 1, &size);
+  const auto count = luaL_checkinteger(L, 2);
+  const auto verbose = lua_toboolean(L, 3);
+
+  lua_pushinteger(L, static_cast<lua_Integer>(size) * count + verbose);
+  return 1;
+}
+
+static lua_Integer
+bench_label(std::string_view name,
+            lua_Integer count,
+            std::optional<bool> verbose)
+{
+  return static_cast<lua_Integer>(name.size()) * count + verbose.value_or(0);
+}
+
+static constexpr auto bench_loop = R"(
+  function loop(fn)
+    local sum = 0
+    for i = 1, 1000 do sum = sum + fn('name', i, true) end
+    return sum
+  end
+  )";
+
+DK_BENCH_CASE("Lua bound function by hand x1000")
+{
+  auto lua = devkit::Lua{ bench_loop };
+  lua.register_function("fn", bench_label_hand);
+  lua.exec("function run() return loop(fn) end");
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(lua.call_global<lua_Integer>("run"));
+  }
+}
+
+DK_BENCH_CASE("Lua bound function generated x1000")
+{
+  auto lua = devkit::Lua{ bench_loop };
+  lua.register_function("fn", devkit::lua_function<bench_label>);
+  lua.exec("function run() return loop(fn) end");
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(lua.call_global<lua_Integer>("run"));
+  }
+}
+
+DK_BENCH_CASE("Lua bound closure x1000")
+{
+  auto lua = devkit::Lua{ bench_loop };
+  lua.register_function(
+    "fn",
+    [offset = lua_Integer{ 0 }](
+      std::string_view name, lua_Integer count, std::optional<bool> verbose) {
+      return bench_label(name, count, verbose) + offset;
+    });
+  lua.exec("function run() return loop(fn) end");
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(lua.call_global<lua_Integer>("run"));
+  }
+}
+
+DK_BENCH_CASE("Lua::call_global arguments copied")
+{
+  auto lua = devkit::Lua{ "function first(list) return list[1] end" };
+  const auto list = std::vector<std::string>(64, "argument");
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(lua.call_global<std::string>("first", list));
+  }
+}
+
+DK_BENCH_CASE("Lua::call_global arguments viewed")
+{
+  auto lua = devkit::Lua{ "function first(list) return list[1] end" };
+  const auto list = std::vector<std::string>(64, "argument");
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(
+      lua.call_global<std::string>("first", devkit::lua_view(list)));
+  }
+}
+
+DK_BENCH_CASE("Lua::call_module LuaRef views")
+{
+  auto lua = devkit::Lua{ R"(
+    local M = {}
+    M.alias = function(cwd, options)
+      return { command = 'make -C ' .. cwd, use_shell = options.shell }
+    end
+    return M
+    )" };
+  const auto options = devkit::Lua::map{
+    { "shell", "true" }, { "jobs", "8" }, { "type", "release" }
+  };
+  for (auto _ : state) {
+    const auto ref = lua.call_module<devkit::LuaRef>(
+      "alias", std::string{ "/home/me/ws" }, options);
+    devkit::bench::do_not_optimize(
+      ref->get<std::map<std::string_view, std::string_view>>());
+  }
+}
+#endif
@@ -0,0 +1,481 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "lua.hh"
+
+namespace devkit
+{
+
+namespace details
+{
+
+struct ActorNode
+{
+  std::atomic<ActorNode*> next{ nullptr };
+};
+
+// Intrusive multi producer, single consumer queue (Vyukov): a push is one
+// exchange and one store, a pop touches no shared counter. Nodes are not
+// owned by the queue.
+class MpscQueue
+{
+private:
+  alignas(64) std::atomic<ActorNode*> head;
+  alignas(64) ActorNode* tail;
+  ActorNode stub;
+
+public:
+  MpscQueue()
+    : head{ &stub }
+    , tail{ &stub }
+  {}
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue&
+  operator=(const MpscQueue&) = delete;
+
+  void
+  push(ActorNode* node)
+  {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    auto* prev = head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Consumer only. Null when empty, or while the newest push is half way.
+  ActorNode*
+  pop()
+  {
+    auto* first = tail;
+    auto* next = first->next.load(std::memory_order_acquire);
+
+    if (first == &stub) {
+      if (next == nullptr) {
+        return nullptr;
+      }
+      tail = first = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr) {
+      tail = next;
+      return first;
+    }
+
+    if (first != head.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+
+    push(&stub);
+    next = first->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      tail = next;
+      return first;
+    }
+    return nullptr;
+  }
+
+  // Consumer only. A push half way counts as empty; the producer finishing
+  // it is the one to wake the consumer.
+  bool
+  empty() const
+  {
+    return tail == &stub &&
+           stub.next.load(std::memory_order_acquire) == nullptr;
+  }
+};
+
+// What a call argument is kept as until the actor runs the call, by which
+// time the caller's C strings and views may be gone: strings are copied.
+template<typename T>
+struct actor_arg
+{
+  using type = T;
+};
+
+template<>
+struct actor_arg<const char*>
+{
+  using type = std::string;
+};
+
+template<>
+struct actor_arg<char*>
+{
+  using type = std::string;
+};
+
+template<>
+struct actor_arg<std::string_view>
+{
+  using type = std::string;
+};
+
+template<typename T>
+using actor_arg_t = typename actor_arg<std::decay_t<T>>::type;
+
+// Whether every argument owns what it refers to once stored.
+template<typename... Args>
+constexpr bool actor_args_owned =
+  ((!is_lua_view<actor_arg_t<Args>>::value &&
+    !holds_view<actor_arg_t<Args>>()) &&
+   ...);
+
+} // namespace details
+
+struct LuaActorStats
+{
+  size_t requests = 0;
+  size_t batches = 0; // wakeups that found work
+};
+
+// One Lua state owned by a thread of its own, for state shared between
+// threads. Any thread submits calls and gets futures; the actor drains the
+// queue and runs everything it finds in one batch, and producers only pay
+// for a wakeup when it sleeps. Arguments are copied into the request, C
+// strings and string views as strings, so they need not outlive the call;
+// other views are rejected. Results must not refer to the state.
+class LuaActor
+{
+private:
+  struct Request : details::ActorNode
+  {
+    virtual ~Request() = default;
+
+    virtual void
+    run(Lua& lua) = 0;
+  };
+
+  template<typename F, typename R>
+  struct Task : Request
+  {
+    F fn;
+    std::promise<R> promise;
+
+    explicit Task(F&& fn)
+      : fn{ std::move(fn) }
+    {}
+
+    void
+    run(Lua& lua) override
+    {
+      if constexpr (std::is_void_v<R>) {
+        fn(lua);
+        promise.set_value();
+      }
+      else {
+        promise.set_value(fn(lua));
+      }
+    }
+  };
+
+  details::MpscQueue queue;
+  std::atomic<bool> sleeping{ false };
+  std::atomic<bool> stopping{ false };
+  std::atomic<size_t> requests{ 0 };
+  std::atomic<size_t> batches{ 0 };
+  std::thread worker;
+
+  // Pairs with the fence in run: either the actor sees the push or we see
+  // it going to sleep.
+  void
+  wake()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.exchange(false)) {
+      sleeping.notify_one();
+    }
+  }
+
+  // Runs requests until the queue is empty; returns how many ran. They are
+  // counted before they run, so whoever has a result sees them in stats.
+  size_t
+  drain(Lua& lua)
+  {
+    size_t count = 0;
+    while (auto* node = queue.pop()) {
+      if (count++ == 0) {
+        batches.fetch_add(1, std::memory_order_relaxed);
+      }
+      requests.fetch_add(1, std::memory_order_relaxed);
+
+      auto* request = static_cast<Request*>(node);
+      request->run(lua);
+      delete request;
+    }
+    return count;
+  }
+
+  void
+  run(std::function<void(Lua&)> init)
+  {
+    auto lua = Lua{};
+    if (init) {
+      init(lua);
+    }
+
+    for (;;) {
+      if (drain(lua) != 0) {
+        continue;
+      }
+
+      // Announce the sleep before the last look at the queue, so a push
+      // racing with it sees the flag and wakes us.
+      sleeping.store(true);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!queue.empty()) {
+        sleeping.store(false);
+        continue;
+      }
+      if (stopping.load()) {
+        return;
+      }
+      sleeping.wait(true);
+    }
+  }
+
+public:
+  // `init` runs on the actor thread, e.g. to load a script, before any
+  // request.
+  explicit LuaActor(std::function<void(Lua&)> init = {})
+    : worker{ [this, init = std::move(init)]() mutable {
+      run(std::move(init));
+    } }
+  {}
+
+  LuaActor(const LuaActor&) = delete;
+  LuaActor&
+  operator=(const LuaActor&) = delete;
+
+  // Runs what was submitted before stopping, so every future is ready.
+  ~LuaActor()
+  {
+    stopping.store(true);
+    sleeping.store(false);
+    sleeping.notify_one();
+    worker.join();
+  }
+
+  // Runs fn(lua) on the actor thread.
+  template<typename F>
+  auto
+  submit(F&& fn)
+  {
+    using R = std::invoke_result_t<std::decay_t<F>&, Lua&>;
+
+    auto* task = new Task<std::decay_t<F>, R>{ std::forward<F>(fn) };
+    auto future = task->promise.get_future();
+    queue.push(task);
+    wake();
+    return future;
+  }
+
+  template<typename Ret, typename... Args>
+  std::future<std::optional<Ret>>
+  call_global(std::string name, Args&&... args)
+  {
+    static_assert(!std::is_same_v<Ret, LuaRef>,
+                  "LuaRef is bound to the actor thread.");
+    static_assert(details::actor_args_owned<Args...>,
+                  "Views would outlive what they refer to, pass copies.");
+
+    return submit([name = std::move(name),
+                   args = std::tuple<details::actor_arg_t<Args>...>{
+                     std::forward<Args>(args)... }](Lua& lua) {
+      return std::apply(
+        [&](const auto&... args) {
+          return lua.call_global<Ret>(name, args...);
+        },
+        args);
+    });
+  }
+
+  template<typename Ret, typename... Args>
+  std::future<std::optional<Ret>>
+  call_module(std::string name, Args&&... args)
+  {
+    static_assert(!std::is_same_v<Ret, LuaRef>,
+                  "LuaRef is bound to the actor thread.");
+    static_assert(details::actor_args_owned<Args...>,
+                  "Views would outlive what they refer to, pass copies.");
+
+    return submit([name = std::move(name),
+                   args = std::tuple<details::actor_arg_t<Args>...>{
+                     std::forward<Args>(args)... }](Lua& lua) {
+      return std::apply(
+        [&](const auto&... args) {
+          return lua.call_module<Ret>(name, args...);
+        },
+        args);
+    });
+  }
+
+  LuaActorStats
+  stats() const
+  {
+    return { requests.load(std::memory_order_relaxed),
+             batches.load(std::memory_order_relaxed) };
+  }
+};
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+TEST_CASE("testing lua_actor")
+{
+  const auto init = [](devkit::Lua& lua) {
+    lua.load(R"(
+      count = 0
+      function bump(by) count = count + by return count end
+      local M = {}
+      M.total = function() return count end
+      return M
+      )");
+  };
+
+  SUBCASE("threads")
+  {
+    auto actor = devkit::LuaActor{ init };
+
+    auto results = std::vector<std::vector<int>>(4);
+    auto threads = std::vector<std::thread>{};
+    for (size_t t = 0; t < results.size(); ++t) {
+      threads.emplace_back([&, t] {
+        auto futures = std::vector<std::future<std::optional<int>>>{};
+        for (int i = 0; i < 500; ++i) {
+          futures.push_back(actor.call_global<int>("bump", 1));
+        }
+        for (auto& future : futures) {
+          results[t].push_back(future.get().value_or(-1));
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    // Every call ran exactly once, each thread's calls in order.
+    auto seen = std::set<int>{};
+    for (const auto& list : results) {
+      CHECK(std::is_sorted(list.begin(), list.end()));
+      seen.insert(list.begin(), list.end());
+    }
+    CHECK(seen.size() == 2000);
+    CHECK(*seen.begin() == 1);
+    CHECK(actor.call_module<int>("total").get() == 2000);
+  }
+
+  SUBCASE("batch")
+  {
+    auto actor = devkit::LuaActor{ init };
+
+    // Requests queued behind a busy actor run in its current batch.
+    auto release = std::atomic<bool>{ false };
+    auto blocker = actor.submit([&](devkit::Lua&) {
+      const auto before = actor.stats();
+      release.wait(false);
+      return before;
+    });
+    auto futures = std::vector<std::future<std::optional<int>>>{};
+    for (int i = 0; i < 100; ++i) {
+      futures.push_back(actor.call_global<int>("bump", 2));
+    }
+    release = true;
+    release.notify_one();
+
+    const auto before = blocker.get();
+    CHECK(futures.back().get() == 200);
+
+    const auto after = actor.stats();
+    CHECK(after.requests - before.requests == 100);
+    CHECK(after.batches == before.batches);
+  }
+
+  SUBCASE("strings")
+  {
+    auto actor = devkit::LuaActor{ [](devkit::Lua& lua) {
+      lua.exec("function join(a, b) return a .. b end");
+    } };
+
+    // The caller's buffer is gone before the actor runs the call.
+    auto release = std::atomic<bool>{ false };
+    actor.submit([&](devkit::Lua&) {
+      release.wait(false);
+      return 0;
+    });
+    auto future = std::future<std::optional<std::string>>{};
+    {
+      auto buffer = std::string{ "left" };
+      auto other = std::string{ "right" };
+      future = actor.call_global<std::string>(
+        "join", buffer.c_str(), std::string_view{ other });
+      buffer.assign(buffer.size(), 'x');
+      other.assign(other.size(), 'x');
+    }
+    release = true;
+    release.notify_one();
+    CHECK(future.get() == "leftright");
+  }
+
+  SUBCASE("shutdown")
+  {
+    auto future = std::future<std::string>{};
+    {
+      auto actor = devkit::LuaActor{};
+      future = actor.submit([](devkit::Lua& lua) {
+        lua.exec("answer = 'late'");
+        return std::string{ "done" };
+      });
+    }
+    CHECK(future.get() == "done");
+  }
+}
+#endif
+
+#ifdef DK_BENCH_LUA_ACTOR
+#include "bench.hh"
+
+DK_BENCH_CASE("LuaActor round trip")
+{
+  auto actor = devkit::LuaActor{ [](devkit::Lua& lua) {
+    lua.exec("function square(n) return n * n end");
+  } };
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(actor.call_global<int>("square", 5).get());
+  }
+}
+
+DK_BENCH_CASE("LuaActor 100 calls in flight")
+{
+  auto actor = devkit::LuaActor{ [](devkit::Lua& lua) {
+    lua.exec("function square(n) return n * n end");
+  } };
+  auto futures = std::vector<std::future<std::optional<int>>>{};
+  futures.reserve(100);
+  for (auto _ : state) {
+    futures.clear();
+    for (int i = 0; i < 100; ++i) {
+      futures.push_back(actor.call_global<int>("square", i));
+    }
+    for (auto& future : futures) {
+      devkit::bench::do_not_optimize(future.get());
+    }
+  }
+}
+#endif
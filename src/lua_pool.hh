@@ -0,0 +1,439 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "alloc.hh"
+#include "fmt.hh"
+#include "lua.hh"
+
+namespace devkit
+{
+
+struct LuaPoolConfig
+{
+  std::string script; // source or bytecode, run once per state
+  std::string name = "=pool";
+  size_t min_states = 1;
+  size_t max_states = std::max(1u, std::thread::hardware_concurrency());
+  // Idle states above min_states are closed after this long.
+  std::chrono::milliseconds idle_timeout = std::chrono::seconds{ 30 };
+  // Runs on every new state before the script, e.g. to register modules.
+  std::function<void(Lua&)> setup = {};
+};
+
+struct LuaPoolStats
+{
+  size_t states = 0; // open, leased or idle
+  size_t idle = 0;
+  size_t created = 0;
+  size_t closed = 0;
+  size_t waits = 0; // acquires that found the pool at max_states
+};
+
+// States loaded from the same script, leased to one thread at a time. The
+// script is compiled once and new states load its bytecode. Every lease
+// starts from the globals and the stack the script left: a returned state
+// is reset, see Lua::reset. The pool grows on demand up to max_states and
+// closes states idle for longer than idle_timeout down to min_states.
+class LuaPool
+{
+private:
+  struct Entry
+  {
+    // Declared first, the state must go away before its allocator.
+    PoolAllocator alloc;
+    Lua lua;
+    std::chrono::steady_clock::time_point last_used;
+
+    Entry()
+      : lua{ { .alloc = PoolAllocator::lua_alloc, .userdata = &alloc } }
+    {}
+  };
+
+public:
+  // A leased state, returned to its pool when the lease goes away. Empty
+  // when the pool could not provide one.
+  class Lease
+  {
+  private:
+    LuaPool* pool = nullptr;
+    std::unique_ptr<Entry> entry;
+
+  public:
+    Lease() = default;
+
+    Lease(LuaPool* pool, std::unique_ptr<Entry> entry)
+      : pool{ pool }
+      , entry{ std::move(entry) }
+    {}
+
+    Lease(Lease&&) = default;
+    Lease&
+    operator=(Lease&& other)
+    {
+      if (this != &other) {
+        release();
+        pool = other.pool;
+        entry = std::move(other.entry);
+      }
+      return *this;
+    }
+
+    ~Lease()
+    {
+      release();
+    }
+
+    void
+    release()
+    {
+      if (entry != nullptr) {
+        pool->release(std::move(entry));
+      }
+    }
+
+    explicit
+    operator bool() const
+    {
+      return entry != nullptr;
+    }
+
+    Lua&
+    operator*() const
+    {
+      return entry->lua;
+    }
+
+    Lua*
+    operator->() const
+    {
+      return &entry->lua;
+    }
+  };
+
+private:
+  LuaPoolConfig config;
+  std::string bytecode;
+  bool ok = false;
+
+  mutable std::mutex mutex;
+  std::condition_variable available;
+  std::deque<std::unique_ptr<Entry>> idle; // least recently used first
+  LuaPoolStats counters;
+
+  std::unique_ptr<Entry>
+  create()
+  {
+    auto entry = std::make_unique<Entry>();
+    if (config.setup) {
+      config.setup(entry->lua);
+    }
+    if (!entry->lua.load(bytecode, config.name)) {
+      return nullptr;
+    }
+    entry->lua.snapshot();
+    return entry;
+  }
+
+  // Takes the states to close out of the pool, the caller closes them
+  // without holding the lock.
+  std::vector<std::unique_ptr<Entry>>
+  expire(std::chrono::steady_clock::time_point now)
+  {
+    auto expired = std::vector<std::unique_ptr<Entry>>{};
+    while (!idle.empty() && counters.states > config.min_states &&
+           now - idle.front()->last_used >= config.idle_timeout) {
+      expired.push_back(std::move(idle.front()));
+      idle.pop_front();
+      counters.states -= 1;
+      counters.closed += 1;
+    }
+    return expired;
+  }
+
+  void
+  release(std::unique_ptr<Entry> entry)
+  {
+    entry->lua.reset();
+    entry->last_used = std::chrono::steady_clock::now();
+
+    auto expired = std::vector<std::unique_ptr<Entry>>{};
+    {
+      const auto lock = std::lock_guard{ mutex };
+      idle.push_back(std::move(entry));
+      expired = expire(idle.back()->last_used);
+    }
+    available.notify_one();
+  }
+
+public:
+  explicit LuaPool(LuaPoolConfig config)
+    : config{ std::move(config) }
+  {
+    this->config.max_states =
+      std::max(this->config.max_states, this->config.min_states);
+
+    if (this->config.script.starts_with(LUA_SIGNATURE)) {
+      bytecode = this->config.script;
+    }
+    else {
+      auto compiled = Lua{}.compile(this->config.script, this->config.name);
+      if (!compiled.has_value()) {
+        dk_err("LuaPool: Cannot compile the script.");
+        return;
+      }
+      bytecode = std::move(*compiled);
+    }
+
+    for (size_t i = 0; i < std::max<size_t>(this->config.min_states, 1); ++i) {
+      auto entry = create();
+      if (entry == nullptr) {
+        dk_err("LuaPool: Cannot load the script.");
+        idle.clear();
+        return;
+      }
+      entry->last_used = std::chrono::steady_clock::now();
+      idle.push_back(std::move(entry));
+    }
+    counters.states = counters.created = idle.size();
+    ok = true;
+  }
+
+  LuaPool(const LuaPool&) = delete;
+  LuaPool&
+  operator=(const LuaPool&) = delete;
+
+  // Leases must not outlive the pool.
+  ~LuaPool() = default;
+
+  bool
+  valid() const
+  {
+    return ok;
+  }
+
+  // An idle state, a new one while below max_states, otherwise waits for
+  // one to be returned.
+  Lease
+  acquire()
+  {
+    if (!ok) {
+      return {};
+    }
+
+    auto lock = std::unique_lock{ mutex };
+    auto waited = false;
+    for (;;) {
+      if (!idle.empty()) {
+        auto entry = std::move(idle.back());
+        idle.pop_back();
+        return { this, std::move(entry) };
+      }
+
+      if (counters.states < config.max_states) {
+        counters.states += 1;
+        lock.unlock();
+
+        auto entry = create();
+        lock.lock();
+        if (entry == nullptr) {
+          counters.states -= 1;
+          available.notify_one();
+          return {};
+        }
+        counters.created += 1;
+        return { this, std::move(entry) };
+      }
+
+      if (!waited) {
+        counters.waits += 1;
+        waited = true;
+      }
+      available.wait(lock);
+    }
+  }
+
+  // An idle state, or an empty lease instead of creating or waiting.
+  Lease
+  try_acquire()
+  {
+    const auto lock = std::lock_guard{ mutex };
+    if (!ok || idle.empty()) {
+      return {};
+    }
+    auto entry = std::move(idle.back());
+    idle.pop_back();
+    return { this, std::move(entry) };
+  }
+
+  // Closes the states idle for too long now, instead of at the next return.
+  void
+  trim()
+  {
+    auto expired = std::vector<std::unique_ptr<Entry>>{};
+    const auto lock = std::lock_guard{ mutex };
+    expired = expire(std::chrono::steady_clock::now());
+  }
+
+  LuaPoolStats
+  stats() const
+  {
+    const auto lock = std::lock_guard{ mutex };
+    auto stats = counters;
+    stats.idle = idle.size();
+    return stats;
+  }
+};
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <atomic>
+
+TEST_CASE("testing lua_pool")
+{
+  constexpr auto script = R"(
+    counter = 0
+    local M = {}
+    M.rule = function(request)
+      counter = counter + 1
+      leaked = request
+      return ('%s %d %s'):format(request, counter, prefix or '-')
+    end
+    return M
+    )";
+
+  SUBCASE("reset")
+  {
+    auto pool = devkit::LuaPool{ { .script = script,
+                                   .min_states = 1,
+                                   .max_states = 1,
+                                   .setup = [](devkit::Lua& lua) {
+                                     lua.register_variable("prefix", "dk");
+                                   } } };
+    REQUIRE(pool.valid());
+
+    for (int i = 0; i < 3; ++i) {
+      auto lease = pool.acquire();
+      REQUIRE(lease);
+      CHECK(lease->call_module<std::string>("rule", "a") == "a 1 dk");
+      lease->exec("prefix = nil print = nil");
+    }
+
+    auto lease = pool.acquire();
+    lease->exec("assert(leaked == nil and print ~= nil and prefix == 'dk')");
+    CHECK(lease->call_module<std::string>("rule", "b") == "b 1 dk");
+
+    // Without a snapshot the module stays on the stack.
+    auto lua = devkit::Lua{ script };
+    lua.reset();
+    CHECK(lua.call_module<std::string>("rule", "c") == "c 1 -");
+  }
+
+  SUBCASE("grow and shrink")
+  {
+    auto pool = devkit::LuaPool{ { .script = script,
+                                   .min_states = 1,
+                                   .max_states = 2,
+                                   .idle_timeout = std::chrono::hours{ 1 } } };
+    REQUIRE(pool.valid());
+    {
+      auto first = pool.acquire();
+      auto second = pool.acquire();
+      CHECK(first);
+      CHECK(second);
+      CHECK(!pool.try_acquire());
+      CHECK(pool.stats().states == 2);
+    }
+    CHECK(pool.stats().idle == 2);
+
+    auto quick = devkit::LuaPool{ { .script = script,
+                                    .min_states = 1,
+                                    .max_states = 3,
+                                    .idle_timeout = {} } };
+    {
+      auto a = quick.acquire();
+      auto b = quick.acquire();
+      auto c = quick.acquire();
+    }
+    CHECK(quick.stats().states == 1);
+    CHECK(quick.stats().created == 3);
+    CHECK(quick.stats().closed == 2);
+  }
+
+  SUBCASE("threads")
+  {
+    auto pool = devkit::LuaPool{ { .script = script, .max_states = 3 } };
+    auto failures = std::atomic<int>{ 0 };
+
+    auto threads = std::vector<std::thread>{};
+    for (int t = 0; t < 6; ++t) {
+      threads.emplace_back([&, t] {
+        const auto request = std::to_string(t);
+        for (int i = 0; i < 200; ++i) {
+          auto lease = pool.acquire();
+          if (lease->call_module<std::string>("rule", request) !=
+              request + " 1 -") {
+            failures += 1;
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    CHECK(failures == 0);
+    CHECK(pool.stats().states <= 3);
+  }
+
+  SUBCASE("invalid")
+  {
+    auto pool = devkit::LuaPool{ { .script = "return (" } };
+    CHECK(!pool.valid());
+    CHECK(!pool.acquire());
+  }
+}
+#endif
+
+#ifdef DK_BENCH_LUA_POOL
+#include "bench.hh"
+
+static constexpr auto bench_rules = R"(
+  local M = {}
+  for i = 1, 50 do
+    M['rule' .. i] = function(request) return request .. i end
+  end
+  M.rule = function(request) return request:upper() end
+  return M
+  )";
+
+DK_BENCH_CASE("LuaPool lease and call")
+{
+  auto pool = devkit::LuaPool{ { .script = bench_rules, .max_states = 1 } };
+  for (auto _ : state) {
+    auto lease = pool.acquire();
+    devkit::bench::do_not_optimize(
+      lease->call_module<std::string>("rule", "request"));
+  }
+}
+
+DK_BENCH_CASE("Lua new state and call")
+{
+  for (auto _ : state) {
+    auto lua = devkit::Lua{ bench_rules };
+    devkit::bench::do_not_optimize(
+      lua.call_module<std::string>("rule", "request"));
+  }
+}
+#endif
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace devkit
+{
+
+// Read only, private mapping of a whole file. Empty files are valid and map
+// to an empty view; files that cannot be opened or are not regular are not.
+class MappedFile
+{
+private:
+  void* data = nullptr;
+  size_t size = 0;
+  bool ok = false;
+
+public:
+  explicit MappedFile(const std::string& path)
+  {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      if (st.st_size == 0) {
+        ok = true;
+      }
+      else {
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+          madvise(addr, st.st_size, MADV_SEQUENTIAL);
+          data = addr;
+          size = st.st_size;
+          ok = true;
+        }
+      }
+    }
+
+    close(fd);
+  }
+
+  ~MappedFile()
+  {
+    if (data != nullptr) {
+      munmap(data, size);
+    }
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile&
+  operator=(const MappedFile&) = delete;
+
+  bool
+  valid() const
+  {
+    return ok;
+  }
+
+  std::string_view
+  view() const
+  {
+    return { static_cast<const char*>(data), size };
+  }
+};
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <cstdio>
+#include <filesystem>
+
+TEST_CASE("testing mmap")
+{
+  const auto path =
+    (std::filesystem::temp_directory_path() / "devkit_mmap_test.txt").string();
+
+  SUBCASE("content")
+  {
+    auto* file = std::fopen(path.c_str(), "w");
+    std::fputs("hello\nworld\n", file);
+    std::fclose(file);
+
+    auto mapped = devkit::MappedFile{ path };
+    CHECK(mapped.valid());
+    CHECK(mapped.view() == "hello\nworld\n");
+
+    std::remove(path.c_str());
+  }
+
+  SUBCASE("empty")
+  {
+    std::fclose(std::fopen(path.c_str(), "w"));
+
+    auto mapped = devkit::MappedFile{ path };
+    CHECK(mapped.valid());
+    CHECK(mapped.view().empty());
+
+    std::remove(path.c_str());
+  }
+
+  SUBCASE("missing")
+  {
+    auto mapped = devkit::MappedFile{ "mmap_test_missing.txt" };
+    CHECK(!mapped.valid());
+    CHECK(mapped.view().empty());
+  }
+}
+#endif
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace devkit
+{
+
+static size_t
+default_jobs()
+{
+  const auto n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : n;
+}
+
+// Run fn(i) for every i in [0, count) on up to `jobs` threads. Work is handed
+// out one index at a time, so a few large items do not stall a whole worker.
+template<typename Fn>
+void
+parallel_for(size_t count, size_t jobs, Fn&& fn)
+{
+  if (jobs == 0) {
+    jobs = default_jobs();
+  }
+  jobs = std::min(jobs, count);
+
+  if (jobs <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      fn(i);
+    }
+    return;
+  }
+
+  auto next = std::atomic<size_t>{ 0 };
+  const auto worker = [&]() {
+    for (auto i = next.fetch_add(1); i < count; i = next.fetch_add(1)) {
+      fn(i);
+    }
+  };
+
+  auto threads = std::vector<std::thread>{};
+  threads.reserve(jobs - 1);
+  for (size_t t = 1; t < jobs; ++t) {
+    threads.emplace_back(worker);
+  }
+  worker();
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+TEST_CASE("testing parallel")
+{
+  SUBCASE("every index once")
+  {
+    auto hits = std::vector<std::atomic<int>>(1000);
+    devkit::parallel_for(hits.size(), 4, [&](size_t i) {
+      hits[i] += 1;
+    });
+
+    CHECK(std::all_of(hits.begin(), hits.end(), [](const auto& hit) {
+      return hit == 1;
+    }));
+  }
+
+  SUBCASE("single job")
+  {
+    auto order = std::vector<size_t>{};
+    devkit::parallel_for(3, 1, [&](size_t i) {
+      order.push_back(i);
+    });
+
+    CHECK(order == std::vector<size_t>{ 0, 1, 2 });
+  }
+
+  SUBCASE("no work")
+  {
+    int calls = 0;
+    devkit::parallel_for(0, 0, [&](size_t) {
+      calls += 1;
+    });
+    CHECK(calls == 0);
+  }
+}
+#endif
@@ -0,0 +1,495 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "fmt.hh"
+
+namespace devkit
+{
+
+struct Root
+{
+  std::string path;
+  std::string marker;
+};
+
+struct PathParts
+{
+  std::string_view dir; // up to and including the last separator
+  std::string_view name;
+  std::string_view ext; // from the last dot of the file name on
+};
+
+// The helpers below work on string_views and write into a caller owned
+// buffer, so batches of paths can be processed without a std::filesystem
+// round trip or an allocation per path.
+
+static PathParts
+split_path(std::string_view path)
+{
+  const auto sep = path.find_last_of("/\\");
+  const auto dir = path.substr(0, sep == std::string_view::npos ? 0 : sep + 1);
+  const auto base = path.substr(dir.size());
+
+  const auto dot = base.rfind('.');
+  if (dot == std::string_view::npos) {
+    return { dir, base, {} };
+  }
+  return { dir, base.substr(0, dot), base.substr(dot) };
+}
+
+// Append `part` to `out` like std::filesystem::path::operator/, expanding a
+// leading '~' to `home` when one is given.
+static void
+append_path(std::string& out, std::string_view part, std::string_view home = {})
+{
+  const bool tilde = !part.empty() && part[0] == '~' && !home.empty();
+  const auto head = tilde ? home : part;
+
+  if (!head.empty() && head[0] == '/') {
+    out.clear();
+  }
+  else if (!out.empty() && out.back() != '/') {
+    out += '/';
+  }
+
+  if (tilde) {
+    out += home;
+    out += part.substr(1);
+  }
+  else {
+    out += part;
+  }
+}
+
+// Lexical normalization, as std::filesystem::path::lexically_normal.
+static void
+normalize_path(std::string& out, std::string_view path)
+{
+  out.clear();
+  if (path.empty()) {
+    return;
+  }
+
+  const bool absolute = path[0] == '/';
+  const size_t root = absolute ? 1 : 0;
+  if (absolute) {
+    out += '/';
+  }
+
+  // start of the last component in `out`, or npos when there is none
+  auto last = std::string_view::npos;
+  bool trailing = false;
+
+  for (size_t pos = 0; pos < path.size();) {
+    auto end = path.find('/', pos);
+    if (end == std::string_view::npos) {
+      end = path.size();
+    }
+    const auto part = path.substr(pos, end - pos);
+    pos = end + 1;
+
+    if (part.empty()) {
+      continue;
+    }
+    if (part == ".") {
+      trailing = true;
+      continue;
+    }
+
+    if (part == "..") {
+      if (last != std::string_view::npos &&
+          std::string_view{ out }.substr(last) != "..") {
+        // drop the last component together with its separator
+        out.resize(last > root ? last - 1 : root);
+        const auto prev = out.rfind('/');
+        if (out.size() == root) {
+          last = std::string_view::npos;
+        }
+        else if (prev == std::string_view::npos || prev < root) {
+          last = root;
+        }
+        else {
+          last = prev + 1;
+        }
+        trailing = true;
+        continue;
+      }
+      if (absolute) {
+        trailing = false;
+        continue;
+      }
+    }
+
+    if (out.size() > root) {
+      out += '/';
+    }
+    last = out.size();
+    out += part;
+    trailing = false;
+  }
+
+  if (path.back() == '/' && last != std::string_view::npos &&
+      std::string_view{ out }.substr(last) != "..") {
+    trailing = true;
+  }
+
+  if (out.empty()) {
+    out = ".";
+  }
+  else if (trailing && out.size() > root &&
+           std::string_view{ out }.substr(last) != "..") {
+    out += '/';
+  }
+}
+
+// `path` relative to `base`, both normalized first and trailing separators
+// ignored. Empty when one is absolute and the other is not, or when `base`
+// climbs above where `path` starts.
+static void
+relative_path(std::string& out,
+              std::string_view path,
+              std::string_view base,
+              std::string& scratch)
+{
+  const auto normalize = [](std::string& s, std::string_view p) {
+    normalize_path(s, p);
+    while (s.size() > 1 && s.back() == '/') {
+      s.pop_back();
+    }
+  };
+  normalize(out, path);
+  normalize(scratch, base);
+
+  if (out.empty() || scratch.empty() ||
+      (out[0] == '/') != (scratch[0] == '/')) {
+    out.clear();
+    return;
+  }
+
+  const auto next = [](std::string_view s, size_t& pos) -> std::string_view {
+    while (pos < s.size() && s[pos] == '/') {
+      pos += 1;
+    }
+    const auto begin = pos;
+    while (pos < s.size() && s[pos] != '/') {
+      pos += 1;
+    }
+    const auto part = s.substr(begin, pos - begin);
+    return part == "." ? std::string_view{} : part;
+  };
+
+  size_t p = 0;
+  size_t b = 0;
+  auto p_part = next(out, p);
+  auto b_part = next(scratch, b);
+  while (!p_part.empty() && p_part == b_part) {
+    p_part = next(out, p);
+    b_part = next(scratch, b);
+  }
+
+  int ups = 0;
+  for (; !b_part.empty(); b_part = next(scratch, b)) {
+    if (b_part == "..") {
+      out.clear();
+      return;
+    }
+    ups += 1;
+  }
+
+  // keep the unmatched tail of `path` and put the climbs in front of it
+  const auto rest = p_part.empty() ? out.size() : p - p_part.size();
+  scratch.clear();
+  for (int i = 0; i < ups; ++i) {
+    scratch += i == 0 ? ".." : "/..";
+  }
+  if (!scratch.empty() && rest < out.size()) {
+    scratch += '/';
+  }
+  out.replace(0, rest, scratch);
+
+  if (out.empty()) {
+    out = ".";
+  }
+}
+
+// Entries of the directory named by `prefix` whose names start with the rest
+// of it, as shell completions: each one is `prefix` completed, directories
+// end in '/'. The directory is read once and entry types come from readdir,
+// only symlinks and file systems without d_type cost a stat. At most `limit`
+// entries are returned (0 for no limit), the first ones in sorted order; at
+// most twice as many are held while reading, so huge directories stay cheap.
+// Hidden entries only match a prefix starting with '.'.
+static std::vector<std::string>
+complete_path(std::string_view prefix,
+              bool dirs_only,
+              size_t limit = 0,
+              std::string_view home = {})
+{
+  const auto parts = split_path(prefix);
+  const auto dir = parts.dir;
+  const auto name = prefix.substr(dir.size());
+
+  auto path = std::string{};
+  append_path(path, dir.empty() ? "." : dir, home);
+
+  auto* handle = opendir(path.c_str());
+  if (handle == nullptr) {
+    return {};
+  }
+
+  auto result = std::vector<std::string>{};
+  while (const auto* entry = readdir(handle)) {
+    const auto entry_name = std::string_view{ entry->d_name };
+    if (entry_name == "." || entry_name == ".." ||
+        !entry_name.starts_with(name) ||
+        (entry_name[0] == '.' && (name.empty() || name[0] != '.'))) {
+      continue;
+    }
+
+    auto is_dir = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+      struct stat st;
+      is_dir = fstatat(dirfd(handle), entry->d_name, &st, 0) == 0 &&
+               S_ISDIR(st.st_mode);
+    }
+    if (dirs_only && !is_dir) {
+      continue;
+    }
+
+    auto& completion = result.emplace_back(dir);
+    completion += entry_name;
+    if (is_dir) {
+      completion += '/';
+    }
+
+    if (limit != 0 && result.size() >= limit * 2) {
+      std::nth_element(result.begin(), result.begin() + limit, result.end());
+      result.resize(limit);
+    }
+  }
+  closedir(handle);
+
+  if (limit != 0 && result.size() > limit) {
+    std::partial_sort(result.begin(), result.begin() + limit, result.end());
+    result.resize(limit);
+  }
+  else {
+    std::sort(result.begin(), result.end());
+  }
+  return result;
+}
+
+// Walk up from `start` to the nearest directory containing any of `markers`.
+// Each level is opened once and probed with faccessat relative to that
+// descriptor.
+static std::optional<Root>
+find_root(const std::filesystem::path& start,
+          const std::vector<std::string>& markers)
+{
+  char resolved[PATH_MAX];
+  if (markers.empty() || realpath(start.c_str(), resolved) == nullptr) {
+    return std::nullopt;
+  }
+  const auto begin = std::filesystem::path{ resolved };
+
+  int fd = open(resolved, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return std::nullopt;
+  }
+
+  auto found = std::optional<Root>{};
+
+  for (auto dir = begin;; dir = dir.parent_path()) {
+    for (const auto& marker : markers) {
+      if (faccessat(fd, marker.c_str(), F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+        found = Root{ dir.string(), marker };
+        break;
+      }
+    }
+
+    if (found.has_value() || dir == dir.parent_path()) {
+      break;
+    }
+
+    const int parent = openat(fd, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    close(fd);
+    fd = parent;
+    if (fd < 0) {
+      break;
+    }
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  return found;
+}
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <fstream>
+
+TEST_CASE("testing path")
+{
+  namespace fs = std::filesystem;
+
+  const auto root = fs::temp_directory_path() / "devkit_path_test";
+  fs::remove_all(root);
+  fs::create_directories(root / "ws/src/pkg/src/nested");
+  fs::create_directories(root / "ws/.git");
+  std::ofstream{ root / "ws/src/pkg/package.xml" } << "<package/>";
+
+  const auto start = root / "ws/src/pkg/src/nested";
+
+  SUBCASE("split")
+  {
+    const auto parts = devkit::split_path("/opt/ros/setup.bash");
+    CHECK(parts.dir == "/opt/ros/");
+    CHECK(parts.name == "setup");
+    CHECK(parts.ext == ".bash");
+
+    CHECK(devkit::split_path("archive.tar.gz").name == "archive.tar");
+    CHECK(devkit::split_path("archive.tar.gz").ext == ".gz");
+    CHECK(devkit::split_path("dir/.bashrc").name == "");
+    CHECK(devkit::split_path("dir/.bashrc").ext == ".bashrc");
+    CHECK(devkit::split_path("dir.d/file").ext == "");
+    CHECK(devkit::split_path("dir/").dir == "dir/");
+    CHECK(devkit::split_path("dir/").name == "");
+  }
+
+  SUBCASE("join")
+  {
+    auto out = std::string{};
+    devkit::append_path(out, "a");
+    devkit::append_path(out, "b/");
+    devkit::append_path(out, "c");
+    CHECK(out == "a/b/c");
+
+    devkit::append_path(out, "/abs");
+    CHECK(out == "/abs");
+
+    out.clear();
+    devkit::append_path(out, "~/.devkit", "/home/me");
+    devkit::append_path(out, "apps");
+    CHECK(out == "/home/me/.devkit/apps");
+  }
+
+  SUBCASE("normalize")
+  {
+    auto out = std::string{};
+    for (const auto* path : { "", ".", "..", "/..", "a/./b/../c/", "a/..",
+                              "a/b/..", "../../a", "a//b/.", "/a/b/../../.." }) {
+      devkit::normalize_path(out, path);
+      CHECK(out == fs::path{ path }.lexically_normal().string());
+    }
+  }
+
+  SUBCASE("complete")
+  {
+    fs::create_directories(root / "complete/dir_a");
+    fs::create_directories(root / "complete/.hidden");
+    std::ofstream{ root / "complete/data.txt" } << "";
+    std::ofstream{ root / "complete/dir_b" } << "";
+    fs::create_directory_symlink(root / "complete/dir_a",
+                                 root / "complete/dir_link");
+
+    const auto base = (root / "complete").string() + "/";
+    using list = std::vector<std::string>;
+
+    CHECK(devkit::complete_path(base + "d", false) ==
+          list{ base + "data.txt", base + "dir_a/", base + "dir_b",
+                base + "dir_link/" });
+    CHECK(devkit::complete_path(base + "di", true) ==
+          list{ base + "dir_a/", base + "dir_link/" });
+    CHECK(devkit::complete_path(base + ".", true) == list{ base + ".hidden/" });
+    CHECK(devkit::complete_path(base + "x", false).empty());
+    CHECK(devkit::complete_path(base + "d", false, 2) ==
+          list{ base + "data.txt", base + "dir_a/" });
+    CHECK(devkit::complete_path(base + "d", false, 1) ==
+          list{ base + "data.txt" });
+    CHECK(devkit::complete_path(base + "nope/", false).empty());
+
+    const auto home = root.string();
+    CHECK(devkit::complete_path("~/complete/da", false, 0, home) ==
+          list{ "~/complete/data.txt" });
+  }
+
+  SUBCASE("relative")
+  {
+    auto out = std::string{};
+    auto scratch = std::string{};
+
+    devkit::relative_path(out, "/a/b/c", "/a/d", scratch);
+    CHECK(out == "../b/c");
+    devkit::relative_path(out, "/a/b/", "/a/b", scratch);
+    CHECK(out == ".");
+    devkit::relative_path(out, "a", "a/b/c", scratch);
+    CHECK(out == "../..");
+    devkit::relative_path(out, "a/x/../b", "a", scratch);
+    CHECK(out == "b");
+    devkit::relative_path(out, "/a", "a", scratch);
+    CHECK(out == "");
+    devkit::relative_path(out, "a", "../b", scratch);
+    CHECK(out == "");
+  }
+
+  SUBCASE("find root")
+  {
+    const auto pkg = devkit::find_root(start, { "package.xml", ".git" });
+    REQUIRE(pkg.has_value());
+    CHECK(pkg->path == (root / "ws/src/pkg").string());
+    CHECK(pkg->marker == "package.xml");
+
+    const auto git = devkit::find_root(start, { ".git" });
+    REQUIRE(git.has_value());
+    CHECK(git->path == (root / "ws").string());
+
+    CHECK(!devkit::find_root(start, { "no_such_marker" }).has_value());
+    CHECK(!devkit::find_root(root / "missing", { ".git" }).has_value());
+  }
+
+  fs::remove_all(root);
+}
+#endif
+
+#ifdef DK_BENCH_PATH
+#include "bench.hh"
+
+DK_BENCH_CASE("find_root")
+{
+  namespace fs = std::filesystem;
+
+  // The markers aliases look for, with the root eight levels up.
+  const auto root = fs::temp_directory_path() / "devkit_path_bench";
+  const auto start = root / "ws/src/a/b/c/d/e/f/g";
+  const auto markers =
+    std::vector<std::string>{ "meson.build", "package.xml", "CMakeLists.txt",
+                              ".git" };
+
+  auto ec = std::error_code{};
+  fs::create_directories(start, ec);
+  fs::create_directories(root / "ws/.git", ec);
+
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(devkit::find_root(start, markers));
+  }
+
+  fs::remove_all(root, ec);
+}
+#endif
@@ -0,0 +1,428 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "trace.hh"
+
+extern char** environ;
+
+namespace devkit
+{
+
+struct ProcessOptions
+{
+  std::string cwd = {};    // empty keeps the current directory
+  bool quiet = false;      // stdout and stderr go to /dev/null
+  bool search_path = true; // look the program up in PATH
+};
+
+namespace details
+{
+
+static int
+pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+  static_cast<void>(pid);
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+} // namespace details
+
+// A child started with posix_spawn, which does not copy the page tables of
+// the parent as fork does. Its pidfd becomes readable when it exits, see
+// ProcessLoop. Exit codes follow the shell: the status the child exited
+// with, or 128 plus the signal that killed it. A child still running when
+// its Process goes away is waited for, so none is left a zombie.
+class Process
+{
+private:
+  pid_t id = -1;
+  int descriptor = -1;
+  int code = -1;
+  int64_t begin = 0;
+  std::string name;
+
+  void
+  reaped(int status)
+  {
+    code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (descriptor >= 0) {
+      // Closing the pidfd also takes it out of any epoll set.
+      close(descriptor);
+      descriptor = -1;
+    }
+
+    if (auto* trace = Trace::instance()) {
+      trace->record(name, "process", begin, Trace::now(), id);
+    }
+  }
+
+public:
+  explicit Process(const std::vector<std::string>& argv,
+                   const ProcessOptions& options = {})
+  {
+    if (argv.empty()) {
+      return;
+    }
+
+    auto args = std::vector<char*>{};
+    args.reserve(argv.size() + 1);
+    for (const auto& arg : argv) {
+      args.push_back(const_cast<char*>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (!options.cwd.empty()) {
+      posix_spawn_file_actions_addchdir_np(&actions, options.cwd.c_str());
+    }
+    if (options.quiet) {
+      posix_spawn_file_actions_addopen(
+        &actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+      posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    }
+
+    if (Trace::instance() != nullptr) {
+      begin = Trace::now();
+      for (const auto& arg : argv) {
+        name += name.empty() ? "" : " ";
+        name += arg;
+      }
+    }
+    const auto error =
+      options.search_path
+        ? posix_spawnp(&id, args[0], &actions, nullptr, args.data(), environ)
+        : posix_spawn(&id, args[0], &actions, nullptr, args.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0) {
+      id = -1;
+      return;
+    }
+
+    // Not reaped yet, so the pid still names our child. -1 on kernels
+    // without pidfds, see ProcessLoop.
+    descriptor = details::pidfd_open(id);
+  }
+
+  ~Process()
+  {
+    wait();
+  }
+
+  Process(const Process&) = delete;
+  Process&
+  operator=(const Process&) = delete;
+
+  bool
+  valid() const
+  {
+    return id > 0;
+  }
+
+  pid_t
+  pid() const
+  {
+    return id;
+  }
+
+  // The pidfd, -1 when there is none or the child was reaped.
+  int
+  fd() const
+  {
+    return descriptor;
+  }
+
+  bool
+  running() const
+  {
+    return valid() && code < 0;
+  }
+
+  // -1 while running, and for a child that could not be started.
+  int
+  exit_code() const
+  {
+    return code;
+  }
+
+  // Reaps the child if it exited, without blocking. True once it is done.
+  bool
+  poll()
+  {
+    if (!running()) {
+      return true;
+    }
+
+    int status = 0;
+    const auto r = waitpid(id, &status, WNOHANG);
+    if (r == id) {
+      reaped(status);
+    }
+    else if (r < 0 && errno != EINTR) {
+      reaped(W_EXITCODE(255, 0));
+    }
+    return !running();
+  }
+
+  int
+  wait()
+  {
+    while (running()) {
+      int status = 0;
+      const auto r = waitpid(id, &status, 0);
+      if (r == id) {
+        reaped(status);
+      }
+      else if (r < 0 && errno != EINTR) {
+        reaped(W_EXITCODE(255, 0));
+      }
+    }
+    return code;
+  }
+};
+
+// Waits for many children at once, with their pidfds in one epoll set.
+// Children without a pidfd are polled every 10ms instead.
+class ProcessLoop
+{
+private:
+  struct Watch
+  {
+    Process* process;
+    bool polled;
+  };
+
+  int epoll = -1;
+  std::vector<Watch> watched;
+
+public:
+  ProcessLoop() = default;
+
+  ~ProcessLoop()
+  {
+    if (epoll >= 0) {
+      close(epoll);
+    }
+  }
+
+  ProcessLoop(const ProcessLoop&) = delete;
+  ProcessLoop&
+  operator=(const ProcessLoop&) = delete;
+
+  // `process` must stay alive until run_once returns it or it is
+  // unwatched.
+  void
+  watch(Process& process)
+  {
+    if (!process.running()) {
+      return;
+    }
+
+    if (epoll < 0) {
+      epoll = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    auto event = epoll_event{ .events = EPOLLIN, .data = { .ptr = &process } };
+    const auto polled =
+      process.fd() < 0 || epoll < 0 ||
+      epoll_ctl(epoll, EPOLL_CTL_ADD, process.fd(), &event) != 0;
+    watched.push_back({ &process, polled });
+  }
+
+  void
+  unwatch(Process& process)
+  {
+    const auto it =
+      std::find_if(watched.begin(), watched.end(), [&](const Watch& watch) {
+        return watch.process == &process;
+      });
+    if (it == watched.end()) {
+      return;
+    }
+
+    if (!it->polled && process.fd() >= 0) {
+      epoll_ctl(epoll, EPOLL_CTL_DEL, process.fd(), nullptr);
+    }
+    watched.erase(it);
+  }
+
+  // Watched children that were not reaped yet.
+  size_t
+  pending() const
+  {
+    return watched.size();
+  }
+
+  // Blocks until a watched child exits, or for `timeout` milliseconds when
+  // not negative, then reaps every child that exited and stops watching
+  // it. Returns them, in no particular order.
+  std::vector<Process*>
+  run_once(int timeout = -1)
+  {
+    auto done = std::vector<Process*>{};
+    if (watched.empty()) {
+      return done;
+    }
+
+    const auto polled = static_cast<size_t>(
+      std::count_if(watched.begin(), watched.end(), [](const Watch& watch) {
+        return watch.polled;
+      }));
+    if (polled > 0 && (timeout < 0 || timeout > 10)) {
+      timeout = 10;
+    }
+
+    // With nothing in the epoll set, only sleep until the next poll.
+    auto events = std::array<epoll_event, 64>{};
+    const auto ready =
+      polled == watched.size()
+        ? ::poll(nullptr, 0, timeout)
+        : epoll_wait(epoll, events.data(), events.size(), timeout);
+
+    for (int i = 0; i < ready; ++i) {
+      auto* process = static_cast<Process*>(events[i].data.ptr);
+      if (process->poll()) {
+        done.push_back(process);
+      }
+    }
+    for (const auto& watch : watched) {
+      if (watch.polled && watch.process->poll()) {
+        done.push_back(watch.process);
+      }
+    }
+
+    std::erase_if(watched, [](const Watch& watch) {
+      return !watch.process->running();
+    });
+    return done;
+  }
+};
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <chrono>
+#include <memory>
+
+TEST_CASE("testing process")
+{
+  SUBCASE("exit codes")
+  {
+    CHECK(devkit::Process{ { "true" } }.wait() == 0);
+    CHECK(devkit::Process{ { "sh", "-c", "exit 3" } }.wait() == 3);
+    CHECK(devkit::Process{ { "sh", "-c", "kill -9 $$" } }.wait() == 137);
+
+    auto missing = devkit::Process{ { "devkit-process-test-missing" } };
+    CHECK(!missing.valid());
+    CHECK(!missing.running());
+    CHECK(missing.wait() == -1);
+  }
+
+  SUBCASE("options")
+  {
+    auto process = devkit::Process{ { "sh", "-c", "[ \"$(pwd)\" = / ]" },
+                                    { .cwd = "/", .quiet = true } };
+    CHECK(process.valid());
+    CHECK(process.wait() == 0);
+    CHECK(process.fd() == -1);
+
+    CHECK(!devkit::Process{ { "true" }, { .search_path = false } }.valid());
+  }
+
+  SUBCASE("loop")
+  {
+    const auto begin = std::chrono::steady_clock::now();
+
+    auto loop = devkit::ProcessLoop{};
+    auto sleepers = std::vector<std::unique_ptr<devkit::Process>>{};
+    for (int i = 0; i < 8; ++i) {
+      sleepers.push_back(std::make_unique<devkit::Process>(
+        std::vector<std::string>{ "sleep", "0.2" }));
+      loop.watch(*sleepers.back());
+    }
+    auto quick = devkit::Process{ { "sh", "-c", "exit 5" } };
+    loop.watch(quick);
+    CHECK(loop.pending() == 9);
+
+    auto first = loop.run_once();
+    REQUIRE(!first.empty());
+    CHECK(first.front() == &quick);
+    CHECK(quick.exit_code() == 5);
+
+    auto reaped = first.size();
+    while (loop.pending() > 0) {
+      reaped += loop.run_once().size();
+    }
+    CHECK(reaped == 9);
+    for (const auto& sleeper : sleepers) {
+      CHECK(sleeper->exit_code() == 0);
+    }
+
+    // One after the other would take 1.6s.
+    CHECK(std::chrono::steady_clock::now() - begin < std::chrono::seconds{ 1 });
+    CHECK(loop.run_once().empty());
+  }
+}
+#endif
+
+#ifdef DK_BENCH_PROCESS
+#include "bench.hh"
+
+#include <memory>
+
+DK_BENCH_CASE("Process spawn and wait")
+{
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(devkit::Process{ { "true" } }.wait());
+  }
+}
+
+DK_BENCH_CASE("fork exec and wait")
+{
+  for (auto _ : state) {
+    const auto pid = fork();
+    if (pid == 0) {
+      execlp("true", "true", nullptr);
+      _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    devkit::bench::do_not_optimize(status);
+  }
+}
+
+DK_BENCH_CASE("ProcessLoop 16 children")
+{
+  for (auto _ : state) {
+    auto loop = devkit::ProcessLoop{};
+    auto children = std::vector<std::unique_ptr<devkit::Process>>{};
+    for (int i = 0; i < 16; ++i) {
+      children.push_back(std::make_unique<devkit::Process>(
+        std::vector<std::string>{ "true" }));
+      loop.watch(*children.back());
+    }
+    while (loop.pending() > 0) {
+      devkit::bench::do_not_optimize(loop.run_once());
+    }
+  }
+}
+#endif
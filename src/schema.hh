@@ -0,0 +1,511 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "args.hh"
+#include "fmt.hh"
+
+namespace devkit
+{
+
+enum class ValueKind
+{
+  flag,
+  string,
+  integer,
+  file,
+  dir,
+  choice,
+};
+
+struct CommandSpec
+{
+  std::string_view name;
+  std::string_view description;
+};
+
+struct OptionSpec
+{
+  std::string_view short_name; // one character, or empty
+  std::string_view long_name;
+  ValueKind kind = ValueKind::flag;
+  std::string_view description;
+  std::string_view choices = {}; // "debug|release" for ValueKind::choice
+};
+
+namespace details
+{
+
+// Reached only from constant evaluation, where it turns a bad schema into a
+// compile error naming the problem.
+inline void
+schema_error(const char*)
+{}
+
+constexpr uint32_t
+schema_hash(std::string_view name, uint32_t seed)
+{
+  uint32_t h = 2166136261u ^ seed;
+  for (const auto c : name) {
+    h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+  }
+  return h ^ (h >> 15);
+}
+
+constexpr std::string_view
+value_type_name(ValueKind kind)
+{
+  switch (kind) {
+    case ValueKind::string:
+      return "string";
+    case ValueKind::integer:
+      return "int";
+    case ValueKind::file:
+      return "file";
+    case ValueKind::dir:
+      return "dir";
+    case ValueKind::choice:
+      return "choice";
+    default:
+      return "";
+  }
+}
+
+template<size_t N>
+struct FixedString
+{
+  char data[N] = {};
+
+  constexpr FixedString(const char (&str)[N])
+  {
+    std::copy_n(str, N, data);
+  }
+
+  constexpr std::string_view
+  view() const
+  {
+    return { data, N - 1 };
+  }
+};
+
+} // namespace details
+
+// Commands and options of a tool, declared at compile time:
+//
+//   constexpr auto schema = devkit::Schema{
+//     "Usage: tool [options]",
+//     std::array{ devkit::CommandSpec{ "build", "Build things" } },
+//     std::array{ devkit::OptionSpec{ "j", "jobs", ValueKind::integer,
+//                                     "Parallel jobs" } },
+//   };
+//
+// Option names are placed in a perfect hash table while compiling, so
+// `find` costs one hash and one comparison. The same declaration feeds
+// Args::document, the help text and the completion list.
+template<size_t Commands, size_t Options>
+class Schema
+{
+public:
+  static constexpr size_t npos = SIZE_MAX;
+
+  std::string_view usage;
+  std::array<CommandSpec, Commands> commands;
+  std::array<OptionSpec, Options> options;
+
+private:
+  static constexpr size_t table_size =
+    std::bit_ceil(std::max<size_t>(4 * Options, 2));
+  static constexpr uint16_t empty_slot = UINT16_MAX;
+
+  uint32_t seed = 0;
+  std::array<uint16_t, table_size> table = {};
+
+  constexpr bool
+  matches(size_t index, std::string_view name) const
+  {
+    return options[index].long_name == name ||
+           (!options[index].short_name.empty() &&
+            options[index].short_name == name);
+  }
+
+  constexpr bool
+  try_seed(uint32_t candidate)
+  {
+    table.fill(empty_slot);
+    for (size_t i = 0; i < Options; ++i) {
+      for (const auto name : { options[i].long_name, options[i].short_name }) {
+        if (name.empty()) {
+          continue;
+        }
+        auto& slot = table[details::schema_hash(name, candidate) &
+                           (table_size - 1)];
+        if (slot != empty_slot) {
+          return false;
+        }
+        slot = static_cast<uint16_t>(i);
+      }
+    }
+    seed = candidate;
+    return true;
+  }
+
+public:
+  consteval Schema(std::string_view usage,
+                   std::array<CommandSpec, Commands> commands,
+                   std::array<OptionSpec, Options> options)
+    : usage{ usage }
+    , commands{ commands }
+    , options{ options }
+  {
+    for (size_t i = 0; i < Options; ++i) {
+      const auto& option = options[i];
+      if (option.long_name.empty() || option.short_name.size() > 1) {
+        details::schema_error("options need a long and at most a one "
+                              "character short name");
+      }
+      if ((option.kind == ValueKind::choice) == option.choices.empty()) {
+        details::schema_error("choices are required for, and only for, "
+                              "ValueKind::choice");
+      }
+      for (size_t j = 0; j < i; ++j) {
+        if (matches(j, option.long_name) ||
+            (!option.short_name.empty() && matches(j, option.short_name))) {
+          details::schema_error("option names must be unique");
+        }
+      }
+    }
+
+    for (uint32_t candidate = 0;; ++candidate) {
+      if (try_seed(candidate)) {
+        break;
+      }
+      if (candidate == 1 << 16) {
+        details::schema_error("no perfect hash found");
+      }
+    }
+  }
+
+  // Index of the option with the short or long name `name`, or npos.
+  constexpr size_t
+  find(std::string_view name) const
+  {
+    if (Options == 0 || name.empty()) {
+      return npos;
+    }
+    const auto slot =
+      table[details::schema_hash(name, seed) & (table_size - 1)];
+    return slot != empty_slot && matches(slot, name) ? slot : npos;
+  }
+
+  // Help text in the layout Args::document parses.
+  std::string
+  help() const
+  {
+    const auto option_head = [](const OptionSpec& option) {
+      auto head = option.short_name.empty()
+                    ? std::string{}
+                    : dk_fmt("-{}, ", option.short_name);
+      head += dk_fmt("--{}", option.long_name);
+      if (option.kind != ValueKind::flag) {
+        head += dk_fmt(" <{}>", value_type(option));
+      }
+      return head;
+    };
+
+    size_t width = 0;
+    for (const auto& command : commands) {
+      width = std::max(width, command.name.size());
+    }
+    for (const auto& option : options) {
+      width = std::max(width, option_head(option).size());
+    }
+
+    auto out = dk_fmt("{}\n", usage);
+    if (Commands > 0) {
+      out += "\nCommands:\n";
+      for (const auto& command : commands) {
+        out += dk_fmt(
+          "  {:<{}}  {}\n", command.name, width, command.description);
+      }
+    }
+    if (Options > 0) {
+      out += "\nOptions:\n";
+      for (const auto& option : options) {
+        out += dk_fmt("  {:<{}}  {}\n",
+                      option_head(option),
+                      width,
+                      description(option));
+      }
+    }
+    return out;
+  }
+
+  static constexpr std::string_view
+  value_type(const OptionSpec& option)
+  {
+    return details::value_type_name(option.kind);
+  }
+
+  // Description as shown in help and completions; choices are listed.
+  static std::string
+  description(const OptionSpec& option)
+  {
+    if (option.kind == ValueKind::choice) {
+      return dk_fmt("{} [{}]", option.description, option.choices);
+    }
+    return std::string{ option.description };
+  }
+
+  // Every command and option with its description, in declaration order.
+  std::vector<std::pair<std::string, std::string>>
+  completions() const
+  {
+    auto list = std::vector<std::pair<std::string, std::string>>{};
+    for (const auto& command : commands) {
+      list.emplace_back(command.name, command.description);
+    }
+    for (const auto& option : options) {
+      list.emplace_back(dk_fmt("--{}", option.long_name), description(option));
+      if (!option.short_name.empty()) {
+        list.emplace_back(dk_fmt("-{}", option.short_name),
+                          description(option));
+      }
+    }
+    return list;
+  }
+
+  // Report options on the command line that the schema does not declare.
+  bool
+  validate(const details::Options& parsed) const
+  {
+    bool ok = true;
+    for (const auto& [name, value] : parsed.to_map()) {
+      if (find(name) == npos) {
+        dk_err("Args: Unknown option {}!", name);
+        ok = false;
+      }
+    }
+    return ok;
+  }
+};
+
+// Typed access to parsed options through a schema with static storage:
+//
+//   const auto values = devkit::SchemaValues<schema>{ args.options };
+//   const std::optional<int64_t> jobs = values.get<"jobs">();
+//
+// Names are resolved while compiling; unknown names do not compile. Flags
+// read as bool, integers as int64_t, files and dirs as paths, choices as
+// the index of the choice or, given an enum type, as that enum.
+template<const auto& S>
+class SchemaValues
+{
+private:
+  const details::Options& parsed;
+
+  template<details::FixedString Name>
+  static constexpr size_t
+  index()
+  {
+    constexpr auto i = S.find(Name.view());
+    static_assert(i != S.npos, "option is not declared in the schema");
+    return i;
+  }
+
+  std::optional<std::string_view>
+  raw(const OptionSpec& option) const
+  {
+    if (const auto value = parsed[option.long_name]->value) {
+      return value;
+    }
+    if (!option.short_name.empty()) {
+      return parsed[option.short_name]->value;
+    }
+    return std::nullopt;
+  }
+
+public:
+  explicit SchemaValues(const details::Options& parsed)
+    : parsed{ parsed }
+  {}
+
+  template<details::FixedString Name, typename Enum = size_t>
+  auto
+  get() const
+  {
+    constexpr auto& option = S.options[index<Name>()];
+    const auto value = raw(option);
+
+    if constexpr (option.kind == ValueKind::flag) {
+      return value == "true";
+    }
+    else if constexpr (option.kind == ValueKind::integer) {
+      auto number = int64_t{};
+      if (!value.has_value()) {
+        return std::optional<int64_t>{};
+      }
+      const auto* end = value->data() + value->size();
+      if (std::from_chars(value->data(), end, number).ptr != end) {
+        dk_err("Args: --{} expects an integer, got \"{}\"!",
+               option.long_name,
+               *value);
+        return std::optional<int64_t>{};
+      }
+      return std::optional<int64_t>{ number };
+    }
+    else if constexpr (option.kind == ValueKind::file ||
+                       option.kind == ValueKind::dir) {
+      return value.has_value()
+               ? std::optional<std::filesystem::path>{ *value }
+               : std::nullopt;
+    }
+    else if constexpr (option.kind == ValueKind::choice) {
+      if (!value.has_value()) {
+        return std::optional<Enum>{};
+      }
+      auto choices = option.choices;
+      for (size_t i = 0;; ++i) {
+        const auto bar = choices.find('|');
+        if (choices.substr(0, bar) == *value) {
+          return std::optional<Enum>{ static_cast<Enum>(i) };
+        }
+        if (bar == std::string_view::npos) {
+          break;
+        }
+        choices.remove_prefix(bar + 1);
+      }
+      dk_err("Args: --{} expects one of {}, got \"{}\"!",
+             option.long_name,
+             option.choices,
+             *value);
+      return std::optional<Enum>{};
+    }
+    else {
+      return value;
+    }
+  }
+};
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+namespace
+{
+
+enum class BuildType
+{
+  debug,
+  release,
+};
+
+using devkit::ValueKind;
+
+constexpr auto test_schema = devkit::Schema{
+  "Usage: tool <command> [options]",
+  std::array{ devkit::CommandSpec{ "build", "Build things" },
+              devkit::CommandSpec{ "clean", "Remove build files" } },
+  std::array{
+    devkit::OptionSpec{ "v", "verbose", ValueKind::flag, "Verbose output" },
+    devkit::OptionSpec{ "j", "jobs", ValueKind::integer, "Parallel jobs" },
+    devkit::OptionSpec{ "o", "output", ValueKind::file, "Output file" },
+    devkit::OptionSpec{ "", "store", ValueKind::dir, "Store path" },
+    devkit::OptionSpec{ "n", "name", ValueKind::string, "Name" },
+    devkit::OptionSpec{
+      "b", "build", ValueKind::choice, "Build type", "debug|release" },
+  },
+};
+
+static_assert(test_schema.find("jobs") == 1);
+static_assert(test_schema.find("j") == 1);
+static_assert(test_schema.find("store") == 3);
+static_assert(test_schema.find("missing") == test_schema.npos);
+static_assert(test_schema.find("") == test_schema.npos);
+
+} // namespace
+
+TEST_CASE("testing schema")
+{
+  SUBCASE("lookup")
+  {
+    for (size_t i = 0; i < test_schema.options.size(); ++i) {
+      const auto& option = test_schema.options[i];
+      CHECK(test_schema.find(option.long_name) == i);
+      if (!option.short_name.empty()) {
+        CHECK(test_schema.find(option.short_name) == i);
+      }
+    }
+    CHECK(test_schema.find("verbos") == test_schema.npos);
+    CHECK(test_schema.find("x") == test_schema.npos);
+  }
+
+  SUBCASE("values")
+  {
+    auto argv = std::array{ "tool", "build", "-v",  "-j",      "8", "--output",
+                            "a.o",  "-b",    "release", "--store=/tmp" };
+    auto args = devkit::ArgsView(argv.size(), argv.data());
+    const auto values = devkit::SchemaValues<test_schema>{ args.options };
+
+    CHECK(values.get<"verbose">());
+    CHECK(values.get<"jobs">() == 8);
+    CHECK(values.get<"output">() == std::filesystem::path{ "a.o" });
+    CHECK(values.get<"store">() == std::filesystem::path{ "/tmp" });
+    CHECK(!values.get<"name">().has_value());
+    CHECK(values.get<"build">() == 1);
+    CHECK(values.get<"build", BuildType>() == BuildType::release);
+    CHECK(test_schema.validate(args.options));
+  }
+
+  SUBCASE("invalid values")
+  {
+    auto argv = std::array{ "tool", "-j", "many", "--build=fast", "--extra" };
+    auto args = devkit::Args(argv.size(), argv.data());
+    const auto values = devkit::SchemaValues<test_schema>{ args.options };
+
+    CHECK(!values.get<"jobs">().has_value());
+    CHECK(!values.get<"build">().has_value());
+    CHECK(!values.get<"verbose">());
+    CHECK(!test_schema.validate(args.options));
+  }
+
+  SUBCASE("document")
+  {
+    auto argv = std::array{ "tool", "-j", "4" };
+    auto from_schema = devkit::Args(argv.size(), argv.data());
+    auto from_help = devkit::Args(argv.size(), argv.data());
+    from_schema.document(test_schema);
+    from_help.document(test_schema.help());
+
+    CHECK(from_schema.options["jobs"] == from_schema.options["j"]);
+    CHECK(from_schema.options["jobs"]->value == "4");
+    CHECK(from_schema.options["build"]->description ==
+          "Build type [debug|release]");
+    CHECK(from_schema.options["store"]->value_type == "dir");
+
+    for (const auto* prefix : { "", "-", "--", "--j", "b", "c" }) {
+      auto lhs = from_schema.complete(prefix);
+      auto rhs = from_help.complete(prefix);
+      std::sort(lhs.begin(), lhs.end());
+      std::sort(rhs.begin(), rhs.end());
+      CHECK(lhs == rhs);
+    }
+
+    auto all = test_schema.completions();
+    auto documented = from_schema.complete("");
+    std::sort(all.begin(), all.end());
+    std::sort(documented.begin(), documented.end());
+    CHECK(all == std::vector(documented.begin(), documented.end()));
+  }
+}
+#endif
@@ -0,0 +1,388 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <linux/fs.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "fmt.hh"
+#include "mmap.hh"
+#include "parallel.hh"
+
+namespace devkit
+{
+
+struct SyncOptions
+{
+  bool checksum = false; // compare contents instead of size and mtime
+  bool force = false;    // copy even if the destination looks unchanged
+  size_t jobs = 0;       // 0 uses every core
+};
+
+struct SyncStats
+{
+  size_t copied = 0;
+  size_t skipped = 0;
+  size_t failed = 0;
+  size_t bytes = 0;
+};
+
+namespace details
+{
+
+static bool
+same_content(const std::string& a, const std::string& b)
+{
+  const auto lhs = MappedFile{ a };
+  const auto rhs = MappedFile{ b };
+  return lhs.valid() && rhs.valid() && lhs.view() == rhs.view();
+}
+
+static std::string
+read_link(const std::string& path, size_t size)
+{
+  auto target = std::string(size + 1, '\0');
+  const auto n = readlink(path.c_str(), target.data(), target.size());
+  target.resize(n < 0 ? 0 : n);
+  return target;
+}
+
+static bool
+up_to_date(const std::string& from,
+           const struct stat& src,
+           const std::string& to,
+           bool checksum)
+{
+  struct stat dst;
+  if (lstat(to.c_str(), &dst) != 0 ||
+      (dst.st_mode & S_IFMT) != (src.st_mode & S_IFMT) ||
+      dst.st_size != src.st_size) {
+    return false;
+  }
+
+  if (S_ISLNK(src.st_mode)) {
+    return read_link(from, src.st_size) == read_link(to, dst.st_size);
+  }
+
+  if (checksum) {
+    return same_content(from, to);
+  }
+
+  return dst.st_mtim.tv_sec == src.st_mtim.tv_sec &&
+         dst.st_mtim.tv_nsec == src.st_mtim.tv_nsec;
+}
+
+// Move the bytes without bouncing them through user space when the kernel
+// can: share extents (FICLONE) on reflink capable filesystems, else
+// copy_file_range, else a plain read/write loop.
+static bool
+copy_data(int in, int out, size_t size)
+{
+  if (ioctl(out, FICLONE, in) == 0) {
+    return true;
+  }
+
+  size_t copied = 0;
+  while (copied < size) {
+    const auto n =
+      copy_file_range(in, nullptr, out, nullptr, size - copied, 0);
+    if (n < 0 && copied == 0 &&
+        (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+         errno == EOPNOTSUPP)) {
+      break;
+    }
+    if (n <= 0) {
+      return n == 0;
+    }
+    copied += n;
+  }
+
+  if (copied == size) {
+    return true;
+  }
+
+  char buffer[1 << 16];
+  for (;;) {
+    const auto n = read(in, buffer, sizeof(buffer));
+    if (n == 0) {
+      return true;
+    }
+    if (n < 0) {
+      return false;
+    }
+    for (ssize_t written = 0; written < n;) {
+      const auto w = write(out, buffer + written, n - written);
+      if (w < 0) {
+        return false;
+      }
+      written += w;
+    }
+  }
+}
+
+// Copy a single regular file or symlink. Data goes to a temporary sibling
+// that replaces `to` only once it is complete, with mode and mtime carried
+// over so a later sync can tell it is unchanged.
+static bool
+copy_entry(const std::string& from,
+           const struct stat& src,
+           const std::string& to)
+{
+  if (S_ISLNK(src.st_mode)) {
+    const auto target = read_link(from, src.st_size);
+    if (target.empty()) {
+      return false;
+    }
+    unlink(to.c_str());
+    return symlink(target.c_str(), to.c_str()) == 0;
+  }
+
+  const auto path = std::filesystem::path{ to };
+  const auto tmp =
+    (path.parent_path() / ("." + path.filename().string() + ".dk~")).string();
+
+  const int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return false;
+  }
+
+  const int out = open(tmp.c_str(),
+                       O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                       src.st_mode & 07777);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+
+  const struct timespec times[2] = { src.st_atim, src.st_mtim };
+  const bool ok = copy_data(in, out, src.st_size) &&
+                  fchmod(out, src.st_mode & 07777) == 0 &&
+                  futimens(out, times) == 0;
+
+  close(in);
+  close(out);
+
+  if (!ok || rename(tmp.c_str(), to.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+} // namespace details
+
+// Mirror `from` onto `to`. Directories are created up front, then files are
+// checked and copied in parallel; files whose size and mtime (or contents,
+// with `checksum`) already match are skipped. Nothing is deleted from `to`.
+static SyncStats
+sync(const std::filesystem::path& from,
+     const std::filesystem::path& to,
+     const SyncOptions& options = {})
+{
+  namespace fs = std::filesystem;
+
+  auto stats = SyncStats{};
+  auto files = std::vector<std::pair<std::string, std::string>>{};
+  auto ec = std::error_code{};
+
+  if (fs::is_directory(fs::symlink_status(from, ec))) {
+    fs::create_directories(to, ec);
+
+    // A destination inside the source would be copied into itself on every
+    // level, so the walk leaves it out.
+    auto nested_ec = std::error_code{};
+    const auto nested = fs::canonical(to, nested_ec)
+                          .lexically_relative(fs::canonical(from, nested_ec));
+    const auto inner = !nested_ec && !nested.empty() && nested != "." &&
+                           *nested.begin() != ".."
+                         ? (from / nested).lexically_normal()
+                         : fs::path{};
+
+    auto it = fs::recursive_directory_iterator{
+      from, fs::directory_options::skip_permission_denied, ec
+    };
+    for (; !ec && it != fs::recursive_directory_iterator{}; it.increment(ec)) {
+      const auto target = to / it->path().lexically_relative(from);
+
+      if (!inner.empty() && it->path().lexically_normal() == inner) {
+        it.disable_recursion_pending();
+        continue;
+      }
+
+      if (it->is_directory(ec) && !it->is_symlink(ec)) {
+        fs::create_directories(target, ec);
+        if (ec) {
+          dk_err(
+            "Sync: Failed to create {}: {}", target.string(), ec.message());
+          stats.failed += 1;
+          it.disable_recursion_pending();
+          ec.clear();
+        }
+      }
+      else {
+        files.emplace_back(it->path().string(), target.string());
+      }
+    }
+  }
+  else {
+    files.emplace_back(from.string(), to.string());
+  }
+
+  auto copied = std::atomic<size_t>{ 0 };
+  auto skipped = std::atomic<size_t>{ 0 };
+  auto failed = std::atomic<size_t>{ 0 };
+  auto bytes = std::atomic<size_t>{ 0 };
+
+  parallel_for(files.size(), options.jobs, [&](size_t i) {
+    const auto& [src_path, dst_path] = files[i];
+
+    struct stat src;
+    if (lstat(src_path.c_str(), &src) != 0 ||
+        !(S_ISREG(src.st_mode) || S_ISLNK(src.st_mode))) {
+      skipped += 1;
+      return;
+    }
+
+    if (!options.force &&
+        details::up_to_date(src_path, src, dst_path, options.checksum)) {
+      skipped += 1;
+      return;
+    }
+
+    if (!details::copy_entry(src_path, src, dst_path)) {
+      dk_err("Sync: Failed to copy {} to {}: {}",
+             src_path,
+             dst_path,
+             std::strerror(errno));
+      failed += 1;
+      return;
+    }
+
+    copied += 1;
+    bytes += S_ISREG(src.st_mode) ? src.st_size : 0;
+  });
+
+  stats.copied += copied;
+  stats.skipped += skipped;
+  stats.failed += failed;
+  stats.bytes += bytes;
+  return stats;
+}
+
+// sync() without the up to date check. Like cp, a file copied to an existing
+// directory lands inside it under its own name; a directory is still mirrored
+// onto `to`.
+static SyncStats
+copy(const std::filesystem::path& from,
+     const std::filesystem::path& to,
+     SyncOptions options = {})
+{
+  namespace fs = std::filesystem;
+
+  options.force = true;
+
+  auto ec = std::error_code{};
+  if (!fs::is_directory(fs::symlink_status(from, ec)) &&
+      fs::is_directory(to, ec)) {
+    return sync(from, to / from.filename(), options);
+  }
+  return sync(from, to, options);
+}
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <fstream>
+#include <sstream>
+
+TEST_CASE("testing sync")
+{
+  namespace fs = std::filesystem;
+
+  const auto root = fs::temp_directory_path() / "devkit_sync_test";
+  const auto src = root / "src";
+  const auto dst = root / "dst";
+
+  const auto read = [](const fs::path& path) {
+    auto ss = std::stringstream{};
+    ss << std::ifstream{ path }.rdbuf();
+    return ss.str();
+  };
+
+  fs::remove_all(root);
+  fs::create_directories(src / "pkg/include");
+  std::ofstream{ src / "a.txt" } << "alpha";
+  std::ofstream{ src / "pkg/b.txt" } << "beta";
+  std::ofstream{ src / "pkg/include/c.h" } << "#pragma once";
+  fs::create_symlink("a.txt", src / "link");
+
+  SUBCASE("tree")
+  {
+    const auto first = devkit::sync(src, dst);
+    CHECK(first.copied == 4);
+    CHECK(first.skipped == 0);
+    CHECK(first.failed == 0);
+    CHECK(read(dst / "a.txt") == "alpha");
+    CHECK(read(dst / "pkg/include/c.h") == "#pragma once");
+    CHECK(fs::is_symlink(dst / "link"));
+    CHECK(fs::read_symlink(dst / "link") == "a.txt");
+    CHECK(fs::last_write_time(dst / "pkg/b.txt") ==
+          fs::last_write_time(src / "pkg/b.txt"));
+
+    const auto second = devkit::sync(src, dst);
+    CHECK(second.copied == 0);
+    CHECK(second.skipped == 4);
+
+    std::ofstream{ src / "pkg/b.txt" } << "beta2";
+    const auto third = devkit::sync(src, dst, { .jobs = 1 });
+    CHECK(third.copied == 1);
+    CHECK(read(dst / "pkg/b.txt") == "beta2");
+  }
+
+  SUBCASE("checksum")
+  {
+    devkit::sync(src, dst);
+    fs::last_write_time(dst / "a.txt", fs::file_time_type::clock::now());
+
+    CHECK(devkit::sync(src, dst, { .checksum = true }).skipped == 4);
+    CHECK(devkit::sync(src, dst).copied == 1);
+  }
+
+  SUBCASE("nested")
+  {
+    const auto first = devkit::sync(src, src / "backup");
+    CHECK(first.copied == 4);
+    CHECK(first.failed == 0);
+    CHECK(read(src / "backup/pkg/b.txt") == "beta");
+    CHECK(!fs::exists(src / "backup/backup"));
+
+    const auto second = devkit::sync(src, src / "backup");
+    CHECK(second.skipped == 4);
+    CHECK(!fs::exists(src / "backup/backup"));
+  }
+
+  SUBCASE("copy file")
+  {
+    fs::create_directories(dst);
+    const auto stats = devkit::copy(src / "a.txt", dst / "copy.txt");
+    CHECK(stats.copied == 1);
+    CHECK(stats.bytes == 5);
+    CHECK(read(dst / "copy.txt") == "alpha");
+    CHECK(devkit::copy(src / "a.txt", dst / "copy.txt").copied == 1);
+
+    CHECK(devkit::copy(src / "pkg/b.txt", dst).copied == 1);
+    CHECK(read(dst / "b.txt") == "beta");
+  }
+
+  fs::remove_all(root);
+}
+#endif
@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "fmt.hh"
+#include "trace.hh"
 
 namespace devkit
 {
@@ -17,10 +18,10 @@ namespace details
 
 struct TaskArg
 {
-  bool use_shell;
-  bool new_process;
-  bool search_path;
-  const std::string command;
+  bool use_shell = false;
+  bool new_process = false;
+  bool search_path = false;
+  const std::string command = {};
 
   std::vector<std::string>
   tokens() const
@@ -111,10 +112,22 @@ public:
     : arg{ arg }
   {}
 
+  // What a child started for the task runs, e.g. by Process: the shell
+  // with the command, or its tokens.
+  std::vector<std::string>
+  argv() const
+  {
+    if (arg.use_shell) {
+      return { "/bin/sh", "-c", arg.command };
+    }
+    return arg.tokens();
+  }
+
   int
   run() const
   {
     if (arg.use_shell) {
+      dk_trace(arg.command, "task");
       auto status = std::system(arg.command.c_str());
       if (status < 0) {
         dk_err("Task: Error executing system.");
@@ -126,12 +139,16 @@ public:
       }
     }
 
-    auto tokens = arg.tokens();
+    auto tokens = [&] {
+      dk_trace("tokenize");
+      return arg.tokens();
+    }();
     if (tokens.empty()) {
       return 0;
     }
 
     if (arg.new_process) {
+      const auto begin = Trace::now();
       pid_t pid = fork();
 
       switch (pid) {
@@ -152,6 +169,11 @@ public:
             exit(254);
           }
 
+          // The child, from fork to reaped, as a process of its own.
+          if (auto* trace = Trace::instance()) {
+            trace->record(arg.command, "task", begin, Trace::now(), pid);
+          }
+
           if (WIFEXITED(status)) {
             dk_log("Process {} returned {}", pid, WEXITSTATUS(status));
             return WEXITSTATUS(status);
@@ -168,6 +190,10 @@ public:
       }
     }
     else {
+      // exec skips the destructor that would write the trace.
+      if (auto* trace = Trace::instance()) {
+        trace->write();
+      }
       execute(tokens);
     }
     return 0;
@@ -213,6 +239,19 @@ TEST_CASE("testing task")
     CHECK(args[3] == nullptr);
   }
 
+  SUBCASE("argv")
+  {
+    const auto shell = devkit::Task{ { .use_shell = true,
+                                       .search_path = true,
+                                       .command = "echo 'a b' | wc" } };
+    CHECK(shell.argv() ==
+          std::vector<std::string>{ "/bin/sh", "-c", "echo 'a b' | wc" });
+
+    const auto direct = devkit::Task{ { .search_path = true,
+                                        .command = "echo 'a b'" } };
+    CHECK(direct.argv() == std::vector<std::string>{ "echo", "a b" });
+  }
+
   SUBCASE("task without command")
   {
     devkit::details::TaskArg arg{ .new_process = true, .search_path = true };
@@ -238,3 +277,19 @@ TEST_CASE("testing task")
   // }
 }
 #endif
+
+#ifdef DK_BENCH_TASK
+#include "bench.hh"
+
+DK_BENCH_CASE("TaskArg::tokens")
+{
+  const auto arg = devkit::details::TaskArg{
+    .command = "cmake -S . -B 'build dir' -G Ninja "
+               "-DCMAKE_BUILD_TYPE=Release --log-level \"VERBOSE\" "
+               "-DCMAKE_EXPORT_COMPILE_COMMANDS=ON"
+  };
+  for (auto _ : state) {
+    devkit::bench::do_not_optimize(arg.tokens());
+  }
+}
+#endif
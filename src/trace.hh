@@ -0,0 +1,275 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "defer.hh"
+#include "fmt.hh"
+#include "json.hh"
+
+// Scoped span, recorded from here to the end of the enclosing scope when
+// tracing is on. Compiled out entirely with DK_TRACE_DISABLE.
+#ifdef DK_TRACE_DISABLE
+#define dk_trace(...) static_cast<void>(0)
+#else
+#define dk_trace(...)                                                          \
+  const auto DEFER_TOKEN(__COUNTER__) =                                        \
+    ::devkit::details::Deferer{} << ::devkit::details::trace_span(__VA_ARGS__)
+#endif
+
+namespace devkit
+{
+
+// Spans in the Chrome trace event format, for chrome://tracing or Perfetto.
+// The process wide instance exists when SK_TRACE names an output file and
+// writes it when the process exits; forked children never write it.
+class Trace
+{
+public:
+  struct Span
+  {
+    std::string name;
+    std::string category;
+    int64_t begin; // microseconds
+    int64_t end;
+    int pid;
+    int tid;
+  };
+
+  // A sample of named values, drawn as a graph over time.
+  struct Counter
+  {
+    std::string name;
+    int64_t time;
+    std::vector<std::pair<std::string, int64_t>> values;
+  };
+
+private:
+  std::string path;
+  int owner;
+  std::mutex mutex;
+  std::vector<Span> spans;
+  std::vector<Counter> counters;
+
+public:
+  explicit Trace(std::string path)
+    : path{ std::move(path) }
+    , owner{ getpid() }
+  {}
+
+  Trace(const Trace&) = delete;
+  Trace&
+  operator=(const Trace&) = delete;
+
+  ~Trace()
+  {
+    write();
+  }
+
+  static Trace*
+  instance()
+  {
+    static auto trace = []() -> std::unique_ptr<Trace> {
+      const char* path = std::getenv("SK_TRACE");
+      if (path == nullptr || *path == '\0') {
+        return nullptr;
+      }
+      return std::make_unique<Trace>(path);
+    }();
+    return trace.get();
+  }
+
+  static int64_t
+  now()
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+  }
+
+  // Child processes pass their own pid, so they show up as processes of
+  // their own.
+  void
+  record(std::string_view name,
+         std::string_view category,
+         int64_t begin,
+         int64_t end,
+         int pid = 0)
+  {
+    const auto lock = std::lock_guard{ mutex };
+    spans.push_back({ std::string{ name },
+                      std::string{ category },
+                      begin,
+                      end,
+                      pid != 0 ? pid : getpid(),
+                      pid != 0 ? pid : gettid() });
+  }
+
+  void
+  counter(std::string_view name,
+          std::vector<std::pair<std::string, int64_t>> values)
+  {
+    const auto lock = std::lock_guard{ mutex };
+    counters.push_back({ std::string{ name }, now(), std::move(values) });
+  }
+
+  // Writes every span recorded so far, e.g. right before exec replaces the
+  // process and the destructor never runs.
+  bool
+  write()
+  {
+    if (getpid() != owner) {
+      return false;
+    }
+
+    auto json = std::string{ "{\"traceEvents\":[" };
+    {
+      const auto lock = std::lock_guard{ mutex };
+      for (size_t i = 0; i < spans.size(); ++i) {
+        const auto& span = spans[i];
+        json += i == 0 ? "\n" : ",\n";
+        json += "{\"name\":\"";
+        details::escape_json(json, span.name);
+        json += "\",\"cat\":\"";
+        details::escape_json(json, span.category);
+        json += dk_fmt(R"(","ph":"X","ts":{},"dur":{},"pid":{},"tid":{}}})",
+                       span.begin,
+                       span.end - span.begin,
+                       span.pid,
+                       span.tid);
+      }
+      for (const auto& counter : counters) {
+        json += spans.empty() && &counter == &counters.front() ? "\n" : ",\n";
+        json += "{\"name\":\"";
+        details::escape_json(json, counter.name);
+        json += dk_fmt(R"(","ph":"C","ts":{},"pid":{},"args":{{)",
+                       counter.time,
+                       owner);
+        for (const auto& [key, value] : counter.values) {
+          json += dk_fmt("{}\"{}\":{}",
+                         &key == &counter.values.front().first ? "" : ",",
+                         key,
+                         value);
+        }
+        json += "}}";
+      }
+    }
+    json += "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    auto* file = std::fopen(path.c_str(), "w");
+    if (file == nullptr) {
+      dk_err("Trace: Cannot write {}.", path);
+      return false;
+    }
+    std::fwrite(json.data(), 1, json.size(), file);
+    std::fclose(file);
+    return true;
+  }
+};
+
+namespace details
+{
+
+// The deferred end of a dk_trace span. Without a trace it only checks a
+// pointer, the name is not even copied.
+static auto
+trace_span(std::string_view name, std::string_view category = "sk")
+{
+  auto* trace = Trace::instance();
+  return [trace,
+          begin = trace != nullptr ? Trace::now() : 0,
+          name = trace != nullptr ? std::string{ name } : std::string{},
+          category = trace != nullptr ? std::string{ category }
+                                      : std::string{}]() {
+    if (trace != nullptr) {
+      trace->record(name, category, begin, Trace::now());
+    }
+  };
+}
+
+} // namespace details
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+TEST_CASE("testing trace")
+{
+  const auto path =
+    std::filesystem::temp_directory_path() / "devkit_trace_test.json";
+  std::filesystem::remove(path);
+
+  const auto read = [&] {
+    auto ss = std::stringstream{};
+    ss << std::ifstream{ path }.rdbuf();
+    return ss.str();
+  };
+
+  SUBCASE("record")
+  {
+    auto trace = devkit::Trace{ path.string() };
+    trace.record("say \"hi\"", "task", 10, 25, 4242);
+    REQUIRE(trace.write());
+
+    const auto json = read();
+    CHECK(json.find(R"("name":"say \"hi\"","cat":"task","ph":"X")") !=
+          std::string::npos);
+    CHECK(json.find(R"("ts":10,"dur":15,"pid":4242,"tid":4242)") !=
+          std::string::npos);
+
+    auto reader = devkit::JsonReader{ json };
+    CHECK(reader.skip());
+  }
+
+  SUBCASE("counter")
+  {
+    auto trace = devkit::Trace{ path.string() };
+    trace.counter("memory", { { "in_use", 10 }, { "peak", 20 } });
+    REQUIRE(trace.write());
+
+    const auto json = read();
+    CHECK(json.find(R"("name":"memory","ph":"C")") != std::string::npos);
+    CHECK(json.find(R"("args":{"in_use":10,"peak":20}})") !=
+          std::string::npos);
+
+    auto reader = devkit::JsonReader{ json };
+    CHECK(reader.skip());
+  }
+
+  SUBCASE("spans")
+  {
+    setenv("SK_TRACE", path.c_str(), 1);
+    auto* trace = devkit::Trace::instance();
+    REQUIRE(trace != nullptr);
+
+    {
+      dk_trace("outer");
+      {
+        dk_trace("inner", "test");
+      }
+    }
+    REQUIRE(trace->write());
+
+    const auto json = read();
+    const auto inner = json.find(R"("name":"inner","cat":"test")");
+    const auto outer = json.find(R"("name":"outer","cat":"sk")");
+    CHECK(inner != std::string::npos);
+    CHECK(outer != std::string::npos);
+    CHECK(inner < outer);
+  }
+}
+#endif
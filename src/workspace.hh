@@ -0,0 +1,598 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <tuple>
+#include <vector>
+
+#include "cache.hh"
+#include "fmt.hh"
+#include "mmap.hh"
+#include "parallel.hh"
+
+namespace devkit
+{
+
+struct Package
+{
+  std::string name;
+  std::string path; // directory holding package.xml
+  std::string version;
+  std::string build_type;
+  std::vector<std::string> build_depends;
+  std::vector<std::string> exec_depends;
+  std::vector<std::string> test_depends;
+
+  // Filled in by Workspace: dependencies on other packages of the workspace,
+  // and the wave the package can be built in. Every package only depends on
+  // packages of lower levels, so a whole level can be built in parallel.
+  std::vector<std::string> depends;
+  size_t level = 0;
+};
+
+namespace details
+{
+
+static void
+add_unique(std::vector<std::string>& list, std::string_view name)
+{
+  if (!name.empty() &&
+      std::find(list.begin(), list.end(), name) == list.end()) {
+    list.emplace_back(name);
+  }
+}
+
+// Just enough of XML for package.xml (formats 1 to 3): comments and
+// processing instructions are skipped, attributes (including `condition`)
+// are ignored, and the text of the interesting elements is trimmed.
+static Package
+parse_package_xml(std::string_view xml)
+{
+  auto package = Package{};
+
+  const auto trim = [](std::string_view s) {
+    const auto begin = s.find_first_not_of(" \t\r\n");
+    if (begin == std::string_view::npos) {
+      return std::string_view{};
+    }
+    return s.substr(begin, s.find_last_not_of(" \t\r\n") - begin + 1);
+  };
+
+  for (size_t pos = xml.find('<'); pos != std::string_view::npos;
+       pos = xml.find('<', pos)) {
+    const auto rest = xml.substr(pos);
+
+    if (rest.starts_with("<!--")) {
+      const auto end = xml.find("-->", pos + 4);
+      pos = end == std::string_view::npos ? xml.size() : end + 3;
+      continue;
+    }
+    if (rest.starts_with("<?") || rest.starts_with("</") ||
+        rest.starts_with("<!")) {
+      pos += 1;
+      continue;
+    }
+
+    const auto close = xml.find('>', pos);
+    if (close == std::string_view::npos) {
+      break;
+    }
+
+    const auto tag = xml.substr(pos + 1, close - pos - 1);
+    pos = close + 1;
+    if (tag.ends_with('/')) {
+      continue;
+    }
+
+    const auto name = tag.substr(0, tag.find_first_of(" \t\r\n"));
+    const auto text = trim(xml.substr(pos, xml.find('<', pos) - pos));
+
+    if (name == "name") {
+      package.name = text;
+    }
+    else if (name == "version") {
+      package.version = text;
+    }
+    else if (name == "build_type") {
+      package.build_type = text;
+    }
+    else if (name == "depend") {
+      add_unique(package.build_depends, text);
+      add_unique(package.exec_depends, text);
+    }
+    else if (name == "build_depend" || name == "buildtool_depend" ||
+             name == "build_export_depend" ||
+             name == "buildtool_export_depend") {
+      add_unique(package.build_depends, text);
+    }
+    else if (name == "exec_depend" || name == "run_depend") {
+      add_unique(package.exec_depends, text);
+    }
+    else if (name == "test_depend") {
+      add_unique(package.test_depends, text);
+    }
+  }
+
+  return package;
+}
+
+static std::string
+join_names(const std::vector<std::string>& names)
+{
+  auto joined = std::string{};
+  for (const auto& name : names) {
+    if (!joined.empty()) {
+      joined += ',';
+    }
+    joined += name;
+  }
+  return joined;
+}
+
+static std::vector<std::string>
+split_names(std::string_view joined)
+{
+  auto names = std::vector<std::string>{};
+  while (!joined.empty()) {
+    const auto comma = joined.find(',');
+    names.emplace_back(joined.substr(0, comma));
+    joined = comma == std::string_view::npos ? std::string_view{}
+                                             : joined.substr(comma + 1);
+  }
+  return names;
+}
+
+static std::filesystem::path
+canonical_root(const std::filesystem::path& root)
+{
+  auto ec = std::error_code{};
+  auto canonical = std::filesystem::weakly_canonical(root, ec);
+  return ec ? std::filesystem::absolute(root, ec) : canonical;
+}
+
+} // namespace details
+
+// Finds every package.xml below a root, the way colcon does: the search
+// stops at a package, and skips hidden directories, directories marked with
+// COLCON_IGNORE / AMENT_IGNORE / CATKIN_IGNORE, and the build, install and
+// log spaces at the top. Parsed manifests are cached by mtime, so rescanning
+// an unchanged workspace only costs the directory walk.
+class Workspace
+{
+private:
+  struct Entry
+  {
+    std::string manifest;
+    struct timespec mtime;
+    Package package;
+  };
+
+  std::filesystem::path root;
+  std::vector<Entry> entries;
+  bool cyclic = false;
+
+  static bool
+  skip_dir(const std::filesystem::path& dir, bool top)
+  {
+    namespace fs = std::filesystem;
+
+    const auto name = dir.filename().string();
+    if (name.starts_with('.')) {
+      return true;
+    }
+    if (top && (name == "build" || name == "install" || name == "log" ||
+                name == "_build" || name == "_install")) {
+      return true;
+    }
+
+    auto ec = std::error_code{};
+    for (const auto* marker :
+         { "COLCON_IGNORE", "AMENT_IGNORE", "CATKIN_IGNORE" }) {
+      if (fs::exists(dir / marker, ec)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void
+  discover()
+  {
+    namespace fs = std::filesystem;
+
+    // a package right at the root is the whole workspace
+    struct stat st;
+    if (const auto manifest = root / "package.xml";
+        stat(manifest.c_str(), &st) == 0) {
+      entries.push_back({ manifest.string(), st.st_mtim, {} });
+      return;
+    }
+
+    auto ec = std::error_code{};
+    auto it = fs::recursive_directory_iterator{
+      root, fs::directory_options::skip_permission_denied, ec
+    };
+
+    for (; !ec && it != fs::recursive_directory_iterator{}; it.increment(ec)) {
+      if (!it->is_directory(ec) || it->is_symlink(ec)) {
+        continue;
+      }
+
+      const auto& dir = it->path();
+      if (skip_dir(dir, it.depth() == 0)) {
+        it.disable_recursion_pending();
+        continue;
+      }
+
+      const auto manifest = dir / "package.xml";
+      if (stat(manifest.c_str(), &st) == 0) {
+        entries.push_back({ manifest.string(), st.st_mtim, {} });
+        it.disable_recursion_pending();
+      }
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+      return a.manifest < b.manifest;
+    });
+  }
+
+  std::string
+  cache_key() const
+  {
+    return "workspace " + root.string();
+  }
+
+  // Reuse cached packages whose manifest has the same mtime; returns the
+  // indices that still need parsing.
+  std::vector<size_t>
+  load(const Cache* cache)
+  {
+    auto stale = std::vector<size_t>{};
+    auto cached = std::map<std::string, Entry>{};
+
+    if (cache != nullptr) {
+      auto ss = std::istringstream{ cache->get(cache_key()).value_or("") };
+      for (std::string line; std::getline(ss, line);) {
+        auto fields = std::vector<std::string>{};
+        for (size_t pos = 0; pos <= line.size();) {
+          auto tab = line.find('\t', pos);
+          if (tab == std::string::npos) {
+            tab = line.size();
+          }
+          fields.push_back(line.substr(pos, tab - pos));
+          pos = tab + 1;
+        }
+        if (fields.size() != 10) {
+          continue;
+        }
+
+        auto entry = Entry{};
+        entry.manifest = fields[0];
+        entry.mtime.tv_sec = std::strtoll(fields[1].c_str(), nullptr, 10);
+        entry.mtime.tv_nsec = std::strtol(fields[2].c_str(), nullptr, 10);
+        entry.package.name = fields[3];
+        entry.package.path = fields[4];
+        entry.package.version = fields[5];
+        entry.package.build_type = fields[6];
+        entry.package.build_depends = details::split_names(fields[7]);
+        entry.package.exec_depends = details::split_names(fields[8]);
+        entry.package.test_depends = details::split_names(fields[9]);
+        cached.emplace(entry.manifest, std::move(entry));
+      }
+    }
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const auto found = cached.find(entries[i].manifest);
+      if (found != cached.end() &&
+          found->second.mtime.tv_sec == entries[i].mtime.tv_sec &&
+          found->second.mtime.tv_nsec == entries[i].mtime.tv_nsec) {
+        entries[i].package = std::move(found->second.package);
+      }
+      else {
+        stale.push_back(i);
+      }
+    }
+
+    return stale;
+  }
+
+  void
+  save(const Cache* cache) const
+  {
+    if (cache == nullptr) {
+      return;
+    }
+
+    auto value = std::string{};
+    for (const auto& entry : entries) {
+      const auto& package = entry.package;
+      value += dk_fmt("{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\n",
+                      entry.manifest,
+                      entry.mtime.tv_sec,
+                      entry.mtime.tv_nsec,
+                      package.name,
+                      package.path,
+                      package.version,
+                      package.build_type,
+                      details::join_names(package.build_depends),
+                      details::join_names(package.exec_depends),
+                      details::join_names(package.test_depends));
+    }
+    cache->put(cache_key(), value);
+  }
+
+  // Kahn's algorithm by waves over build and exec dependencies inside the
+  // workspace; test dependencies are left out as they commonly form cycles.
+  void
+  order()
+  {
+    auto index = std::map<std::string, size_t>{};
+    for (size_t i = 0; i < entries.size(); ++i) {
+      index.emplace(entries[i].package.name, i);
+    }
+
+    auto pending = std::vector<size_t>(entries.size(), 0);
+    auto dependents = std::vector<std::vector<size_t>>(entries.size());
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+      auto& package = entries[i].package;
+      package.depends.clear();
+
+      for (const auto* list :
+           { &package.build_depends, &package.exec_depends }) {
+        for (const auto& dep : *list) {
+          const auto found = index.find(dep);
+          if (found == index.end() || found->second == i ||
+              std::find(package.depends.begin(),
+                        package.depends.end(),
+                        dep) != package.depends.end()) {
+            continue;
+          }
+          package.depends.push_back(dep);
+          dependents[found->second].push_back(i);
+          pending[i] += 1;
+        }
+      }
+    }
+
+    auto wave = std::vector<size_t>{};
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (pending[i] == 0) {
+        wave.push_back(i);
+      }
+    }
+
+    size_t level = 0;
+    size_t placed = 0;
+    auto done = std::vector<bool>(entries.size(), false);
+
+    while (!wave.empty()) {
+      auto next = std::vector<size_t>{};
+      for (const auto i : wave) {
+        entries[i].package.level = level;
+        done[i] = true;
+        placed += 1;
+        for (const auto d : dependents[i]) {
+          if ((pending[d] -= 1) == 0) {
+            next.push_back(d);
+          }
+        }
+      }
+      wave = std::move(next);
+      level += 1;
+    }
+
+    cyclic = placed != entries.size();
+    if (cyclic) {
+      for (size_t i = 0; i < entries.size(); ++i) {
+        if (!done[i]) {
+          dk_err("Workspace: {} is part of a dependency cycle.",
+                 entries[i].package.name);
+          entries[i].package.level = level;
+        }
+      }
+    }
+
+    std::stable_sort(
+      entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+        return std::tie(a.package.level, a.package.name) <
+               std::tie(b.package.level, b.package.name);
+      });
+  }
+
+public:
+  // `root` is made absolute and canonical, so the cache entry and the package
+  // paths are the same however it is spelled.
+  explicit Workspace(const std::filesystem::path& root,
+                     const Cache* cache = nullptr)
+    : root{ details::canonical_root(root) }
+  {
+    discover();
+
+    const auto stale = load(cache);
+    parallel_for(stale.size(), 0, [&](size_t i) {
+      auto& entry = entries[stale[i]];
+      const auto file = MappedFile{ entry.manifest };
+      entry.package = details::parse_package_xml(file.view());
+      entry.package.path =
+        std::filesystem::path{ entry.manifest }.parent_path().string();
+    });
+
+    if (!stale.empty()) {
+      save(cache);
+    }
+
+    order();
+  }
+
+  // True when some packages could not be ordered; they are put in one last
+  // level of their own.
+  bool
+  has_cycle() const
+  {
+    return cyclic;
+  }
+
+  // Packages in build order: by level, then by name.
+  std::vector<Package>
+  packages() const
+  {
+    auto list = std::vector<Package>{};
+    list.reserve(entries.size());
+    for (const auto& entry : entries) {
+      list.push_back(entry.package);
+    }
+    return list;
+  }
+
+  // Names grouped by level, ready to be handed to parallel workers.
+  std::vector<std::vector<std::string>>
+  levels() const
+  {
+    auto waves = std::vector<std::vector<std::string>>{};
+    for (const auto& entry : entries) {
+      if (waves.size() <= entry.package.level) {
+        waves.resize(entry.package.level + 1);
+      }
+      waves[entry.package.level].push_back(entry.package.name);
+    }
+    return waves;
+  }
+};
+
+} // namespace devkit
+
+#ifndef DOCTEST_CONFIG_DISABLE
+#include <doctest/doctest.h>
+
+#include <fstream>
+
+TEST_CASE("testing workspace")
+{
+  namespace fs = std::filesystem;
+
+  const auto root = fs::temp_directory_path() / "devkit_workspace_test";
+  fs::remove_all(root);
+
+  const auto write_package = [&](const fs::path& dir,
+                                 const std::string& name,
+                                 const std::string& deps) {
+    fs::create_directories(root / dir);
+    std::ofstream{ root / dir / "package.xml" }
+      << "<?xml version=\"1.0\"?>\n<package format=\"3\">\n  <name>" << name
+      << "</name>\n  <version>1.0.0</version>\n" << deps
+      << "  <export>\n    <build_type>ament_cmake</build_type>\n  </export>\n"
+         "</package>\n";
+  };
+
+  write_package(
+    "src/msgs", "msgs", "  <buildtool_depend>ament_cmake</buildtool_depend>\n");
+  write_package(
+    "src/core", "core", "  <depend>msgs</depend>\n  <depend>rclcpp</depend>\n");
+  write_package("src/publisher",
+                "publisher",
+                "  <build_depend>core</build_depend>\n"
+                "  <!-- <build_depend>subscriber</build_depend> -->\n"
+                "  <test_depend>subscriber</test_depend>\n");
+  write_package("src/subscriber",
+                "subscriber",
+                "  <exec_depend condition=\"$ROS_VERSION == 2\">msgs"
+                "</exec_depend>\n");
+  write_package("src/ignored/pkg", "ignored", "");
+  std::ofstream{ root / "src/ignored/COLCON_IGNORE" };
+  write_package("install/share/msgs", "msgs", "");
+
+  SUBCASE("parse")
+  {
+    const auto package = devkit::details::parse_package_xml(R"(
+      <package format="2">
+        <name> talker </name>
+        <!-- <depend>commented</depend> -->
+        <depend>rclcpp</depend>
+        <build_depend>std_msgs</build_depend>
+        <run_depend>roscpp</run_depend>
+        <empty_depend/>
+      </package>)");
+
+    CHECK(package.name == "talker");
+    CHECK(package.build_depends ==
+          std::vector<std::string>{ "rclcpp", "std_msgs" });
+    CHECK(package.exec_depends ==
+          std::vector<std::string>{ "rclcpp", "roscpp" });
+  }
+
+  SUBCASE("order")
+  {
+    const auto ws = devkit::Workspace{ root };
+    const auto packages = ws.packages();
+
+    REQUIRE(packages.size() == 4);
+    CHECK(!ws.has_cycle());
+    CHECK(packages[0].name == "msgs");
+    CHECK(packages[0].level == 0);
+    CHECK(packages[0].build_type == "ament_cmake");
+    CHECK(packages[1].name == "core");
+    CHECK(packages[1].depends == std::vector<std::string>{ "msgs" });
+    CHECK(packages[2].name == "subscriber");
+    CHECK(packages[2].level == 1);
+    CHECK(packages[3].name == "publisher");
+    CHECK(packages[3].level == 2);
+    CHECK(packages[3].path == (root / "src/publisher").string());
+
+    const auto levels = ws.levels();
+    REQUIRE(levels.size() == 3);
+    CHECK(levels[1] == std::vector<std::string>{ "core", "subscriber" });
+  }
+
+  SUBCASE("cache")
+  {
+    const auto cache = devkit::Cache{ root / "cache" };
+
+    const auto first = devkit::Workspace{ root, &cache }.packages();
+    CHECK(cache.get("workspace " + root.string()).has_value());
+
+    const auto second = devkit::Workspace{ root, &cache }.packages();
+    REQUIRE(second.size() == first.size());
+    for (size_t i = 0; i < first.size(); ++i) {
+      CHECK(second[i].name == first[i].name);
+      CHECK(second[i].depends == first[i].depends);
+      CHECK(second[i].level == first[i].level);
+    }
+
+    // an unchanged mtime means the manifest is not read again
+    const auto manifest = root / "src/subscriber/package.xml";
+    const auto mtime = fs::last_write_time(manifest);
+    write_package("src/subscriber", "renamed", "");
+    fs::last_write_time(manifest, mtime);
+    CHECK(devkit::Workspace{ root, &cache }.packages()[2].name == "subscriber");
+
+    fs::last_write_time(manifest, mtime + std::chrono::seconds{ 1 });
+    CHECK(devkit::Workspace{ root, &cache }.packages()[1].name == "renamed");
+
+    // the same entry and paths however the root is spelled
+    const auto renamed = fs::last_write_time(manifest);
+    write_package("src/subscriber", "again", "");
+    fs::last_write_time(manifest, renamed);
+    const auto spelled = devkit::Workspace{ root / "src/../", &cache };
+    CHECK(spelled.packages()[1].name == "renamed");
+    CHECK(spelled.packages()[3].path == (root / "src/publisher").string());
+  }
+
+  SUBCASE("cycle")
+  {
+    write_package("src/msgs", "msgs", "  <depend>publisher</depend>\n");
+
+    const auto ws = devkit::Workspace{ root };
+    CHECK(ws.has_cycle());
+    CHECK(ws.packages().size() == 4);
+  }
+
+  fs::remove_all(root);
+}
+#endif
@@ -1,19 +1,36 @@
 #!/usr/bin/env python
 
 import os
+import re
 import sys
 
 if __name__ == '__main__':
-    template = '''
+    args = sys.argv[1:]
+    bench = '--bench' in args
+    if bench:
+        args.remove('--bench')
+
+    input = args[0].removeprefix('./src/')
+    output = args[1]
+
+    if bench:
+        # Only the header under test compiles its benches, not the ones it
+        # includes: lua_actor.hh must not rerun those of lua.hh.
+        name = re.sub(r'\W', '_', input.split('/')[-1].split('.')[0]).upper()
+        template = f'''
+#define DOCTEST_CONFIG_DISABLE
+#define DK_BENCH_{name}
+#define DK_BENCH_IMPLEMENT_WITH_MAIN
+#include "bench.hh"
+'''
+    else:
+        template = '''
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
 '''
 
-    input = sys.argv[1].removeprefix('./src/')
-    output = sys.argv[2]
-
     template += f'\n#include "{input}"'
 
     with open(output, 'w') as f:
         f.write(template)
-        print(f'generate test for {input}')
+        print(f'generate {"bench" if bench else "test"} for {input}')